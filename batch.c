@@ -0,0 +1,350 @@
+/* batch.c
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "xutil.h"
+#include "log.h"
+#include "defs.h"
+
+/*
+ * Many guests in one run.
+ *
+ * --batch FILE lists one guest per line: a libvirt domain or QMP socket,
+ * its System.map and optionally an output file.  The state of a guest
+ * (translation, symbols, layout, output) is process wide, so each guest
+ * is collected by a worker process forked from here, at most pc->jobs at
+ * a time.  The guests are started in System.map order and each map is
+ * parsed once, before the first of its workers is forked: the workers
+ * inherit the table and symtab_init() keeps it.  A worker writes its
+ * messages, and its log unless it has an output file, to a pipe whose
+ * lines are printed here prefixed with the guest.  The pipe also tells
+ * when a worker is done, as it stays open until the worker exits.
+ */
+#define BATCH_MAX_WORKERS   (64)
+#define BATCH_LINE_MAX      (4096)
+
+struct batch_job {
+    struct batch_guest g;           /* lines are prefixed if g.out is NULL */
+    pid_t pid;
+    int fd;                         /* read end of the worker's pipe */
+    char *line;                     /* partial output line */
+    size_t line_len;
+};
+
+/* the guests of a --batch file, also used by --daemon */
+int batch_parse(const char *config, struct batch_guest **guests)
+{
+    struct batch_guest *g = NULL;
+    char line[BATCH_LINE_MAX];
+    char *guest, *map, *out;
+    int nr = 0, max = 0, lineno = 0;
+    FILE *file;
+
+    if (!(file = fopen(config, "r"))) {
+        pr_err("Cannot open batch file %s", config);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+        lineno++;
+        if (!(guest = strtok(line, " \t\r\n")) || guest[0] == '#')
+            continue;
+        if (!(map = strtok(NULL, " \t\r\n"))) {
+            pr_err("%s:%d: expected GUEST SYSTEM.MAP [OUTPUT]", config, lineno);
+            goto err;
+        }
+        out = strtok(NULL, " \t\r\n");
+
+        if (nr == max) {
+            max = max ? max * 2 : 64;
+            g = xrealloc(g, max * sizeof(*g));
+        }
+        g[nr].guest = xstrdup(guest);
+        g[nr].map = xstrdup(map);
+        g[nr].out = out ? xstrdup(out) : NULL;
+        nr++;
+    }
+    fclose(file);
+
+    if (!nr) {
+        pr_err("No guests in batch file %s", config);
+        xfree(g);
+        return -1;
+    }
+
+    *guests = g;
+    return nr;
+
+err:
+    fclose(file);
+    batch_free(g, nr);
+    return -1;
+}
+
+void batch_free(struct batch_guest *guests, int nr)
+{
+    int i;
+
+    for (i = 0; i < nr; i++) {
+        xfree(guests[i].guest);
+        xfree(guests[i].map);
+        xfree(guests[i].out);
+    }
+    xfree(guests);
+}
+
+static int batch_map_cmp(const void *a, const void *b)
+{
+    return strcmp(((const struct batch_job *)a)->g.map,
+            ((const struct batch_job *)b)->g.map);
+}
+
+/* print the complete lines of a worker's output, prefixed with its guest */
+static void batch_emit(struct batch_job *j, const char *buf, size_t len,
+        int eof)
+{
+    const char *p = buf, *end = buf + len, *nl;
+
+    while (p < end) {
+        if (!(nl = memchr(p, '\n', end - p))) {
+            j->line = xrealloc(j->line, j->line_len + (end - p));
+            memcpy(j->line + j->line_len, p, end - p);
+            j->line_len += end - p;
+            break;
+        }
+        fprintf(fp, "%s: %.*s%.*s\n", j->g.guest, (int)j->line_len,
+                j->line ? j->line : "", (int)(nl - p), p);
+        j->line_len = 0;
+        p = nl + 1;
+    }
+
+    if (eof && j->line_len) {
+        fprintf(fp, "%s: %.*s\n", j->g.guest, (int)j->line_len, j->line);
+        j->line_len = 0;
+    }
+}
+
+/*
+ * Fork the worker for j.  Returns 1 in the worker, 0 in the parent.
+ */
+static int batch_start(struct batch_job *j)
+{
+    int pipefd[2], out;
+
+    if (pipe(pipefd)) {
+        pr_err("Cannot create a pipe for %s", j->g.guest);
+        return -1;
+    }
+
+    /* nothing buffered may be written twice */
+    fflush(fp);
+    fflush(stderr);
+
+    if ((j->pid = fork()) == -1) {
+        pr_err("Cannot fork a worker for %s", j->g.guest);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return -1;
+    }
+
+    if (!j->pid) {
+        close(pipefd[0]);
+        if (j->g.out) {
+            if ((out = open(j->g.out, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+                pr_err("Cannot create %s", j->g.out);
+                _exit(1);
+            }
+            dup2(out, STDOUT_FILENO);
+            close(out);
+        } else {
+            dup2(pipefd[1], STDOUT_FILENO);
+        }
+        dup2(pipefd[1], STDERR_FILENO);
+        close(pipefd[1]);
+        return 1;
+    }
+
+    close(pipefd[1]);
+    j->fd = pipefd[0];
+    return 0;
+}
+
+static int batch_finish(struct batch_job *j)
+{
+    int status;
+
+    batch_emit(j, NULL, 0, TRUE);
+    close(j->fd);
+    j->fd = -1;
+
+    while (waitpid(j->pid, &status, 0) == -1 && errno == EINTR)
+        ;
+
+    if (WIFEXITED(status) && !WEXITSTATUS(status))
+        return 0;
+
+    if (WIFEXITED(status))
+        pr_err("%s: failed with status %d", j->g.guest, WEXITSTATUS(status));
+    else
+        pr_err("%s: killed by signal %d", j->g.guest, WTERMSIG(status));
+    return -1;
+}
+
+static nfds_t batch_workers(int nr)
+{
+    long workers = pc->jobs;
+
+    if (!workers) {
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+        if (workers > 8)
+            workers = 8;
+    }
+    if (workers > nr)
+        workers = nr;
+    if (workers > BATCH_MAX_WORKERS)
+        workers = BATCH_MAX_WORKERS;
+
+    return workers < 1 ? 1 : workers;
+}
+
+/*
+ * Run the batch.  Returns 1 in a worker, with *guest and *map set to the
+ * guest it collects; 0 in the parent once every worker succeeded, -1 if
+ * any failed.
+ */
+int batch_run(const char *config, char **guest, char **map)
+{
+    struct batch_job *jobs, **running;
+    struct batch_guest *guests;
+    struct pollfd *pfd;
+    char buf[65536];
+    const char *loaded = NULL;
+    struct stat st_map;
+    nfds_t nr_running = 0, max;
+    int nr, next = 0, failed = 0, i, ret;
+    ssize_t n;
+
+    if (pc->follow || pc->cursor || pc->save || pc->load) {
+        pr_warning("--follow, --cursor, --save and --load take one guest, "
+                "ignored with --batch");
+        pc->follow = FALSE;
+        pc->cursor = NULL;
+        pc->save = NULL;
+        pc->load = NULL;
+    }
+
+    if ((nr = batch_parse(config, &guests)) < 0)
+        return -1;
+
+    jobs = xcalloc(nr, sizeof(*jobs));
+    for (i = 0; i < nr; i++) {
+        jobs[i].g = guests[i];
+        jobs[i].fd = -1;
+    }
+    xfree(guests);
+
+    qsort(jobs, nr, sizeof(*jobs), batch_map_cmp);
+    max = batch_workers(nr);
+    running = xmalloc(max * sizeof(*running));
+    pfd = xmalloc(max * sizeof(*pfd));
+
+    if (KDEBUG(1))
+        pr_debug("batch: %d guests, %lu workers", nr, (ulong)max);
+
+    while (next < nr || nr_running) {
+        while (next < nr && nr_running < max) {
+            struct batch_job *j = &jobs[next++];
+
+            /* a map that cannot be read is reported by its worker */
+            if ((!loaded || strcmp(loaded, j->g.map)) &&
+                    !stat(j->g.map, &st_map) && S_ISREG(st_map.st_mode)) {
+                symtab_init(j->g.map);
+                loaded = j->g.map;
+            }
+
+            if ((ret = batch_start(j)) == 1) {
+                /* the other workers' output is none of its business */
+                for (i = 0; i < (int)nr_running; i++)
+                    close(running[i]->fd);
+                *guest = j->g.guest;
+                *map = j->g.map;
+                /* the pool already uses the CPUs */
+                pc->jobs = 1;
+                return 1;
+            }
+            if (ret) {
+                failed++;
+                continue;
+            }
+            running[nr_running++] = j;
+        }
+        if (!nr_running)
+            break;
+
+        for (i = 0; i < (int)nr_running; i++) {
+            pfd[i].fd = running[i]->fd;
+            pfd[i].events = POLLIN;
+        }
+        if (poll(pfd, nr_running, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            pr_err("poll failed");
+            /* the workers exit on EPIPE, none is left behind */
+            while (nr_running) {
+                batch_finish(running[--nr_running]);
+                failed++;
+            }
+            failed += nr - next;
+            break;
+        }
+
+        for (i = (int)nr_running - 1; i >= 0; i--) {
+            if (!pfd[i].revents)
+                continue;
+
+            n = read(running[i]->fd, buf, sizeof(buf));
+            if (n > 0) {
+                batch_emit(running[i], buf, n, FALSE);
+                continue;
+            }
+            if (n == -1 && errno == EINTR)
+                continue;
+
+            if (batch_finish(running[i]))
+                failed++;
+            running[i] = running[--nr_running];
+        }
+    }
+    fflush(fp);
+
+    for (i = 0; i < nr; i++) {
+        xfree(jobs[i].g.guest);
+        xfree(jobs[i].g.map);
+        xfree(jobs[i].g.out);
+        xfree(jobs[i].line);
+    }
+    xfree(jobs);
+    xfree(running);
+    xfree(pfd);
+
+    return failed ? -1 : 0;
+}
@@ -0,0 +1,288 @@
+/* cache.c
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "xutil.h"
+#include "log.h"
+#include "defs.h"
+#include "client.h"
+#include "session.h"
+
+/*
+ * Per-guest session cache.
+ *
+ * The KASLR offset, phys_base, page_offset_base, the log buffer pointer
+ * and the SIZE/OFFSET tables only change when the guest reboots, yet
+ * computing them costs a register query, an IDT read, a page walk and
+ * the vmcoreinfo parse.  They are saved here after a full init and
+ * trusted on the next run if the log buffer pointer, read through the
+ * cached translation, still holds the cached value.  A reboot moves the
+ * kernel (KASLR) or reallocates the buffer, so any mismatch falls back
+ * to the full init.
+ *
+ * The cache also keeps the word that grows with every message (head_id,
+ * log_next_seq or log_end) as the last full run saw it.  --probe reads
+ * only that word, through the cached translation, and stops right there
+ * if it did not change.
+ */
+#define SESSION_CACHE_MAGIC    (0x434d444b)    /* "KDMC" */
+#define SESSION_CACHE_VERSION  (2)
+
+struct session_cache {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t tables_size;
+    uint32_t pad;
+
+    /* System.map identity */
+    uint64_t map_size;
+    int64_t map_mtime;
+
+    ulong kt_flags;
+    ulong relocate;
+    ulong phys_base;
+    ulong page_offset;
+    ulong prb;
+    ulong log_buf;
+    char release[65];
+
+    /* --probe, no marker if probe_size is 0 */
+    uint32_t probe_size;
+    ulong probe_kaddr;
+    uint64_t probe_value;
+
+    struct offset_table offset_table;
+    struct size_table size_table;
+};
+
+static int session_cache_path(const char *guest, char *path, size_t len)
+{
+    char name[NAME_MAX - 8];
+    size_t i;
+
+    if (!pc->cache_dir || !guest)
+        return -1;
+
+    /* domain names and socket paths both become one flat file name */
+    for (i = 0; guest[i] && i < sizeof(name) - 1; i++)
+        name[i] = (guest[i] == '/') ? '_' : guest[i];
+    name[i] = NULLCHAR;
+
+    if ((size_t)snprintf(path, len, "%s/%s.cache", pc->cache_dir, name) >= len)
+        return -1;
+
+    return 0;
+}
+
+static int session_cache_map_stat(const char *map_file, struct session_cache *c)
+{
+    struct stat sb;
+
+    if (stat(map_file, &sb))
+        return -1;
+
+    c->map_size = sb.st_size;
+    c->map_mtime = sb.st_mtime;
+    return 0;
+}
+
+/* a cache file that matches this build and System.map */
+static int session_cache_read(const char *path, const char *map_file,
+        struct session_cache *c)
+{
+    struct session_cache id;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) == -1)
+        return -1;
+
+    if (xread(fd, c, sizeof(*c)) != sizeof(*c)) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    if (c->magic != SESSION_CACHE_MAGIC || c->version != SESSION_CACHE_VERSION ||
+            c->tables_size != sizeof(c->offset_table) + sizeof(c->size_table))
+        return -1;
+
+    if (session_cache_map_stat(map_file, &id) ||
+            id.map_size != c->map_size || id.map_mtime != c->map_mtime)
+        return -1;
+
+    return 0;
+}
+
+/* the marker seen by this run, saved by session_cache_store() */
+void session_cache_observe(ulong kaddr, uint32_t size, uint64_t value)
+{
+    session->probe_kaddr = kaddr;
+    session->probe_size = size;
+    session->probe_value = value;
+}
+
+/* the marker seen last, size 0 if none, for --daemon */
+void session_cache_observed(ulong *kaddr, uint32_t *size, uint64_t *value)
+{
+    *kaddr = session->probe_kaddr;
+    *size = session->probe_size;
+    *value = session->probe_value;
+}
+
+/*
+ * 0 if the marker still holds the value of the last full run, i.e.
+ * nothing was logged since.  Costs one small read of guest memory.
+ */
+int session_cache_probe(const char *guest, const char *map_file)
+{
+    struct session_cache c;
+    char path[PATH_MAX];
+    uint64_t value = 0;
+
+    if (session_cache_path(guest, path, sizeof(path)) ||
+            session_cache_read(path, map_file, &c) || !c.probe_size ||
+            c.probe_size > sizeof(value))
+        return -1;
+
+    machdep->machspec->phys_base = c.phys_base;
+    machdep->machspec->page_offset = c.page_offset;
+
+    if (readmem(c.probe_kaddr, KVADDR, &value, c.probe_size) ||
+            value != c.probe_value) {
+        machdep->machspec->phys_base = 0;
+        machdep->machspec->page_offset = PAGE_OFFSET_2_6_27;
+        if (KDEBUG(1))
+            pr_debug("probe: log changed");
+        return -1;
+    }
+
+    if (KDEBUG(1))
+        pr_debug("probe: nothing new since the last run");
+    return 0;
+}
+
+int session_cache_load(const char *guest, const char *map_file)
+{
+    struct session_cache c;
+    char path[PATH_MAX];
+    char release[sizeof(c.release)];
+    ulong value = 0;
+
+    if (session_cache_path(guest, path, sizeof(path)))
+        return -1;
+
+    if (session_cache_read(path, map_file, &c))
+        goto miss;
+
+    kt->flags = c.kt_flags;
+    kt->relocate = c.relocate;
+    machdep->machspec->phys_base = c.phys_base;
+    machdep->machspec->page_offset = c.page_offset;
+
+    symbol_data_prefetch();
+    if (c.prb)
+        get_symbol_data("prb", sizeof(value), &value);
+    else
+        get_symbol_data("log_buf", sizeof(value), &value);
+
+    if (value != (c.prb ? c.prb : c.log_buf)) {
+        symbol_data_flush();
+        kt->flags = 0;
+        kt->relocate = 0;
+        machdep->machspec->phys_base = 0;
+        machdep->machspec->page_offset = PAGE_OFFSET_2_6_27;
+        goto miss;
+    }
+
+    kt->prb = c.prb;
+    kt->log_buf = c.log_buf;
+    *ot = c.offset_table;
+    *szt = c.size_table;
+
+    c.release[sizeof(c.release) - 1] = NULLCHAR;
+    memcpy(kt->release, c.release, sizeof(kt->release));
+    memcpy(release, c.release, sizeof(release));
+    parse_kernel_version(release);
+
+    if (KDEBUG(1))
+        pr_debug("session cache hit: %s", path);
+    return 0;
+
+miss:
+    if (KDEBUG(1))
+        pr_debug("session cache miss: %s", path);
+    return -1;
+}
+
+int session_cache_store(const char *guest, const char *map_file)
+{
+    struct session_cache c;
+    char path[PATH_MAX], tmp[PATH_MAX + 8];
+    int fd;
+
+    if (session_cache_path(guest, path, sizeof(path)))
+        return -1;
+
+    if (!kt->prb && !kt->log_buf)
+        return -1;
+
+    memset(&c, 0, sizeof(c));
+    c.magic = SESSION_CACHE_MAGIC;
+    c.version = SESSION_CACHE_VERSION;
+    c.tables_size = sizeof(c.offset_table) + sizeof(c.size_table);
+    if (session_cache_map_stat(map_file, &c))
+        return -1;
+
+    c.kt_flags = kt->flags;
+    c.relocate = kt->relocate;
+    c.phys_base = machdep->machspec->phys_base;
+    c.page_offset = machdep->machspec->page_offset;
+    c.prb = kt->prb;
+    c.log_buf = kt->log_buf;
+    memcpy(c.release, kt->release, sizeof(c.release));
+    c.probe_size = session->probe_size;
+    c.probe_kaddr = session->probe_kaddr;
+    c.probe_value = session->probe_value;
+    c.offset_table = *ot;
+    c.size_table = *szt;
+
+    /* write-and-rename so concurrent pollers never see a torn file */
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1) {
+        pr_warning("Cannot create session cache %s", tmp);
+        return -1;
+    }
+
+    if (xwrite(fd, (const char *)&c, sizeof(c)) != sizeof(c)) {
+        pr_warning("Cannot write session cache %s", tmp);
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    close(fd);
+
+    if (rename(tmp, path)) {
+        pr_warning("Cannot install session cache %s", path);
+        unlink(tmp);
+        return -1;
+    }
+
+    return 0;
+}
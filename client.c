@@ -1,8 +1,13 @@
+#include <signal.h>
+#include <pthread.h>
+
 #include "defs.h"
 #include "xutil.h"
+#include "log.h"
 #include "mem.h"
 #include "client.h"
 
+/* the client of the current session */
 guest_client_t *guest_client = NULL;
 
 int get_cr3_idtr(uint64_t *cr3, uint64_t *idtr)
@@ -12,17 +17,22 @@ int get_cr3_idtr(uint64_t *cr3, uint64_t *idtr)
     return 0;
 }
 
+/* kernel image and direct map addresses only, no page table walk */
+uint64_t kvaddr_to_paddr(uint64_t addr)
+{
+    if (addr >= __START_KERNEL_map)
+        return addr - (ulong)__START_KERNEL_map + machdep->machspec->phys_base;
+
+    return addr - PAGE_OFFSET;
+}
+
 int readmem(uint64_t addr, int memtype, void *buffer, long size)
 {
     physaddr_t paddr = 0;
 
     switch (memtype) {
         case KVADDR:
-            if (addr >= __START_KERNEL_map) {
-                paddr = ((addr) - (ulong)__START_KERNEL_map + machdep->machspec->phys_base);
-            } else {
-                paddr = ((addr) - PAGE_OFFSET);
-            }
+            paddr = kvaddr_to_paddr(addr);
             break;
         case PHYSADDR:
             paddr = addr;
@@ -39,10 +49,12 @@ int guest_client_new(char *ac, guest_access_t ty)
 
     guest_client_t *c = xcalloc(1, sizeof(guest_client_t));
     c->ty = ty;
+    /* the backends keep their connection in it */
+    guest_client = c;
     switch(c->ty) {
         case GUEST_NAME:
             if (libvirt_client_init(ac))
-                return -1;
+                goto err;
             c->pid = libvirt_get_pid(ac);
             libvirt_gpa2hva(0, &c->hva_base);
             if (mem_init(c->pid, c->hva_base) == 0) {
@@ -51,16 +63,19 @@ int guest_client_new(char *ac, guest_access_t ty)
                 c->readmem = libvirt_readmem;
             }
             c->get_registers = libvirt_get_registers;
+            c->pause = libvirt_suspend;
+            c->resume = libvirt_resume;
+            c->is_paused = libvirt_is_paused;
             break;
         case GUEST_MEMORY:
             if (file_client_init(ac))
-                return -1;
+                goto err;
             c->get_registers = file_get_registers;
             c->readmem = file_readmem;
             break;
         case QMP_SOCKET:
             if (qmp_client_init(ac))
-                return -1;
+                goto err;
             c->pid = qmp_get_pid(ac);
             qmp_gpa2hva(0, &c->hva_base);
             if (mem_init(c->pid, c->hva_base) == 0) {
@@ -69,17 +84,96 @@ int guest_client_new(char *ac, guest_access_t ty)
                 c->readmem = qmp_readmem;
             }
             c->get_registers = qmp_get_registers;
+            c->pause = qmp_stop;
+            c->resume = qmp_cont;
+            c->is_paused = qmp_is_paused;
+            break;
+        case GUEST_SNAPSHOT:
+            if (snapshot_client_init(ac))
+                goto err;
+            c->readmem = snapshot_readmem;
             break;
     }
-    guest_client = c;
+    return 0;
+
+err:
+    xfree(c);
+    guest_client = NULL;
+    return -1;
+}
+
+/*
+ * Stop the guest's vCPUs for a consistent copy of its log.  A memory
+ * image needs no pause, and a guest someone else paused is left as it
+ * is: it is not paused again and not resumed either.  The signals that
+ * would end kvm-dmesg are held until guest_resume(), a guest must never
+ * be left stopped by an interrupted run.
+ */
+int guest_pause(void)
+{
+    guest_client_t *c = guest_client;
+    sigset_t mask;
+
+    if (!c->pause || c->paused)
+        return 0;
+
+    if (c->is_paused && c->is_paused() == 1) {
+        pr_info("The guest is already paused, it is left so");
+        return 0;
+    }
+
+    if (c->readmem != mem_read)
+        pr_warning("Guest memory is read through the monitor, the pause will be long");
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGQUIT);
+    pthread_sigmask(SIG_BLOCK, &mask, &c->paused_sigmask);
+
+    clock_gettime(CLOCK_MONOTONIC, &c->paused_at);
+    if (c->pause()) {
+        pthread_sigmask(SIG_SETMASK, &c->paused_sigmask, NULL);
+        pr_err("Cannot pause the guest");
+        return -1;
+    }
+    c->paused = TRUE;
+
     return 0;
 }
 
+void guest_resume(void)
+{
+    guest_client_t *c = guest_client;
+    struct timespec now;
+    long us;
+
+    if (!c || !c->paused)
+        return;
+
+    if (c->resume()) {
+        pr_err("Cannot resume the guest, it is still paused");
+        pthread_sigmask(SIG_SETMASK, &c->paused_sigmask, NULL);
+        return;
+    }
+    c->paused = FALSE;
+    /* a signal that came in the meantime is delivered here */
+    pthread_sigmask(SIG_SETMASK, &c->paused_sigmask, NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    us = (now.tv_sec - c->paused_at.tv_sec) * 1000000 +
+        (now.tv_nsec - c->paused_at.tv_nsec) / 1000;
+    pr_info("Guest paused for %ld.%03ld ms", us / 1000, us % 1000);
+}
+
 int guest_client_release()
 {
     if (!guest_client)
         return 0;
 
+    guest_resume();
+
     guest_client_t *c = guest_client;
     switch(c->ty) {
         case GUEST_NAME:
@@ -93,6 +187,9 @@ int guest_client_release()
             qmp_client_uninit();
             mem_uninit();
             break;
+        case GUEST_SNAPSHOT:
+            snapshot_client_uninit();
+            break;
     }
     xfree(c);
     guest_client = NULL;
@@ -16,13 +16,21 @@
 #ifndef __CLIENT_H__
 #define __CLIENT_H__
 
+#include <stdio.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <time.h>
+#include <signal.h>
+
+#include "mem.h"
+
+struct qmp_conn;
 
 typedef enum {
     GUEST_NAME,
     GUEST_MEMORY,
     QMP_SOCKET,
+    GUEST_SNAPSHOT,
 } guest_access_t;
 
 typedef struct {
@@ -31,20 +39,44 @@ typedef struct {
     uint64_t hva_base;
     int (*get_registers)(uint64_t*, uint64_t*, uint64_t*);
     int (*readmem)(uint64_t, void*, size_t);
+    int (*pause)(void);
+    int (*resume)(void);
+    int (*is_paused)(void);         /* 1 paused, 0 running, -1 unknown */
+    int paused;                     /* by guest_pause(), not by someone else */
+    struct timespec paused_at;
+    sigset_t paused_sigmask;        /* to restore when resumed */
+
+    /* the transport, one of them is in use */
+    struct qmp_conn *qmp;
+    void *domain;                   /* libvirt virDomainPtr */
+    void *domain_conn;              /* libvirt virConnectPtr */
+    FILE *mem_file;
+    proc_mem_t *proc_mem;           /* /proc/pid/mem of QEMU */
+    char *snapshot_map;
+    size_t snapshot_size;
 } guest_client_t;
 
+extern guest_client_t *guest_client;
+
 int get_cr3_idtr(uint64_t *cr3, uint64_t *idtr);
+uint64_t kvaddr_to_paddr(uint64_t addr);
 int readmem(uint64_t addr, int memtype, void *buffer, long size);
 
 int guest_client_new(char *ac, guest_access_t ty);
 int guest_client_release();
+int guest_pause(void);
+void guest_resume(void);
 
 int qmp_client_init(char *sock_path);
+int qmp_client_prepare(char *sock_path);
 int qmp_client_uninit();
 int qmp_get_registers(uint64_t *idtr, uint64_t *cr3, uint64_t *cr4);
 int qmp_readmem(uint64_t addr, void *buffer, size_t size);
 pid_t qmp_get_pid(char *sock_path);
 int qmp_gpa2hva(uint64_t gpa, uint64_t *hva);
+int qmp_stop(void);
+int qmp_cont(void);
+int qmp_is_paused(void);
 
 int libvirt_client_init(char *guest_name);
 int libvirt_client_uninit();
@@ -52,10 +84,17 @@ int libvirt_get_registers(uint64_t *idtr, uint64_t *cr3, uint64_t *cr4);
 int libvirt_readmem(uint64_t addr, void *buffer, size_t size);
 pid_t libvirt_get_pid(char *guest_name);
 int libvirt_gpa2hva(uint64_t gpa, uint64_t *hva);
+int libvirt_suspend(void);
+int libvirt_resume(void);
+int libvirt_is_paused(void);
 
 int file_client_init(char *sock_path);
 int file_client_uninit();
 int file_get_registers(uint64_t *idtr, uint64_t *cr3, uint64_t *cr4);
 int file_readmem(uint64_t addr, void *buffer, size_t size);
 
+int snapshot_client_init(char *path);
+int snapshot_client_uninit();
+int snapshot_readmem(uint64_t addr, void *buffer, size_t size);
+
 #endif
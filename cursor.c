@@ -0,0 +1,215 @@
+/* cursor.c
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "xutil.h"
+#include "log.h"
+#include "defs.h"
+#include "filter.h"
+#include "session.h"
+
+/*
+ * Cursor for incremental collection.
+ *
+ * --cursor FILE keeps the sequence number after the last record handled,
+ * and the next run prints only newer records.  Sequence numbers restart
+ * with every boot, so the cursor also names the boot it belongs to: the
+ * kernel release, the KASLR offset and the log buffer pointer must be
+ * unchanged, the ring must not end below the cursor and the last handled
+ * record, when it is still in the ring, must carry the saved timestamp.
+ * Otherwise the guest rebooted and the whole ring is printed again.
+ *
+ * The position belongs to the current session, so that --daemon keeps
+ * one per guest.
+ */
+#define CURSOR_MAGIC    (0x5243444b)    /* "KDCR" */
+#define CURSOR_VERSION  (1)
+
+struct cursor_file {
+    uint32_t magic;
+    uint32_t version;
+
+    uint64_t next_seq;              /* first sequence number not handled */
+    uint64_t last_ts;               /* ts_nsec of next_seq - 1 */
+
+    /* boot identity */
+    ulong relocate;
+    ulong log_kaddr;                /* prb or log_buf */
+    char release[65];
+};
+
+struct cursor_state {
+    struct cursor_file file;
+    int loaded;                     /* the cursor belongs to this boot */
+    int dirty;
+};
+
+static struct cursor_state *cursor_get(void)
+{
+    if (!session->cursor)
+        session->cursor = xcalloc(1, sizeof(struct cursor_state));
+    return session->cursor;
+}
+
+static void cursor_identity(struct cursor_file *c)
+{
+    c->relocate = kt->relocate;
+    c->log_kaddr = kt->prb ? kt->prb : kt->log_buf;
+    memcpy(c->release, kt->release, sizeof(c->release));
+}
+
+int cursor_load(void)
+{
+    struct cursor_state *c = cursor_get();
+    struct cursor_file id;
+    int fd;
+
+    if ((fd = open(pc->cursor, O_RDONLY)) == -1) {
+        if (errno != ENOENT)
+            pr_warning("Cannot open cursor %s, starting over", pc->cursor);
+        return -1;
+    }
+
+    if (xread(fd, &c->file, sizeof(c->file)) != sizeof(c->file) ||
+            c->file.magic != CURSOR_MAGIC || c->file.version != CURSOR_VERSION) {
+        close(fd);
+        pr_warning("Invalid cursor %s, starting over", pc->cursor);
+        return -1;
+    }
+    close(fd);
+
+    memset(&id, 0, sizeof(id));
+    cursor_identity(&id);
+    c->file.release[sizeof(c->file.release) - 1] = NULLCHAR;
+    if (c->file.relocate != id.relocate || c->file.log_kaddr != id.log_kaddr ||
+            strcmp(c->file.release, id.release)) {
+        pr_warning("Cursor %s is from another boot, starting over", pc->cursor);
+        return -1;
+    }
+
+    if (KDEBUG(1))
+        pr_debug("cursor: next seq %llu", (ulonglong)c->file.next_seq);
+
+    c->loaded = TRUE;
+    return 0;
+}
+
+/*
+ * The ring holds first_seq up to end_seq - 1.  last_ts_match tells
+ * whether the last handled record still carries the saved timestamp,
+ * -1 if it is gone or cannot be checked.  Records below the cursor are
+ * left out through the record filter, so the seek skips them too.
+ */
+void cursor_resume(uint64_t first_seq, uint64_t end_seq, int last_ts_match)
+{
+    struct cursor_state *c = cursor_get();
+
+    if (!c->loaded)
+        return;
+
+    if (c->file.next_seq > end_seq || !last_ts_match) {
+        pr_warning("Guest rebooted since cursor %s was saved, starting over",
+                pc->cursor);
+        c->loaded = FALSE;
+        return;
+    }
+
+    if (first_seq > c->file.next_seq)
+        pr_warning("%llu messages lost, the ring wrapped past the cursor",
+                (ulonglong)(first_seq - c->file.next_seq));
+
+    if (record_filter->seq_min < c->file.next_seq)
+        record_filter->seq_min = c->file.next_seq;
+    record_filter->active = TRUE;
+}
+
+/* sequence number and timestamp the saved cursor ends at, if any */
+int cursor_last(uint64_t *seq, uint64_t *ts_nsec)
+{
+    struct cursor_state *c = cursor_get();
+
+    if (!c->loaded || !c->file.next_seq)
+        return -1;
+
+    *seq = c->file.next_seq - 1;
+    *ts_nsec = c->file.last_ts;
+    return 0;
+}
+
+/*
+ * Every record up to seq has been handled.  From here on the cursor is
+ * one of this boot, for the next pass of --daemon.
+ */
+void cursor_advance(uint64_t seq, uint64_t ts_nsec)
+{
+    struct cursor_state *c = cursor_get();
+
+    c->file.next_seq = seq + 1;
+    c->file.last_ts = ts_nsec;
+    c->loaded = TRUE;
+    c->dirty = TRUE;
+}
+
+/*
+ * Write-and-rename, so a collector killed halfway leaves the previous
+ * cursor in place.  Called only once the output is written.
+ */
+int cursor_store(void)
+{
+    struct cursor_state *c = session->cursor;
+    char tmp[PATH_MAX];
+    int fd;
+
+    if (!pc->cursor || !c || !c->dirty)
+        return 0;
+
+    c->file.magic = CURSOR_MAGIC;
+    c->file.version = CURSOR_VERSION;
+    cursor_identity(&c->file);
+
+    if ((size_t)snprintf(tmp, sizeof(tmp), "%s.%d", pc->cursor,
+                (int)getpid()) >= sizeof(tmp)) {
+        pr_warning("Cursor path too long: %s", pc->cursor);
+        return -1;
+    }
+
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+        pr_warning("Cannot create cursor %s", tmp);
+        return -1;
+    }
+
+    if (xwrite(fd, (const char *)&c->file, sizeof(c->file)) != sizeof(c->file) ||
+            fsync(fd)) {
+        pr_warning("Cannot write cursor %s", tmp);
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    close(fd);
+
+    if (rename(tmp, pc->cursor)) {
+        pr_warning("Cannot install cursor %s", pc->cursor);
+        unlink(tmp);
+        return -1;
+    }
+
+    c->dirty = FALSE;
+    return 0;
+}
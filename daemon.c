@@ -0,0 +1,357 @@
+/* daemon.c
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "xutil.h"
+#include "log.h"
+#include "defs.h"
+#include "client.h"
+#include "printk.h"
+#include "filter.h"
+#include "output.h"
+#include "session.h"
+
+/*
+ * Host-wide collector.
+ *
+ * --daemon DIR keeps every guest of the --batch file attached, each in a
+ * session of its own: the monitor connection, /proc/pid/mem, symbols,
+ * KASLR offset and structure layout are resolved once.  Every interval
+ * the word that grows with every message (head_id or log_next_seq) is
+ * read through the session; only if it moved is the ring read, from the
+ * guest's cursor on, and the new records appended to its spool file,
+ * DIR/GUEST.log unless the batch line names one.  The cursor is kept
+ * next to the spool, so a restarted daemon resumes where it stopped.
+ *
+ * The guests are attached one after the other, but the connections to
+ * the QMP sockets among them are all started first, so the monitors'
+ * handshakes overlap.  A guest that cannot be reached, or whose log
+ * cannot be read, is attached again every DAEMON_RETRY seconds.
+ * Whenever the marker moved, or there is none yet, the ring's address is
+ * checked: if it moved, the guest rebooted and is attached again at
+ * once.  SIGHUP reopens the spool files.
+ */
+#define DAEMON_RETRY    (30)
+
+struct daemon_guest {
+    struct batch_guest g;           /* absolute paths */
+    char *spool;
+    char *cursor;
+    FILE *spool_file;
+    struct session *session;
+    int qmp;                        /* g.guest is a QMP socket */
+    int attached;
+    int failed;                     /* the guest's log cannot be followed */
+    time_t retry_at;
+    ulong log_kaddr;                /* prb or log_buf when attached */
+    ulong marker_kaddr;
+    uint32_t marker_size;           /* 0 until the ring was read once */
+    uint64_t marker_value;
+};
+
+static volatile sig_atomic_t daemon_reopen;
+
+static void daemon_hup(int sig)
+{
+    (void)sig;
+    daemon_reopen = TRUE;
+}
+
+/* path as seen from the current directory, the daemon runs from / */
+static char *daemon_abspath(const char *path)
+{
+    char cwd[PATH_MAX], resolved[PATH_MAX], *p;
+
+    if (realpath(path, resolved))
+        return xstrdup(resolved);
+    if (path[0] == '/' || !getcwd(cwd, sizeof(cwd)))
+        return xstrdup(path);
+
+    p = xmalloc(strlen(cwd) + strlen(path) + 2);
+    sprintf(p, "%s/%s", cwd, path);
+    return p;
+}
+
+/* DIR/GUEST.log, with the guest's last path component made a file name */
+static char *daemon_spool_path(const char *dir, const char *guest)
+{
+    const char *base = strrchr(guest, '/') ? strrchr(guest, '/') + 1 : guest;
+    size_t dir_len = strlen(dir);
+    char *p, *q;
+
+    p = xmalloc(dir_len + strlen(base) + sizeof("/.log"));
+    sprintf(p, "%s/%s.log", dir, base);
+    for (q = p + dir_len + 1; *q; q++) {
+        if (!isalnum((unsigned char)*q) && *q != '.' && *q != '-' && *q != '_')
+            *q = '_';
+    }
+    return p;
+}
+
+static int daemon_open_spool(struct daemon_guest *g)
+{
+    if (g->spool_file)
+        fclose(g->spool_file);
+
+    if (!(g->spool_file = fopen(g->spool, "a"))) {
+        pr_err("Cannot open spool %s: %s", g->spool, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int daemon_setup(const char *spool_dir, struct daemon_guest *guests,
+        struct batch_guest *list, int nr)
+{
+    struct stat sb;
+    char *dir;
+    int i, j;
+
+    if (mkdir(spool_dir, 0755) && errno != EEXIST) {
+        pr_err("Cannot create spool directory %s", spool_dir);
+        return -1;
+    }
+    dir = daemon_abspath(spool_dir);
+
+    for (i = 0; i < nr; i++) {
+        struct daemon_guest *g = &guests[i];
+
+        /* a libvirt domain is a name, not a path */
+        if (stat(list[i].guest, &sb)) {
+            g->g.guest = xstrdup(list[i].guest);
+        } else {
+            g->g.guest = daemon_abspath(list[i].guest);
+            g->qmp = S_ISSOCK(sb.st_mode);
+        }
+        g->g.map = daemon_abspath(list[i].map);
+        g->spool = list[i].out ? daemon_abspath(list[i].out) :
+            daemon_spool_path(dir, list[i].guest);
+        g->cursor = xmalloc(strlen(g->spool) + sizeof(".cursor"));
+        sprintf(g->cursor, "%s.cursor", g->spool);
+        g->session = session_new();
+
+        for (j = 0; j < i; j++) {
+            if (STREQ(guests[j].spool, g->spool)) {
+                pr_err("%s and %s would share %s, give one an OUTPUT",
+                        guests[j].g.guest, g->g.guest, g->spool);
+                xfree(dir);
+                return -1;
+            }
+        }
+    }
+    xfree(dir);
+
+    for (i = 0; i < nr; i++) {
+        if (daemon_open_spool(&guests[i]))
+            return -1;
+    }
+    return 0;
+}
+
+/* the ring's address, it moves when the guest reboots */
+static ulong daemon_log_kaddr(void)
+{
+    ulong value = 0;
+
+    symbol_data_flush();
+    get_symbol_data(kernel_symbol_exists("prb") ? "prb" : "log_buf",
+            sizeof(value), &value);
+    return value;
+}
+
+static int daemon_attach(struct daemon_guest *g)
+{
+    int ret;
+
+    /* the kernel version banner does not go to the spool */
+    fp = stderr;
+    ret = session_open(g->g.guest, g->g.map);
+    if (!ret && !kernel_symbol_exists("prb") &&
+            !(kernel_symbol_exists("log_first_idx") &&
+                kernel_symbol_exists("log_next_idx"))) {
+        pr_err("%s: --daemon needs a structured log buffer (3.5+), dropped",
+                g->g.guest);
+        g->failed = TRUE;
+        ret = -1;
+    }
+    if (ret) {
+        session_close();
+        g->retry_at = time(NULL) + DAEMON_RETRY;
+        return -1;
+    }
+
+    if (pc->annotate)
+        symtab_text_init(g->g.map);
+    g->log_kaddr = daemon_log_kaddr();
+    g->marker_size = 0;
+    cursor_load();
+    g->attached = TRUE;
+
+    pr_info("%s: attached", g->g.guest);
+    return 0;
+}
+
+static void daemon_detach(struct daemon_guest *g)
+{
+    session_close();
+    g->attached = FALSE;
+}
+
+/* append what g logged since the last poll to its spool */
+static void daemon_poll(struct daemon_guest *g)
+{
+    uint64_t value = 0;
+    int ret;
+
+    session_switch(g->session);
+    pc->cursor = g->cursor;
+
+    if (!g->attached) {
+        if (time(NULL) < g->retry_at || daemon_attach(g))
+            return;
+    } else {
+        if (g->marker_size &&
+                !readmem(g->marker_kaddr, KVADDR, &value, g->marker_size) &&
+                value == g->marker_value)
+            return;
+
+        /* no marker yet, or it moved: see whether the ring did too */
+        if (daemon_log_kaddr() != g->log_kaddr) {
+            pr_warning("%s: guest rebooted or went away, attaching again",
+                    g->g.guest);
+            daemon_detach(g);
+            if (daemon_attach(g))
+                return;
+        }
+    }
+
+    fp = g->spool_file;
+    session_cache_observe(0, 0, 0);
+
+    symbol_data_flush();
+    symbol_data_prefetch();
+    if (kernel_symbol_exists("prb"))
+        ret = dump_lockless_record_log();
+    else
+        ret = dump_variable_length_record_log();
+    symbol_data_flush();
+
+    session_cache_observed(&g->marker_kaddr, &g->marker_size, &g->marker_value);
+
+    /* the cursor never gets ahead of the spool */
+    if (!output_flush())
+        cursor_store();
+
+    if (ret) {
+        pr_warning("%s: cannot read the log, attaching again in %d seconds",
+                g->g.guest, DAEMON_RETRY);
+        daemon_detach(g);
+        g->retry_at = time(NULL) + DAEMON_RETRY;
+    }
+}
+
+int daemon_run(const char *spool_dir, const char *config)
+{
+    struct daemon_guest *guests;
+    struct batch_guest *list;
+    struct sigaction sa;
+    int nr, i, ret = -1;
+
+    if (!config) {
+        pr_err("--daemon needs --batch FILE listing the guests");
+        return -1;
+    }
+
+    if (pc->follow || pc->cursor || pc->save || pc->load || pc->probe ||
+            pc->atomic || pc->tail) {
+        pr_warning("--follow, --cursor, --save, --load, --probe, --atomic "
+                "and --tail are ignored with --daemon, which keeps a cursor "
+                "next to each spool");
+        pc->follow = FALSE;
+        pc->save = NULL;
+        pc->load = NULL;
+        pc->probe = FALSE;
+        pc->atomic = FALSE;
+        pc->tail = 0;
+    }
+    pc->cursor = NULL;
+
+    if ((nr = batch_parse(config, &list)) < 0)
+        return -1;
+
+    guests = xcalloc(nr, sizeof(*guests));
+    if (daemon_setup(spool_dir, guests, list, nr))
+        goto out;
+
+    /* with --debug the daemon stays in the foreground */
+    if (!pc->debug) {
+        daemonize();
+        log_syslog("kvm-dmesg");
+    }
+
+    follow_init();
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = daemon_hup;
+    sigaction(SIGHUP, &sa, NULL);
+
+    pr_info("collecting %d guests into %s", nr, spool_dir);
+
+    do {
+        if (daemon_reopen) {
+            daemon_reopen = FALSE;
+            for (i = 0; i < nr; i++)
+                daemon_open_spool(&guests[i]);
+        }
+
+        for (i = 0; i < nr; i++) {
+            struct daemon_guest *g = &guests[i];
+
+            if (g->qmp && !g->attached && !g->failed && g->spool_file &&
+                    time(NULL) >= g->retry_at)
+                qmp_client_prepare(g->g.guest);
+        }
+
+        for (i = 0; i < nr; i++) {
+            if (!guests[i].failed && guests[i].spool_file)
+                daemon_poll(&guests[i]);
+        }
+    } while (follow_wait());
+    ret = 0;
+
+out:
+    for (i = 0; i < nr; i++) {
+        session_free(guests[i].session);
+        if (guests[i].spool_file)
+            fclose(guests[i].spool_file);
+        xfree(guests[i].spool);
+        xfree(guests[i].cursor);
+    }
+    for (i = 0; i < nr; i++) {
+        xfree(guests[i].g.guest);
+        xfree(guests[i].g.map);
+    }
+    xfree(guests);
+    batch_free(list, nr);
+
+    return ret;
+}
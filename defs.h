@@ -48,6 +48,22 @@ typedef unsigned long long int ulonglong;
 
 struct program_context {
     ulong debug;                    /* level of debug */
+    char *cache_dir;                /* per-guest session cache directory */
+    int annotate;                   /* symbolize kernel addresses in text */
+    int follow;                     /* keep polling for new records */
+    ulong interval;                 /* follow poll interval (ms) */
+    ulong tail;                     /* print only the last N records */
+    int escape;                     /* print unprintable bytes as \xNN */
+    ulong jobs;                     /* decoding threads, 0 = one per CPU */
+    ulong max_memory;               /* cap on local copies of the log, 0 = none */
+    int atomic;                     /* pause the guest while the log is copied */
+    int format;                     /* FORMAT_TEXT, FORMAT_JSON or FORMAT_KMSG */
+    char *cursor;                   /* resume after the records of the last run */
+    char *save;                     /* write a raw snapshot of the log here */
+    char *load;                     /* decode a snapshot instead of a guest */
+    int probe;                      /* stop early if nothing was logged */
+    char *batch;                    /* collect the guests listed here */
+    char *daemon;                   /* spool directory of --daemon */
 };
 
 #define RELOC_SET            (0x2000000)
@@ -56,6 +72,9 @@ struct kernel_table {
     ulong flags;
     ulong relocate;
 	uint kernel_version[3];
+    char release[65];               /* VMCOREINFO OSRELEASE */
+    ulong prb;                      /* struct printk_ringbuffer *prb */
+    ulong log_buf;                  /* char *log_buf, pre-5.10 rings */
 };
 
 struct machdep_table {
@@ -124,6 +143,9 @@ struct offset_table {
     // struct prb_data_ring
     long prb_data_ring_size_bits;
     long prb_data_ring_data;
+
+    // struct printk_log, 0 without CONFIG_PRINTK_CALLER
+    long printk_log_caller_id;
 };
 
 struct size_table {
@@ -141,10 +163,10 @@ struct size_table {
 #define STRUCT_SIZE(X)      datatype_info((X), NULL, STRUCT_SIZE_REQUEST)
 #define MEMBER_OFFSET(X,Y)  datatype_info((X), (Y), MEMBER_OFFSET_REQUEST)
 
-#define OFFSET(X)          (offset_table.X)
-#define SIZE(X)            (size_table.X)
-#define ASSIGN_SIZE(X)     (size_table.X)
-#define ASSIGN_OFFSET(X)   (offset_table.X)
+#define OFFSET(X)          (ot->X)
+#define SIZE(X)            (szt->X)
+#define ASSIGN_SIZE(X)     (szt->X)
+#define ASSIGN_OFFSET(X)   (ot->X)
 
 #define STRUCT_SIZE_INIT(X, Y) (ASSIGN_SIZE(X) = STRUCT_SIZE(Y))
 #define MEMBER_OFFSET_INIT(X, Y, Z) (ASSIGN_OFFSET(X) = MEMBER_OFFSET(Y, Z))
@@ -163,16 +185,22 @@ struct syment {
     char *name;
     struct syment *name_hash_next;
     unsigned char cnt;
+    unsigned char prefetched;       /* data holds the guest value */
+    ulong data;
 };
 
 #define SYMNAME_HASH (512)
 #define SYMNAME_HASH_INDEX(name) \
      ((name[0] ^ (name[strlen(name)-1] * name[strlen(name)/2])) % SYMNAME_HASH)
 
+struct text_symtab;
+
 struct symbol_table_data {
     struct syment *symname_hash[SYMNAME_HASH];
     ulong divide_error_vmlinux;
     ulong idt_table_vmlinux;
+    char *map_file;                 /* System.map the table was built from */
+    struct text_symtab *text;       /* --annotate */
 };
 
 #define KVADDR             (0x1)
@@ -233,20 +261,24 @@ struct machine_specific {
 
 /*
  *  Global data (global_data.c)
+ *
+ *  They belong to the current struct session (session.h), see
+ *  session_switch().
  */
 extern FILE *fp;
-extern struct program_context program_context, *pc;
-extern struct kernel_table kernel_table, *kt;
-extern struct offset_table offset_table;
-extern struct size_table size_table;
-extern struct vm_table vm_table, *vt;
-extern struct symbol_table_data symbol_table_data, *st;
+extern struct program_context *pc;
+extern struct kernel_table *kt;
+extern struct offset_table *ot;
+extern struct size_table *szt;
+extern struct vm_table *vt;
+extern struct symbol_table_data *st;
 
 
 /*
  * symbols.c
  */
 void symtab_init(const char*);
+void symtab_free(void);
 ulong symbol_value(char *);
 int kernel_symbol_exists(char *s);
 
@@ -254,12 +286,92 @@ int kernel_symbol_exists(char *s);
 /*
  *  symbols.c
  */
-void get_symbol_data(char *symbol, long size, void *local);
+int get_symbol_data(char *symbol, long size, void *local);
+ulong symbol_data_kaddr(char *symbol);
+void symbol_data_prefetch(void);
+void symbol_data_prefetch_list(char **names, size_t nr_syms);
+void symbol_data_flush(void);
+int symtab_text_init(const char *map_file);
+void symtab_for_each(void (*fn)(const char *name, ulong value, void *arg),
+        void *arg);
+void symtab_install(const char *name, ulong value);
+void symbol_annotate_text(const char *text, size_t len);
 
 void kernel_init(void);
-long datatype_info(char *name, char *member, int datatype);
 void parse_kernel_version(char *);
-void vmcoreinfo_init();
 void die(const char *err, ...);
+
+/*
+ *  dmesg.c
+ */
+void x86_64_init(void);
+void x86_64_free(void);
+void x86_64_post_reloc(void);
+void derive_kaslr_offset(void);
+int dump_variable_length_record_log(void);
+int dump_plain_log(void);
+
+/*
+ *  cache.c
+ */
+int session_cache_load(const char *guest, const char *map_file);
+int session_cache_store(const char *guest, const char *map_file);
+void session_cache_observe(ulong kaddr, uint32_t size, uint64_t value);
+void session_cache_observed(ulong *kaddr, uint32_t *size, uint64_t *value);
+int session_cache_probe(const char *guest, const char *map_file);
+
+/*
+ *  cursor.c
+ */
+int cursor_load(void);
+void cursor_resume(uint64_t first_seq, uint64_t end_seq, int last_ts_match);
+int cursor_last(uint64_t *seq, uint64_t *ts_nsec);
+void cursor_advance(uint64_t seq, uint64_t ts_nsec);
+int cursor_store(void);
+
+/*
+ *  batch.c
+ */
+struct batch_guest {
+    char *guest;
+    char *map;
+    char *out;                      /* output file, NULL if not given */
+};
+
+int batch_parse(const char *config, struct batch_guest **guests);
+void batch_free(struct batch_guest *guests, int nr);
+int batch_run(const char *config, char **guest, char **map);
+
+/*
+ *  daemon.c
+ */
+int daemon_run(const char *spool_dir, const char *config);
+
+/*
+ *  snapshot.c
+ */
+int snapshot_save(const char *path);
+int snapshot_restore(void);
+
+/*
+ *  vmcoreinfo.c
+ */
+#define VMCOREINFO_STRING  (0)
+#define VMCOREINFO_SIZE    (1)
+#define VMCOREINFO_OFFSET  (2)
+#define VMCOREINFO_SYMBOL  (3)
+#define VMCOREINFO_NUMBER  (4)
+#define VMCOREINFO_LENGTH  (5)
+
+void vmcoreinfo_init();
+void vmcoreinfo_free(void);
+const char *vmcoreinfo_lookup(int type, const char *name, size_t *len);
+int vmcoreinfo_get(int type, const char *name, const char *member, long *value);
+long vmcoreinfo_size(const char *name);
+long vmcoreinfo_offset(const char *name, const char *member);
+ulong vmcoreinfo_symbol(const char *name);
+long vmcoreinfo_number(const char *name);
+long vmcoreinfo_length(const char *name);
 char *vmcoreinfo_read_string(const char *key);
+long datatype_info(char *name, char *member, int datatype);
 #endif
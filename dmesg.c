@@ -0,0 +1,745 @@
+/* dmesg.c
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "xutil.h"
+#include "log.h"
+#include "defs.h"
+#include "client.h"
+#include "printk.h"
+#include "filter.h"
+#include "output.h"
+
+static ulong * x86_64_kpgd_offset(ulong kvaddr)
+{
+    ulong *pgd;
+    pgd = ((ulong *)machdep->pgd) + pgd_index(kvaddr);
+    return pgd;
+}
+
+ulong x86_64_pud_offset(ulong pgd_pte, ulong vaddr)
+{
+    ulong *pud;
+    ulong pud_paddr;
+    ulong pud_pte;
+
+    pud_paddr = pgd_pte & PHYSICAL_PAGE_MASK;
+
+    FILL_PUD(pud_paddr, PAGESIZE());
+    pud = ((ulong *)pud_paddr) + pud_index(vaddr);
+    pud_pte = ULONG(machdep->pud + PAGEOFFSET(pud));
+
+    return pud_pte;
+}
+
+ulong x86_64_pmd_offset(ulong pud_pte, ulong vaddr)
+{
+    ulong *pmd;
+    ulong pmd_paddr;
+    ulong pmd_pte;
+
+    pmd_paddr = pud_pte & PHYSICAL_PAGE_MASK;
+
+    FILL_PMD(pmd_paddr, PAGESIZE());
+
+    pmd = ((ulong *)pmd_paddr) + pmd_index(vaddr);
+    pmd_pte = ULONG(machdep->pmd + PAGEOFFSET(pmd));
+    return pmd_pte;
+}
+
+ulong x86_64_pte_offset(ulong pmd_pte, ulong vaddr)
+{
+    ulong *ptep;
+    ulong pte_paddr;
+    ulong pte;
+
+    pte_paddr = pmd_pte & PHYSICAL_PAGE_MASK;
+
+    FILL_PTBL(pte_paddr, PAGESIZE());
+    ptep = ((ulong *)pte_paddr) + pte_index(vaddr);
+    pte = ULONG(machdep->ptbl + PAGEOFFSET(ptep));
+
+    return pte;
+}
+
+int x86_64_kvtop(ulong kvaddr, physaddr_t *paddr)
+{
+    ulong *pgd;
+    ulong pud_pte;
+    ulong pmd_pte;
+    ulong pte;
+
+    pgd = x86_64_kpgd_offset(kvaddr);
+    pud_pte = x86_64_pud_offset(*pgd, kvaddr);
+    pmd_pte = x86_64_pmd_offset(pud_pte, kvaddr);
+    pte = x86_64_pte_offset(pmd_pte, kvaddr);
+    *paddr = (PAGEBASE(pte) & PHYSICAL_PAGE_MASK) + PAGEOFFSET(kvaddr);
+
+    return 0;
+}
+
+ulong get_vec0_addr(ulong idtr)
+{
+    struct gate_struct64 {
+        uint16_t offset_low;
+        uint16_t segment;
+        uint32_t ist : 3, zero0 : 5, type : 5, dpl : 2, p : 1;
+        uint16_t offset_middle;
+        uint32_t offset_high;
+        uint32_t zero1;
+    } __attribute__((packed)) gate;
+
+    readmem(idtr, PHYSADDR, &gate, sizeof(gate));
+
+    return ((ulong)gate.offset_high << 32)
+        + ((ulong)gate.offset_middle << 16)
+        + gate.offset_low;
+}
+
+#define PTI_USER_PGTABLE_BIT    PAGE_SHIFT
+#define PTI_USER_PGTABLE_MASK   (1 << PTI_USER_PGTABLE_BIT)
+#define CR3_PCID_MASK           0xFFFull
+int calc_kaslr_offset(ulong *kaslr_offset, ulong *phys_base)
+{
+    uint64_t cr3 = 0, idtr = 0, pgd = 0, idtr_paddr;
+    ulong divide_error_vmcore;
+
+    get_cr3_idtr(&cr3, &idtr);
+
+    pgd = cr3 & ~(CR3_PCID_MASK|PTI_USER_PGTABLE_MASK);
+
+    vt->kernel_pgd[0] = pgd;
+    machdep->last_pgd_read = vt->kernel_pgd[0];
+    machdep->machspec->physical_mask_shift = __PHYSICAL_MASK_SHIFT_2_6;
+    machdep->machspec->pgdir_shift = PGDIR_SHIFT;
+    machdep->machspec->ptrs_per_pgd = PTRS_PER_PGD;
+
+    readmem(pgd, PHYSADDR, machdep->pgd, PAGESIZE());
+    x86_64_kvtop(idtr, &idtr_paddr);
+
+    divide_error_vmcore = get_vec0_addr(idtr_paddr);
+    *kaslr_offset = divide_error_vmcore - st->divide_error_vmlinux;
+    *phys_base = idtr_paddr -
+        (st->idt_table_vmlinux + *kaslr_offset - __START_KERNEL_map);
+
+    if (KDEBUG(1)) {
+        pr_debug("kaslr_offset: idtr=%lx", idtr);
+        pr_debug("kaslr_offset: pgd=%lx", pgd);
+        pr_debug("kaslr_offset: idtr(phys)=%lx", idtr_paddr);
+        pr_debug("kaslr_offset: divide_error(vmcore): %lx", divide_error_vmcore);
+        pr_debug("kaslr_offset: kaslr_offset=%lx", *kaslr_offset);
+        pr_debug("kaslr_offset: phys_base   =%lx", *phys_base);
+    }
+
+    return 0;
+}
+
+/* machdep->machspec is set by the session */
+void x86_64_init(void)
+{
+    machdep->pagesize = 4096;
+    machdep->pageoffset = machdep->pagesize - 1;
+    machdep->pagemask = ~((ulonglong)machdep->pageoffset);
+
+    machdep->pgd = malloc(PAGESIZE());
+    machdep->pud = malloc(PAGESIZE());
+    machdep->pmd = malloc(PAGESIZE());
+    machdep->ptbl = malloc(PAGESIZE());
+
+    machdep->machspec->page_offset = PAGE_OFFSET_2_6_27;
+}
+
+void x86_64_free(void)
+{
+    xfree(machdep->pgd);
+    xfree(machdep->pud);
+    xfree(machdep->pmd);
+    xfree(machdep->ptbl);
+    machdep->pgd = machdep->pud = machdep->pmd = machdep->ptbl = NULL;
+}
+
+void x86_64_post_reloc(void)
+{
+    if (kernel_symbol_exists("page_offset_base")) {
+        get_symbol_data("page_offset_base", sizeof(ulong),
+            &machdep->machspec->page_offset);
+    }
+}
+
+void derive_kaslr_offset(void)
+{
+    ulong kaslr_offset = 0;
+    ulong phys_base = 0;
+
+    calc_kaslr_offset(&kaslr_offset, &phys_base);
+
+    if (kaslr_offset) {
+        kt->relocate = kaslr_offset * -1;
+        kt->flags |= RELOC_SET;
+    }
+
+    machdep->machspec->phys_base = phys_base;
+}
+
+/*
+ * The part of log_buf that is local: all of it, or under --max-memory a
+ * window that is refilled as the records are walked.
+ */
+struct log_window {
+    ulong kaddr;
+    uint32_t buf_len;
+    char *buf;
+    uint32_t size;
+    uint32_t base;
+    uint32_t len;
+    int failed;                     /* a read of log_buf failed */
+};
+
+/* len bytes of log_buf from idx, NULL if they cannot be read */
+static char *log_window_get(struct log_window *w, uint32_t idx, uint32_t len)
+{
+    if (idx > w->buf_len || len > w->buf_len - idx)
+        return NULL;
+
+    if (idx >= w->base && idx + len <= w->base + w->len)
+        return w->buf + (idx - w->base);
+
+    if (len > w->size)
+        return NULL;
+
+    w->base = idx;
+    w->len = (w->buf_len - idx < w->size) ? w->buf_len - idx : w->size;
+    if (readmem(w->kaddr + idx, KVADDR, w->buf, w->len)) {
+        w->len = 0;
+        w->failed = TRUE;
+        return NULL;
+    }
+
+    return w->buf;
+}
+
+/*
+ * The record at idx, or at the start of the buffer when idx holds the
+ * zero length wrap marker.  *next is set to the index after it.
+ */
+static char *log_record(struct log_window *w, uint32_t idx, uint32_t *next)
+{
+    char *logptr;
+    uint16_t msglen;
+
+    if (!(logptr = log_window_get(w, idx, sizeof(struct log))))
+        return NULL;
+
+    msglen = USHORT(logptr + offsetof(struct log, len));
+    if (!msglen) {
+        idx = 0;
+        if (!(logptr = log_window_get(w, idx, sizeof(struct log))))
+            return NULL;
+        msglen = USHORT(logptr + offsetof(struct log, len));
+    }
+
+    if (msglen < sizeof(struct log))
+        return NULL;
+
+    *next = idx + msglen;
+    return log_window_get(w, idx, msglen);
+}
+
+/*
+ * Records held back as --grep context are named by their sequence number
+ * and index, log_buf_len is below 1 << LOG_HANDLE_SHIFT.
+ */
+#define LOG_HANDLE_SHIFT    (24)
+#define LOG_HANDLE(seq, idx) (((ulong)(seq) << LOG_HANDLE_SHIFT) | (idx))
+
+static void dump_log_entry(char *logptr, uint64_t seq);
+
+static void print_log_entry(void *arg, unsigned long handle)
+{
+    struct log_window *w = arg;
+    uint32_t next;
+    char *logptr;
+
+    logptr = log_record(w, handle & ((1UL << LOG_HANDLE_SHIFT) - 1), &next);
+    if (logptr)
+        dump_log_entry(logptr, handle >> LOG_HANDLE_SHIFT);
+}
+
+/*
+ * struct log has no sequence number, the caller counts from log_first_seq.
+ */
+static int log_entry_selected(char *logptr, uint64_t seq)
+{
+    struct log *l = (struct log *)logptr;
+    uint32_t caller_id = 0;
+
+    if (!record_filter->active)
+        return TRUE;
+
+    if (OFFSET(printk_log_caller_id))
+        caller_id = UINT(logptr + OFFSET(printk_log_caller_id));
+
+    return filter_match(l->level, l->facility, caller_id, seq, l->ts_nsec);
+}
+
+/* value of key in a record's dictionary of NUL separated KEY=VALUE */
+static const char *log_dict_value(const char *dict, size_t dict_len,
+        const char *key, size_t *len)
+{
+    const char *end = dict + dict_len, *p, *next;
+    size_t key_len = strlen(key);
+
+    for (p = dict; p < end; p = next + 1) {
+        if (!(next = memchr(p, '\0', end - p)))
+            next = end;
+        if ((size_t)(next - p) > key_len && !memcmp(p, key, key_len) &&
+                p[key_len] == '=') {
+            *len = next - p - key_len - 1;
+            return p + key_len + 1;
+        }
+    }
+
+    *len = 0;
+    return NULL;
+}
+
+static void dump_log_entry_structured(char *logptr, uint64_t seq)
+{
+    struct log *l = (struct log *)logptr;
+    struct output_record r;
+    const char *dict;
+
+    r.seq = seq;
+    r.ts_nsec = l->ts_nsec;
+    r.level = l->level;
+    r.facility = l->facility;
+    r.flags = l->flags;
+    r.has_caller = OFFSET(printk_log_caller_id) != 0;
+    r.caller_id = r.has_caller ? UINT(logptr + OFFSET(printk_log_caller_id)) : 0;
+    r.text = logptr + sizeof(struct log);
+    r.text_len = l->text_len;
+
+    dict = r.text + l->text_len;
+    r.subsystem = log_dict_value(dict, l->dict_len, "SUBSYSTEM", &r.subsystem_len);
+    r.device = log_dict_value(dict, l->dict_len, "DEVICE", &r.device_len);
+
+    output_record(&r);
+}
+
+static void dump_log_entry(char *logptr, uint64_t seq)
+{
+    char *msg;
+    uint16_t text_len;
+    uint64_t ts_nsec;
+
+    if (pc->format != FORMAT_TEXT) {
+        dump_log_entry_structured(logptr, seq);
+        return;
+    }
+
+    text_len = USHORT(logptr + offsetof(struct log, text_len));
+
+    ts_nsec = ULONGLONG(logptr);
+    msg = logptr + sizeof(struct log);
+
+    output_timestamp(ts_nsec);
+
+    dump_text(msg, text_len);
+
+    output_record_end();
+}
+
+static int log_entry_text_match(char *logptr)
+{
+    return text_filter_match(logptr + sizeof(struct log),
+            USHORT(logptr + offsetof(struct log, text_len)));
+}
+
+/*
+ * Print one record of the walk, or hold it back as --grep context.
+ * *skip counts the records still left out for --tail.
+ */
+static void log_walk_entry(struct log_window *w, char *logptr, uint64_t seq,
+        ulong *skip)
+{
+    int matched;
+
+    if (!log_entry_selected(logptr, seq)) {
+        /* not a candidate, not even as context */
+    } else if (text_filter->nr_patterns) {
+        matched = log_entry_text_match(logptr);
+        if (matched && *skip) {
+            (*skip)--;
+            text_filter_skip();
+        } else {
+            text_filter_record(matched, print_log_entry, w,
+                    LOG_HANDLE(seq, logptr - w->buf + w->base));
+        }
+    } else if (*skip) {
+        (*skip)--;
+    } else {
+        dump_log_entry(logptr, seq);
+    }
+}
+
+/* the indices a poll reads, next to each other in the kernel's .bss */
+static char *log_index_symbols[] = {
+    "log_first_idx",
+    "log_first_seq",
+    "log_next_idx",
+    "log_next_seq",
+};
+
+/*
+ * Follow a 3.5+ log_buf.  Each poll reads log_next_seq alone and stops
+ * there if it did not move.  Otherwise the indices are read together,
+ * then only the bytes written between the last poll's log_next_idx and
+ * the new one, in two pieces when the writer wrapped to the start of
+ * the buffer.  log_first_seq is read again afterwards: the kernel moves
+ * it before overwriting records, so if it did not pass idx the copy is
+ * intact.  w holds all of log_buf.
+ */
+static void log_follow(struct log_window *w, uint32_t idx, uint64_t seq)
+{
+    uint32_t first_idx, next_idx, next;
+    uint64_t first_seq, next_seq, ts_nsec = 0;
+    ulong skip = 0;
+    int ret;
+    char *logptr;
+
+    symbol_data_flush();
+
+    while (follow_wait()) {
+        get_symbol_data("log_next_seq", sizeof(next_seq), &next_seq);
+        if (next_seq == seq)
+            continue;
+
+        symbol_data_prefetch_list(log_index_symbols,
+                sizeof(log_index_symbols) / sizeof(log_index_symbols[0]));
+        get_symbol_data("log_first_idx", sizeof(first_idx), &first_idx);
+        get_symbol_data("log_first_seq", sizeof(first_seq), &first_seq);
+        get_symbol_data("log_next_idx", sizeof(next_idx), &next_idx);
+        get_symbol_data("log_next_seq", sizeof(next_seq), &next_seq);
+        symbol_data_flush();
+
+        if (next_idx >= w->buf_len || first_idx >= w->buf_len)
+            continue;
+
+        if (next_seq < seq) {
+            pr_warning("Guest rebooted, following the new log");
+            idx = first_idx;
+            seq = first_seq;
+        } else if (first_seq > seq) {
+            /* the writers lapped us, resume at the oldest record left */
+            pr_warning("%llu messages lost, the ring was overwritten",
+                    (ulonglong)(first_seq - seq));
+            idx = first_idx;
+            seq = first_seq;
+        }
+
+        if (next_idx > idx) {
+            ret = readmem(w->kaddr + idx, KVADDR, w->buf + idx, next_idx - idx);
+        } else {
+            ret = readmem(w->kaddr + idx, KVADDR, w->buf + idx,
+                    w->buf_len - idx);
+            if (!ret && next_idx)
+                ret = readmem(w->kaddr, KVADDR, w->buf, next_idx);
+        }
+        if (ret)
+            continue;
+
+        get_symbol_data("log_first_seq", sizeof(first_seq), &first_seq);
+        if (first_seq > seq)
+            continue;
+
+        while (seq != next_seq) {
+            if (!(logptr = log_record(w, idx, &next)))
+                break;
+            ts_nsec = ((struct log *)logptr)->ts_nsec;
+            log_walk_entry(w, logptr, seq, &skip);
+            cursor_advance(seq, ts_nsec);
+            seq++;
+            idx = next;
+            if (idx >= w->buf_len)
+                break;
+        }
+
+        /* a torn walk starts over from the indices */
+        if (seq != next_seq || idx != next_idx) {
+            if (KDEBUG(1))
+                pr_debug("follow: walk ended at %u, log_next_idx %u",
+                        idx, next_idx);
+            idx = next_idx;
+            seq = next_seq;
+        }
+    }
+}
+
+/*
+ * Whether the last record handled by --cursor still carries the saved
+ * timestamp, -1 if it is not in the buffer.  The release, KASLR offset
+ * and log_buf are the same after a reboot without KASLR, so this is
+ * what tells the boots apart.  The records only link forward, the
+ * buffer is walked up to the cursor's.
+ */
+static int log_cursor_match(struct log_window *w, uint32_t idx, uint64_t seq,
+        uint32_t next_idx)
+{
+    uint64_t last_seq, last_ts;
+    uint32_t next;
+    char *logptr;
+
+    if (cursor_last(&last_seq, &last_ts) || last_seq < seq)
+        return -1;
+
+    while (idx != next_idx) {
+        if (!(logptr = log_record(w, idx, &next)))
+            break;
+        if (seq == last_seq)
+            return ((struct log *)logptr)->ts_nsec == last_ts;
+        seq++;
+        idx = next;
+        if (idx >= w->buf_len)
+            break;
+    }
+
+    return -1;
+}
+
+/* the smallest window worth streaming log_buf with */
+#define LOG_MIN_WINDOW  (64 << 10)
+
+/* 0 once the log was printed, -1 if it could not be read */
+int dump_variable_length_record_log(void)
+{
+    uint32_t idx, next, log_first_idx, log_next_idx, log_buf_len;
+    uint64_t seq, log_first_seq = 0, log_next_seq = 0, ts_nsec = 0;
+    ulong log_buf, skip;
+    struct log_window w;
+    char *logptr;
+    int ret = -1;
+
+    if (get_symbol_data("log_buf_len", sizeof(uint32_t), &log_buf_len))
+        return -1;
+    if (!(log_buf = kt->log_buf) &&
+            get_symbol_data("log_buf", sizeof(char *), &log_buf))
+        return -1;
+    log_buf_len &= ((1<<20) | ((1<<20) - 1));
+
+    memset(&w, 0, sizeof(w));
+    w.kaddr = log_buf;
+    w.buf_len = log_buf_len;
+    w.size = log_buf_len;
+    /* --atomic copies the whole buffer in one pause, --follow keeps it */
+    if (pc->max_memory && pc->max_memory < log_buf_len && !pc->atomic &&
+            !pc->follow) {
+        w.size = pc->max_memory < LOG_MIN_WINDOW ? LOG_MIN_WINDOW : pc->max_memory;
+        if (w.size > log_buf_len)
+            w.size = log_buf_len;
+        if (KDEBUG(1))
+            pr_debug("streaming: %u of %u bytes", w.size, log_buf_len);
+    }
+    w.buf = xmalloc(w.size);
+
+    /* the indices are read again, with the buffer, while paused */
+    if (pc->atomic) {
+        if (guest_pause())
+            goto out;
+        symbol_data_flush();
+        symbol_data_prefetch();
+    }
+
+    if (get_symbol_data("log_first_idx", sizeof(uint32_t), &log_first_idx) ||
+            get_symbol_data("log_next_idx", sizeof(uint32_t), &log_next_idx))
+        goto out;
+    if ((record_filter->active || pc->format != FORMAT_TEXT || pc->cursor ||
+                pc->follow) && kernel_symbol_exists("log_first_seq") &&
+            get_symbol_data("log_first_seq", sizeof(uint64_t), &log_first_seq))
+        goto out;
+    if ((pc->cursor || pc->probe || pc->follow) &&
+            kernel_symbol_exists("log_next_seq")) {
+        if (get_symbol_data("log_next_seq", sizeof(uint64_t), &log_next_seq))
+            goto out;
+        session_cache_observe(symbol_data_kaddr("log_next_seq"),
+                sizeof(log_next_seq), log_next_seq);
+    }
+
+    if (KDEBUG(1)) {
+        pr_debug("log_buf: %lx", (ulong)log_buf);
+        pr_debug("log_buf_len: %d", log_buf_len);
+        pr_debug("log_first_idx: %d", log_first_idx);
+        pr_debug("log_next_idx: %d", log_next_idx);
+    }
+
+    /* the whole buffer is read up front, a window on demand */
+    if (w.size == log_buf_len && !log_window_get(&w, 0, log_buf_len)) {
+        pr_err("Cannot read log_buf contents");
+        goto out;
+    }
+    guest_resume();
+
+    if (pc->cursor)
+        cursor_resume(log_first_seq, log_next_seq, log_cursor_match(&w,
+                    log_first_idx, log_first_seq, log_next_idx));
+
+    if (record_filter->nr_callers && !OFFSET(printk_log_caller_id))
+        pr_warning("Kernel has no caller ids, --caller matches nothing");
+
+    /* the records only link forward, count them to find the last N */
+    skip = 0;
+    if (pc->tail) {
+        idx = log_first_idx;
+        seq = log_first_seq;
+        while (idx != log_next_idx) {
+            if (!(logptr = log_record(&w, idx, &next)))
+                break;
+            if (log_entry_selected(logptr, seq++) &&
+                    (!text_filter->nr_patterns || log_entry_text_match(logptr)))
+                skip++;
+            idx = next;
+            if (idx >= log_buf_len)
+                break;
+        }
+        skip = (skip > pc->tail) ? skip - pc->tail : 0;
+    }
+
+    idx = log_first_idx;
+    seq = log_first_seq;
+    while (idx != log_next_idx) {
+        if (!(logptr = log_record(&w, idx, &next)))
+            break;
+        ts_nsec = ((struct log *)logptr)->ts_nsec;
+        log_walk_entry(&w, logptr, seq++, &skip);
+
+        idx = next;
+
+        if (idx >= log_buf_len) {
+            break;
+        }
+    }
+
+    if (seq != log_first_seq)
+        cursor_advance(seq - 1, ts_nsec);
+
+    /* a window that could not be refilled ends the walk early */
+    if (w.failed) {
+        pr_err("Cannot read log_buf contents");
+        goto out;
+    }
+
+    if (pc->follow) {
+        if (kernel_symbol_exists("log_first_seq") &&
+                kernel_symbol_exists("log_next_seq"))
+            log_follow(&w, log_next_idx, log_next_seq);
+        else
+            pr_warning("--follow needs log_first_seq and log_next_seq, ignored");
+    }
+    ret = 0;
+
+out:
+    guest_resume();
+    xfree(w.buf);
+    return ret;
+}
+
+/* a pre-3.5 log_buf is plain text, 0 once it was printed */
+int dump_plain_log(void)
+{
+    ulong log_buf_len = 0, log_buf = 0, i, end;
+    char *logbuf_arry, *start, *q;
+    int next_line = FALSE;
+
+    if (pc->follow)
+        pr_warning("--follow needs a structured log buffer (3.5+), ignored");
+
+    if (record_filter->active || text_filter->nr_patterns)
+        pr_warning("Record filters need a structured log buffer (3.5+), ignored");
+    if (pc->format != FORMAT_TEXT)
+        pr_warning("--format needs a structured log buffer (3.5+), printing text");
+    if (pc->cursor)
+        pr_warning("--cursor needs a structured log buffer (3.5+), ignored");
+
+    if (!(log_buf = kt->log_buf) &&
+            get_symbol_data("log_buf", sizeof(char *), &log_buf))
+        return -1;
+    if (get_symbol_data("log_buf_len", sizeof(uint32_t), &log_buf_len))
+        return -1;
+
+    log_buf_len &= ((1<<20) | ((1<<20) - 1));
+    logbuf_arry = xmalloc(log_buf_len);
+
+    if (KDEBUG(1)) {
+        pr_debug("log_buf len: %ld (0x%lx)", log_buf_len, log_buf_len);
+        pr_debug("log_buf addr: 0x%lx", log_buf);
+    }
+    if (pc->atomic && guest_pause()) {
+        xfree(logbuf_arry);
+        return -1;
+    }
+    if (pc->probe && kernel_symbol_exists("log_end")) {
+        uint32_t log_end;
+
+        if (!get_symbol_data("log_end", sizeof(log_end), &log_end))
+            session_cache_observe(symbol_data_kaddr("log_end"),
+                    sizeof(log_end), log_end);
+    }
+    if (readmem(log_buf, KVADDR, logbuf_arry, log_buf_len)) {
+        pr_err("Cannot read log_buf contents");
+        guest_resume();
+        xfree(logbuf_arry);
+        return -1;
+    }
+    guest_resume();
+
+    /*
+     * Runs of 7-bit text are copied as they are, NULs end a line and
+     * bytes with the high bit set are dropped (escaped with --escape).
+     */
+    for (i = 0; i < log_buf_len; ) {
+        end = i + OUTPUT_CHUNK_SIZE / 4 < log_buf_len ? i + OUTPUT_CHUNK_SIZE / 4 : log_buf_len;
+        start = output_reserve(4 * (end - i));
+        q = start;
+
+        while (i < end) {
+            size_t n = text_clean_span(logbuf_arry + i, end - i, TEXT_ASCII);
+
+            if (n) {
+                memcpy(q, logbuf_arry + i, n);
+                q += n;
+                i += n;
+                next_line = TRUE;
+                continue;
+            }
+
+            if (!logbuf_arry[i]) {
+                if (next_line)
+                    *q++ = '\n';
+                next_line = FALSE;
+            } else if (pc->escape) {
+                q += text_sanitize(q, logbuf_arry + i, 1);
+                next_line = TRUE;
+            }
+            i++;
+        }
+        output_advance(q - start);
+    }
+    output_record_end();
+    xfree(logbuf_arry);
+    return 0;
+}
@@ -0,0 +1,385 @@
+/* filter.c
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "xutil.h"
+#include "log.h"
+#include "defs.h"
+#include "filter.h"
+#include "output.h"
+
+/* no criterion and no pattern, everything matches */
+void filter_reset(void)
+{
+    memset(record_filter, 0, sizeof(*record_filter));
+    record_filter->seq_max = UINT64_MAX;
+    record_filter->ts_max = UINT64_MAX;
+    memset(text_filter, 0, sizeof(*text_filter));
+}
+
+static const char *level_names[] = {
+    "emerg", "alert", "crit", "err", "warn", "notice", "info", "debug",
+};
+
+static const char *facility_names[] = {
+    "kern", "user", "mail", "daemon", "auth", "syslog", "lpr", "news",
+    "uucp", "cron", "authpriv", "ftp", "res0", "res1", "res2", "res3",
+    "local0", "local1", "local2", "local3", "local4", "local5", "local6", "local7",
+};
+
+static int name_lookup(const char *names[], int nr, const char *s, size_t len)
+{
+    char *end;
+    long v;
+    int i;
+
+    for (i = 0; i < nr; i++) {
+        if (strlen(names[i]) == len && !strncasecmp(names[i], s, len))
+            return i;
+    }
+
+    v = strtol(s, &end, 10);
+    if (end == s + len && v >= 0 && v < nr)
+        return v;
+
+    return -1;
+}
+
+/*
+ * Comma separated level names or numbers.  "warn+" selects warn and
+ * every more severe level, "+warn" warn and every less severe one.
+ */
+int filter_parse_levels(const char *arg)
+{
+    const char *p = arg, *end;
+    int level, above, below;
+    size_t len;
+
+    while (*p) {
+        end = strchr(p, ',');
+        len = end ? (size_t)(end - p) : strlen(p);
+
+        below = (len && p[0] == '+');
+        above = (len && p[len - 1] == '+');
+        level = name_lookup(level_names, 8, p + below, len - below - above);
+        if (level < 0 || (above && below)) {
+            pr_err("Unknown level '%.*s'", (int)len, p);
+            return -1;
+        }
+
+        if (above)
+            record_filter->levels |= (2U << level) - 1;
+        else if (below)
+            record_filter->levels |= 0xffU & ~((1U << level) - 1);
+        else
+            record_filter->levels |= 1U << level;
+
+        p += len + (end ? 1 : 0);
+    }
+
+    record_filter->active = 1;
+    return 0;
+}
+
+int filter_parse_facilities(const char *arg)
+{
+    const char *p = arg, *end;
+    int facility;
+    size_t len;
+
+    while (*p) {
+        end = strchr(p, ',');
+        len = end ? (size_t)(end - p) : strlen(p);
+
+        facility = name_lookup(facility_names, 24, p, len);
+        if (facility < 0) {
+            pr_err("Unknown facility '%.*s'", (int)len, p);
+            return -1;
+        }
+        record_filter->facilities |= 1U << facility;
+
+        p += len + (end ? 1 : 0);
+    }
+
+    record_filter->active = 1;
+    return 0;
+}
+
+/*
+ * Comma separated callers as printed with CONFIG_PRINTK_CALLER:
+ * "T<pid>" for a task, "C<cpu>" for a CPU.
+ */
+int filter_parse_callers(const char *arg)
+{
+    const char *p = arg;
+    unsigned long v;
+    char *end;
+
+    while (*p) {
+        if ((toupper(*p) != 'T' && toupper(*p) != 'C') || !isdigit(p[1]))
+            goto err;
+
+        v = strtoul(p + 1, &end, 10);
+        if (*end && *end != ',')
+            goto err;
+        if (record_filter->nr_callers == FILTER_MAX_CALLERS) {
+            pr_err("Too many callers, at most %d", FILTER_MAX_CALLERS);
+            return -1;
+        }
+
+        record_filter->callers[record_filter->nr_callers++] =
+            (toupper(*p) == 'C') ? (0x80000000U | v) : v;
+
+        p = *end ? end + 1 : end;
+    }
+
+    record_filter->active = 1;
+    return 0;
+
+err:
+    pr_err("Invalid caller '%s', expected T<pid> or C<cpu>", p);
+    return -1;
+}
+
+/* "FIRST-LAST", "FIRST-" or "-LAST" */
+int filter_parse_seq(const char *arg)
+{
+    const char *dash = strchr(arg, '-');
+    char *end;
+
+    if (!dash) {
+        pr_err("Invalid sequence range '%s', expected FIRST-LAST", arg);
+        return -1;
+    }
+
+    if (dash != arg) {
+        record_filter->seq_min = strtoull(arg, &end, 10);
+        if (end != dash)
+            goto err;
+    }
+    if (dash[1]) {
+        record_filter->seq_max = strtoull(dash + 1, &end, 10);
+        if (*end)
+            goto err;
+    }
+
+    record_filter->active = 1;
+    return 0;
+
+err:
+    pr_err("Invalid sequence range '%s'", arg);
+    return -1;
+}
+
+/* Guest monotonic time in seconds as printed by dmesg, e.g. "123.456789" */
+int filter_parse_time(const char *arg, uint64_t *ns)
+{
+    const char *p = arg;
+    uint64_t sec = 0, frac = 0, scale = 1000000000ULL;
+
+    if (!isdigit(*p) && !(*p == '.' && isdigit(p[1])))
+        goto err;
+
+    for (; isdigit(*p); p++) {
+        if (sec > UINT64_MAX / 10 / 1000000000ULL)
+            goto err;
+        sec = sec * 10 + (*p - '0');
+    }
+
+    if (*p == '.') {
+        for (p++; isdigit(*p); p++) {
+            if (scale > 1) {
+                scale /= 10;
+                frac += (*p - '0') * scale;
+            }
+        }
+    }
+
+    if (*p)
+        goto err;
+
+    *ns = sec * 1000000000ULL + frac;
+    record_filter->active = 1;
+    return 0;
+
+err:
+    pr_err("Invalid time '%s', expected seconds such as 12.5", arg);
+    return -1;
+}
+
+/*
+ * Candidate positions are found by the first two bytes of each pattern,
+ * sixteen positions at a time, and only those are compared in full.
+ * first_bytes[] does the same one position at a time for the tail.
+ */
+
+int filter_add_pattern(const char *arg)
+{
+    struct text_filter *t = text_filter;
+    size_t len = strlen(arg);
+
+    if (!len) {
+        pr_err("Empty pattern");
+        return -1;
+    }
+    if (t->nr_patterns == FILTER_MAX_PATTERNS) {
+        pr_err("Too many patterns, at most %d", FILTER_MAX_PATTERNS);
+        return -1;
+    }
+
+    t->first_bytes[(unsigned char)arg[0]] = 1;
+#ifdef __SSE2__
+    t->pattern_byte0[t->nr_patterns] = _mm_set1_epi8(arg[0]);
+    /* a one byte pattern matches whatever follows it */
+    t->pattern_byte1[t->nr_patterns] = (len > 1) ? _mm_set1_epi8(arg[1]) :
+        _mm_setzero_si128();
+#endif
+
+    t->patterns[t->nr_patterns] = arg;
+    t->lengths[t->nr_patterns] = len;
+    t->nr_patterns++;
+    return 0;
+}
+
+int filter_parse_context(const char *arg)
+{
+    char *end;
+    long v = strtol(arg, &end, 10);
+
+    if (*end || end == arg || v < 0 || v > FILTER_MAX_CONTEXT) {
+        pr_err("Invalid context '%s', expected 0-%d", arg, FILTER_MAX_CONTEXT);
+        return -1;
+    }
+
+    text_filter->context = v;
+    return 0;
+}
+
+static int text_filter_verify(const unsigned char *p, const unsigned char *end)
+{
+    struct text_filter *t = text_filter;
+    int i;
+
+    for (i = 0; i < t->nr_patterns; i++) {
+        if (t->lengths[i] <= (size_t)(end - p) &&
+                !memcmp(p, t->patterns[i], t->lengths[i]))
+            return 1;
+    }
+
+    return 0;
+}
+
+int text_filter_match(const char *text, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)text;
+    const unsigned char *end = p + len;
+    struct text_filter *t = text_filter;
+#ifdef __SSE2__
+    __m128i v0, v1, hit, eq;
+    unsigned int mask;
+    int i;
+
+    /* p + 1 is loaded as well, so stop one byte early */
+    for (; end - p > 16; p += 16) {
+        v0 = _mm_loadu_si128((const __m128i *)p);
+        v1 = _mm_loadu_si128((const __m128i *)(p + 1));
+        hit = _mm_setzero_si128();
+
+        for (i = 0; i < t->nr_patterns; i++) {
+            eq = _mm_cmpeq_epi8(v0, t->pattern_byte0[i]);
+            if (t->lengths[i] > 1)
+                eq = _mm_and_si128(eq, _mm_cmpeq_epi8(v1, t->pattern_byte1[i]));
+            hit = _mm_or_si128(hit, eq);
+        }
+
+        for (mask = _mm_movemask_epi8(hit); mask; mask &= mask - 1) {
+            if (text_filter_verify(p + __builtin_ctz(mask), end))
+                return 1;
+        }
+    }
+#endif
+
+    for (; p < end; p++) {
+        if (t->first_bytes[*p] && text_filter_verify(p, end))
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Decide whether a record that passed the record filter is printed,
+ * as a match or as context.  Up to text_filter->context earlier records
+ * are held back by handle and printed when a match follows.
+ */
+void text_filter_record(int matched, record_print_t print, void *arg,
+        unsigned long handle)
+{
+    struct text_filter *t = text_filter;
+    int c = t->context;
+    int i;
+
+    if (matched) {
+        /* the separator is not a record, structured output has none */
+        if (t->context_printed && t->context_gap && c && pc->format == FORMAT_TEXT)
+            output_write("--\n", 3);
+        for (i = 0; i < t->context_nr; i++)
+            print(arg, t->context_ring[(t->context_head + c -
+                        t->context_nr + i) % c]);
+        print(arg, handle);
+
+        t->context_nr = 0;
+        t->context_after = c;
+        t->context_printed = TRUE;
+        t->context_gap = FALSE;
+        t->context_hold = FALSE;
+    } else if (t->context_hold) {
+        t->context_gap = TRUE;
+    } else if (t->context_after) {
+        print(arg, handle);
+        t->context_after--;
+    } else if (c) {
+        if (t->context_nr == c)
+            t->context_gap = TRUE;
+        else
+            t->context_nr++;
+        t->context_ring[t->context_head] = handle;
+        t->context_head = (t->context_head + 1) % c;
+    } else {
+        t->context_gap = TRUE;
+    }
+}
+
+/*
+ * A record that matched but is left out, e.g. above --tail.  Output
+ * resumes with the next match, without context before it.
+ */
+void text_filter_skip(void)
+{
+    struct text_filter *t = text_filter;
+
+    t->context_nr = 0;
+    t->context_after = 0;
+    t->context_gap = TRUE;
+    t->context_hold = TRUE;
+}
@@ -0,0 +1,119 @@
+/* filter.h
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __FILTER_H__
+#define __FILTER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define FILTER_MAX_CALLERS  (32)
+#define FILTER_MAX_PATTERNS (16)
+#define FILTER_MAX_CONTEXT  (1024)
+
+/*
+ * Record selection on metadata only, evaluated before the text of a
+ * record is read.  A criterion that was not given matches everything.
+ */
+struct record_filter {
+    int active;
+    uint32_t levels;                /* bit per syslog level, 0 = any */
+    uint32_t facilities;            /* bit per syslog facility, 0 = any */
+    int nr_callers;
+    uint32_t callers[FILTER_MAX_CALLERS];
+    uint64_t seq_min;
+    uint64_t seq_max;
+    uint64_t ts_min;                /* guest monotonic nanoseconds */
+    uint64_t ts_max;
+};
+
+/* the current session's, see session_switch() */
+extern struct record_filter *record_filter;
+
+/*
+ * Fixed-string search over the record text, applied to records that
+ * passed the record filter.  Records within context of a match are
+ * printed too, with "--" between groups that are not adjacent.
+ */
+struct text_filter {
+    int nr_patterns;
+    const char *patterns[FILTER_MAX_PATTERNS];
+    size_t lengths[FILTER_MAX_PATTERNS];
+    int context;
+
+    /* candidate positions, see filter_add_pattern() */
+    unsigned char first_bytes[256];
+#ifdef __SSE2__
+    __m128i pattern_byte0[FILTER_MAX_PATTERNS];
+    __m128i pattern_byte1[FILTER_MAX_PATTERNS];
+#endif
+
+    /* records held back as context, see text_filter_record() */
+    unsigned long context_ring[FILTER_MAX_CONTEXT];
+    int context_head, context_nr, context_after;
+    int context_printed, context_gap, context_hold;
+};
+
+/* the current session's, see session_switch() */
+extern struct text_filter *text_filter;
+
+typedef void (*record_print_t)(void *arg, unsigned long handle);
+
+void filter_reset(void);
+int filter_parse_levels(const char *arg);
+int filter_parse_facilities(const char *arg);
+int filter_parse_callers(const char *arg);
+int filter_parse_seq(const char *arg);
+int filter_parse_time(const char *arg, uint64_t *ns);
+int filter_add_pattern(const char *arg);
+int filter_parse_context(const char *arg);
+int text_filter_match(const char *text, size_t len);
+void text_filter_record(int matched, record_print_t print, void *arg,
+        unsigned long handle);
+void text_filter_skip(void);
+
+static inline int filter_match(uint8_t level, uint8_t facility,
+        uint32_t caller_id, uint64_t seq, uint64_t ts_nsec)
+{
+    struct record_filter *f = record_filter;
+    int i;
+
+    if (!f->active)
+        return 1;
+
+    if (f->levels && !(f->levels & (1U << level)))
+        return 0;
+    if (f->facilities && !(f->facilities & (1U << facility)))
+        return 0;
+    if (seq < f->seq_min || seq > f->seq_max)
+        return 0;
+    if (ts_nsec < f->ts_min || ts_nsec > f->ts_max)
+        return 0;
+    if (f->nr_callers) {
+        for (i = 0; i < f->nr_callers; i++) {
+            if (f->callers[i] == caller_id)
+                return 1;
+        }
+        return 0;
+    }
+
+    return 1;
+}
+
+#endif
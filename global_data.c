@@ -14,23 +14,26 @@
  */
 
 #include "defs.h"
+#include "session.h"
 
-FILE *fp;
-
-struct program_context program_context = { 0 };
-struct program_context *pc = &program_context;
-
-struct kernel_table kernel_table = { 0 };
-struct kernel_table *kt = &kernel_table;
-
-struct vm_table vm_table = { 0 };
-struct vm_table *vt = &vm_table;
+/* the session of a single guest run, until session_switch() */
+struct session session_default = {
+    .machdep_table.machspec = &session_default.machine_specific,
+    .record_filter = {
+        .seq_max = UINT64_MAX,
+        .ts_max = UINT64_MAX,
+    },
+};
 
-struct symbol_table_data symbol_table_data = { 0 };
-struct symbol_table_data *st = &symbol_table_data;
-
-struct machdep_table machdep_table = { 0 };
-struct machdep_table *machdep = &machdep_table;
-
-struct offset_table offset_table = { 0 };
-struct size_table size_table = { 0 };
+FILE *fp;
+struct program_context *pc = &session_default.program_context;
+struct record_filter *record_filter = &session_default.record_filter;
+struct text_filter *text_filter = &session_default.text_filter;
+
+struct session *session = &session_default;
+struct kernel_table *kt = &session_default.kernel_table;
+struct machdep_table *machdep = &session_default.machdep_table;
+struct vm_table *vt = &session_default.vm_table;
+struct symbol_table_data *st = &session_default.symbol_table_data;
+struct offset_table *ot = &session_default.offset_table;
+struct size_table *szt = &session_default.size_table;
@@ -1,10 +1,18 @@
 #include "defs.h"
+#include "xutil.h"
 
 void kernel_init() {
+  char *release;
+
   // We cannot use VMCOREINFO_OFFSET to get 'name'
   // from struct uts_namespace. Fortunately, 'release' has already
   // been recorded in VMCOREINFO_OSRELEASE, so let's simply search
   // it from vmcoreinfo_data.
 
-  parse_kernel_version(vmcoreinfo_read_string("OSRELEASE"));
+  release = vmcoreinfo_read_string("OSRELEASE");
+  if (release)
+    xstrlcpy(kt->release, release, sizeof(kt->release));
+
+  parse_kernel_version(release);
+  xfree(release);
 }
@@ -0,0 +1,91 @@
+/* kvm-dmesg.h
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __KVM_DMESG_H__
+#define __KVM_DMESG_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * libkvmdmesg: the kernel log of KVM guests, record by record.
+ *
+ *     struct kvm_dmesg *d = kvm_dmesg_open("vm1", "System.map");
+ *     struct kvm_dmesg_record r;
+ *
+ *     while (kvm_dmesg_read(d) >= 0) {
+ *         while (kvm_dmesg_next(d, &r))
+ *             printf("%.*s\n", (int)r.text_len, r.text);
+ *         sleep(1);
+ *     }
+ *     kvm_dmesg_close(d);
+ *
+ * A handle stays attached to its guest, with the address translation,
+ * symbols and structure layout resolved once at open.  Any number of
+ * handles may be open and used from any thread; calls are serialized,
+ * one runs at a time even for different handles.
+ */
+struct kvm_dmesg;
+
+struct kvm_dmesg_record {
+    uint64_t seq;
+    uint64_t ts_nsec;               /* guest monotonic time */
+    uint8_t level;                  /* syslog level, 0 (emerg) to 7 (debug) */
+    uint8_t facility;
+    uint8_t flags;                  /* printk flags, 8 is a continuation */
+    int has_caller;                 /* kernel has CONFIG_PRINTK_CALLER */
+    uint32_t caller_id;             /* pid, or cpu with bit 31 set */
+    const char *text;               /* NUL terminated, may hold other bytes */
+    size_t text_len;
+    const char *subsystem;          /* NULL when the record has none */
+    size_t subsystem_len;
+    const char *device;             /* NULL when the record has none */
+    size_t device_len;
+};
+
+/*
+ * Attach to guest, a libvirt domain name, a QMP socket or a guest memory
+ * image, whose kernel matches system_map.  NULL on failure.
+ */
+struct kvm_dmesg *kvm_dmesg_open(const char *guest, const char *system_map);
+
+/* a snapshot written by kvm-dmesg --save, no guest or System.map needed */
+struct kvm_dmesg *kvm_dmesg_open_snapshot(const char *path);
+
+/*
+ * Fetch the records logged since the last call, all of them the first
+ * time.  Returns how many there are, -1 if the guest's log cannot be
+ * read (or is a pre-3.5 plain text buffer) or memory ran out.
+ */
+int kvm_dmesg_read(struct kvm_dmesg *d);
+
+/*
+ * Iterate over the records of the last kvm_dmesg_read() in order.
+ * Returns 1 with *rec filled, 0 after the last one.  rec's strings stay
+ * valid until the next kvm_dmesg_read() or kvm_dmesg_close().
+ */
+int kvm_dmesg_next(struct kvm_dmesg *d, struct kvm_dmesg_record *rec);
+
+void kvm_dmesg_close(struct kvm_dmesg *d);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
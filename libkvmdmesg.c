@@ -0,0 +1,291 @@
+/* libkvmdmesg.c
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "xutil.h"
+#include "log.h"
+#include "defs.h"
+#include "printk.h"
+#include "filter.h"
+#include "output.h"
+#include "session.h"
+#include "kvm-dmesg.h"
+
+/*
+ * The library is built from the same objects as kvm-dmesg with hidden
+ * visibility, only these functions are exported.  Each handle owns a
+ * session, options and filters included, made current for the duration
+ * of a call: records are handed to kvm_dmesg_collect() through
+ * FORMAT_RECORD and the record filter starts past the last record
+ * already returned.  The decoders reach the current session through
+ * globals, so calls are serialized by kvm_dmesg_lock.  Running out of
+ * memory fails the call rather than the caller's process: each call
+ * catches xfatal() with setjmp() right after kvm_dmesg_enter().
+ */
+#define KVM_DMESG_EXPORT    __attribute__((visibility("default")))
+
+/* a record of the last read, strings as offsets into the arena */
+struct kvm_dmesg_entry {
+    struct kvm_dmesg_record rec;
+    size_t text;
+    size_t subsystem;
+    size_t device;
+};
+
+struct kvm_dmesg {
+    struct session *session;
+    uint64_t next_seq;              /* first sequence number not returned */
+
+    struct kvm_dmesg_entry *entries;
+    size_t nr_entries;
+    size_t max_entries;
+    size_t pos;                     /* kvm_dmesg_next() */
+
+    char *arena;
+    size_t arena_len;
+    size_t arena_size;
+};
+
+static pthread_mutex_t kvm_dmesg_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the session of the caller's program, when it is kvm-dmesg itself */
+struct kvm_dmesg_call {
+    struct session *prev;
+    jmp_buf *prev_fatal;
+    jmp_buf fatal;
+};
+
+static void kvm_dmesg_enter(struct kvm_dmesg_call *call, struct session *s)
+{
+    pthread_mutex_lock(&kvm_dmesg_lock);
+
+    call->prev = session;
+    call->prev_fatal = xfatal_jmp;
+    xfatal_jmp = &call->fatal;
+
+    if (s)
+        session_switch(s);
+}
+
+static void kvm_dmesg_leave(struct kvm_dmesg_call *call)
+{
+    xfatal_jmp = call->prev_fatal;
+    session_switch(call->prev);
+
+    pthread_mutex_unlock(&kvm_dmesg_lock);
+}
+
+static size_t kvm_dmesg_store(struct kvm_dmesg *d, const char *s, size_t len)
+{
+    size_t off = d->arena_len;
+
+    if (d->arena_len + len + 1 > d->arena_size) {
+        while (d->arena_len + len + 1 > d->arena_size)
+            d->arena_size = d->arena_size ? d->arena_size * 2 : 65536;
+        d->arena = xrealloc(d->arena, d->arena_size);
+    }
+
+    if (len)
+        memcpy(d->arena + off, s, len);
+    d->arena[off + len] = NULLCHAR;
+    d->arena_len += len + 1;
+
+    return off;
+}
+
+static void kvm_dmesg_collect(const struct output_record *r, void *arg)
+{
+    struct kvm_dmesg *d = arg;
+    struct kvm_dmesg_entry *e;
+
+    if (d->nr_entries == d->max_entries) {
+        d->max_entries = d->max_entries ? d->max_entries * 2 : 256;
+        d->entries = xrealloc(d->entries, d->max_entries * sizeof(*d->entries));
+    }
+
+    e = &d->entries[d->nr_entries++];
+    memset(e, 0, sizeof(*e));
+    e->rec.seq = r->seq;
+    e->rec.ts_nsec = r->ts_nsec;
+    e->rec.level = r->level;
+    e->rec.facility = r->facility;
+    e->rec.flags = r->flags;
+    e->rec.has_caller = r->has_caller;
+    e->rec.caller_id = r->caller_id;
+    e->rec.text_len = r->text_len;
+    e->rec.subsystem_len = r->subsystem_len;
+    e->rec.device_len = r->device_len;
+    e->text = kvm_dmesg_store(d, r->text, r->text_len);
+    if (r->subsystem_len)
+        e->subsystem = kvm_dmesg_store(d, r->subsystem, r->subsystem_len);
+    if (r->device_len)
+        e->device = kvm_dmesg_store(d, r->device, r->device_len);
+
+    if (r->seq >= d->next_seq)
+        d->next_seq = r->seq + 1;
+}
+
+static struct kvm_dmesg *kvm_dmesg_new(void)
+{
+    struct kvm_dmesg *d = xcalloc(1, sizeof(struct kvm_dmesg));
+    int debug = pc->debug;
+
+    d->session = session_new();
+    session_switch(d->session);
+
+    memset(pc, 0, sizeof(*pc));
+    pc->format = FORMAT_RECORD;
+    /* the records are collected from the calling thread */
+    pc->jobs = 1;
+    pc->debug = debug;
+    filter_reset();
+    if (!fp)
+        fp = stdout;
+
+    return d;
+}
+
+KVM_DMESG_EXPORT
+struct kvm_dmesg *kvm_dmesg_open(const char *guest, const char *system_map)
+{
+    struct kvm_dmesg_call call;
+    struct kvm_dmesg *volatile d = NULL;
+    volatile int ret = -1;
+
+    if (!guest || !system_map)
+        return NULL;
+
+    kvm_dmesg_enter(&call, NULL);
+    if (!setjmp(call.fatal)) {
+        d = kvm_dmesg_new();
+        ret = session_open(guest, system_map);
+    }
+    kvm_dmesg_leave(&call);
+
+    if (ret) {
+        kvm_dmesg_close(d);
+        return NULL;
+    }
+    return d;
+}
+
+KVM_DMESG_EXPORT
+struct kvm_dmesg *kvm_dmesg_open_snapshot(const char *path)
+{
+    struct kvm_dmesg_call call;
+    struct kvm_dmesg *volatile d = NULL;
+    volatile int ret = -1;
+
+    if (!path)
+        return NULL;
+
+    kvm_dmesg_enter(&call, NULL);
+    if (!setjmp(call.fatal)) {
+        d = kvm_dmesg_new();
+        ret = session_load(path, NULL);
+    }
+    kvm_dmesg_leave(&call);
+
+    if (ret) {
+        kvm_dmesg_close(d);
+        return NULL;
+    }
+    return d;
+}
+
+KVM_DMESG_EXPORT
+int kvm_dmesg_read(struct kvm_dmesg *d)
+{
+    struct kvm_dmesg_call call;
+    volatile int ret = -1;
+
+    d->nr_entries = 0;
+    d->arena_len = 0;
+    d->pos = 0;
+
+    kvm_dmesg_enter(&call, d->session);
+    if (setjmp(call.fatal)) {
+        /* nothing of a read cut short is returned, the guest runs */
+        guest_resume();
+        d->nr_entries = 0;
+        ret = -1;
+        goto out;
+    }
+
+    if (d->next_seq) {
+        record_filter->seq_min = d->next_seq;
+        record_filter->active = TRUE;
+    }
+    output_set_record_fn(kvm_dmesg_collect, d);
+
+    /* the values read at open or by the last call are stale */
+    symbol_data_flush();
+    symbol_data_prefetch();
+
+    if (kernel_symbol_exists("prb"))
+        ret = dump_lockless_record_log();
+    else if (kernel_symbol_exists("log_first_idx") &&
+            kernel_symbol_exists("log_next_idx"))
+        ret = dump_variable_length_record_log();
+    else
+        ret = -1;
+
+out:
+    symbol_data_flush();
+    output_set_record_fn(NULL, NULL);
+    kvm_dmesg_leave(&call);
+
+    return ret ? ret : (int)d->nr_entries;
+}
+
+KVM_DMESG_EXPORT
+int kvm_dmesg_next(struct kvm_dmesg *d, struct kvm_dmesg_record *rec)
+{
+    struct kvm_dmesg_entry *e;
+    int ret = 0;
+
+    pthread_mutex_lock(&kvm_dmesg_lock);
+    if (d->pos < d->nr_entries) {
+        e = &d->entries[d->pos++];
+        *rec = e->rec;
+        rec->text = d->arena + e->text;
+        rec->subsystem = rec->subsystem_len ? d->arena + e->subsystem : NULL;
+        rec->device = rec->device_len ? d->arena + e->device : NULL;
+        ret = 1;
+    }
+    pthread_mutex_unlock(&kvm_dmesg_lock);
+
+    return ret;
+}
+
+KVM_DMESG_EXPORT
+void kvm_dmesg_close(struct kvm_dmesg *d)
+{
+    struct kvm_dmesg_call call;
+
+    if (!d)
+        return;
+
+    kvm_dmesg_enter(&call, NULL);
+    if (!setjmp(call.fatal))
+        session_free(d->session);
+    kvm_dmesg_leave(&call);
+    xfree(d->entries);
+    xfree(d->arena);
+    xfree(d);
+}
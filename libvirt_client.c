@@ -39,6 +39,9 @@ typedef enum {
     VIR_DOMAIN_QEMU_MONITOR_COMMAND_HMP     = (1 << 0), /* cmd is in HMP */
 } virDomainQemuMonitorCommandFlags;
 
+/* virDomainState */
+#define VIR_DOMAIN_PAUSED   3
+
 typedef void* virDomainPtr;
 typedef void* virConnectPtr;
 
@@ -47,13 +50,12 @@ int (*virConnectClose)(virConnectPtr conn);
 virDomainPtr (*virDomainLookupByName)(virConnectPtr conn, const char *name);
 int (*virDomainFree)(virDomainPtr domain);
 int (*virDomainQemuMonitorCommand)(virDomainPtr domain, const char *cmd, char **result, unsigned int flags);
+int (*virDomainSuspend)(virDomainPtr domain);
+int (*virDomainResume)(virDomainPtr domain);
+int (*virDomainGetState)(virDomainPtr domain, int *state, int *reason, unsigned int flags);
 
 void *libvirt_handle = NULL;
 void *libvirt_qemu_handle = NULL;
-virDomainPtr domain = NULL;
-virConnectPtr domain_conn = NULL;
-
-FILE *mem_file = NULL;
 
 #define CHECK_FUNC(f) if (!f) { pr_err("Error loading function: %s\n", dlerror()); return -1; }
 
@@ -83,12 +85,18 @@ static int libvirt_dlsym()
     virDomainLookupByName = dlsym(libvirt_handle, "virDomainLookupByName");
     virDomainFree = dlsym(libvirt_handle, "virDomainFree");
     virDomainQemuMonitorCommand = dlsym(libvirt_qemu_handle, "virDomainQemuMonitorCommand");
+    virDomainSuspend = dlsym(libvirt_handle, "virDomainSuspend");
+    virDomainResume = dlsym(libvirt_handle, "virDomainResume");
+    virDomainGetState = dlsym(libvirt_handle, "virDomainGetState");
 
     CHECK_FUNC(virConnectOpen);
     CHECK_FUNC(virConnectClose);
     CHECK_FUNC(virDomainLookupByName);
     CHECK_FUNC(virDomainFree);
     CHECK_FUNC(virDomainQemuMonitorCommand);
+    CHECK_FUNC(virDomainSuspend);
+    CHECK_FUNC(virDomainResume);
+    CHECK_FUNC(virDomainGetState);
 
     return 0;
 }
@@ -126,21 +134,21 @@ int libvirt_client_init(char *guest_name)
     }
 
 
-    if (!domain_conn)
-        domain_conn = virConnectOpen("qemu:///system");
+    if (!guest_client->domain_conn)
+        guest_client->domain_conn = virConnectOpen("qemu:///system");
 
-    if (!domain_conn) {
+    if (!guest_client->domain_conn) {
         pr_err("Failed to open connection to qemu:///system");
         return -1;
     }
 
-    if (!domain)
-        domain = virDomainLookupByName(domain_conn, guest_name);
+    if (!guest_client->domain)
+        guest_client->domain = virDomainLookupByName(guest_client->domain_conn, guest_name);
 
-    if (!domain) {
+    if (!guest_client->domain) {
         pr_err("Failed to find the domain: %s", guest_name);
-        virConnectClose(domain_conn);
-        domain_conn = NULL;
+        virConnectClose(guest_client->domain_conn);
+        guest_client->domain_conn = NULL;
         return -1;
     }
 
@@ -149,14 +157,14 @@ int libvirt_client_init(char *guest_name)
 
 int libvirt_client_uninit()
 {
-    if (domain) {
-        virDomainFree(domain);
-        domain = NULL;
+    if (guest_client->domain) {
+        virDomainFree(guest_client->domain);
+        guest_client->domain = NULL;
     }
 
-    if (domain_conn) {
-        virConnectClose(domain_conn);
-        domain_conn = NULL;
+    if (guest_client->domain_conn) {
+        virConnectClose(guest_client->domain_conn);
+        guest_client->domain_conn = NULL;
     }
 
     if (libvirt_handle) {
@@ -172,6 +180,36 @@ int libvirt_client_uninit()
     return 0;
 }
 
+int libvirt_suspend(void)
+{
+    if (virDomainSuspend(guest_client->domain) < 0) {
+        pr_err("Failed to suspend the domain");
+        return -1;
+    }
+
+    return 0;
+}
+
+int libvirt_resume(void)
+{
+    if (virDomainResume(guest_client->domain) < 0) {
+        pr_err("Failed to resume the domain");
+        return -1;
+    }
+
+    return 0;
+}
+
+int libvirt_is_paused(void)
+{
+    int state, reason;
+
+    if (virDomainGetState(guest_client->domain, &state, &reason, 0) < 0)
+        return -1;
+
+    return state == VIR_DOMAIN_PAUSED;
+}
+
 static unsigned long get_line_value(const char *line, const char *key)
 {
     const char *start = strstr(line, key);
@@ -190,7 +228,7 @@ int libvirt_get_registers(uint64_t *idtr, uint64_t *cr3, uint64_t *cr4)
     char hmp_command[64] = {0};
 
     snprintf(hmp_command, sizeof(hmp_command), "info registers");
-    if (virDomainQemuMonitorCommand(domain, hmp_command, &hmp_response, flag) < 0) {
+    if (virDomainQemuMonitorCommand(guest_client->domain, hmp_command, &hmp_response, flag) < 0) {
         pr_err("Failed to send QMP command: %s", hmp_command);
         return -1;
     }
@@ -225,7 +263,7 @@ static void* libvirt_dump_phy_memory(uint64_t start_addr, ssize_t size)
 
     // https://qemu-project.gitlab.io/qemu/system/monitor.html
     snprintf(hmp_command, sizeof(hmp_command), "xp /%" PRIu64 "xw 0x%zx", size / 4, start_addr);
-    if (virDomainQemuMonitorCommand(domain, hmp_command, &hmp_response, flag) < 0) {
+    if (virDomainQemuMonitorCommand(guest_client->domain, hmp_command, &hmp_response, flag) < 0) {
         pr_err("Failed to send QMP command: %s", hmp_command);
         return NULL;
     }
@@ -289,7 +327,7 @@ int libvirt_gpa2hva(uint64_t gpa, uint64_t *hva)
     char hmp_command[64] = {0};
 
     snprintf(hmp_command, sizeof(hmp_command), "gpa2hva 0x%lx", gpa);
-    if (virDomainQemuMonitorCommand(domain, hmp_command, &hmp_response, flag) < 0) {
+    if (virDomainQemuMonitorCommand(guest_client->domain, hmp_command, &hmp_response, flag) < 0) {
         pr_err("Failed to send QMP command: %s", hmp_command);
         return -1;
     }
@@ -301,11 +339,11 @@ int libvirt_gpa2hva(uint64_t gpa, uint64_t *hva)
 
 int file_client_init(char *path)
 {
-    if (mem_file)
+    if (guest_client->mem_file)
         return 0;
 
-    mem_file = fopen(path, "rb");
-    if (!mem_file) {
+    guest_client->mem_file = fopen(path, "rb");
+    if (!guest_client->mem_file) {
         pr_err("fopen error");
         return -1;
     }
@@ -314,24 +352,24 @@ int file_client_init(char *path)
 
 int file_client_uninit( )
 {
-    if (mem_file) {
-        fclose(mem_file);
+    if (guest_client->mem_file) {
+        fclose(guest_client->mem_file);
     }
-    mem_file = NULL;
+    guest_client->mem_file = NULL;
     return 0;
 }
 
 int file_readmem(uint64_t addr, void *buffer, size_t size)
 {
-    if (fseek(mem_file, addr, SEEK_SET) != 0) {
+    if (fseek(guest_client->mem_file, addr, SEEK_SET) != 0) {
         pr_err("fseek error");
         return -1;
     }
 
-    size_t bytesRead = fread(buffer, 1, size, mem_file);
+    size_t bytesRead = fread(buffer, 1, size, guest_client->mem_file);
 
     if (bytesRead != size) {
-        if (feof(mem_file)) {
+        if (feof(guest_client->mem_file)) {
             printf("eof to read: %zu\n", bytesRead);
             return bytesRead;
         } else {
@@ -16,10 +16,13 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <syslog.h>
 
 #include "log.h"
+#include "xutil.h"
 
 int loglevel = LOGLEVEL_WARNING;
+static int log_to_syslog;
 
 void log_init(int level)
 {
@@ -27,36 +30,49 @@ void log_init(int level)
         loglevel = level;
 }
 
-static void report(const char *prefix, const char *err, va_list params)
+/* a detached --daemon has no stderr, its messages go to syslog */
+void log_syslog(const char *ident)
+{
+    openlog(ident, LOG_PID, LOG_DAEMON);
+    log_to_syslog = 1;
+}
+
+static void report(int priority, const char *prefix, const char *err,
+        va_list params)
 {
     char msg[1024];
     vsnprintf(msg, sizeof(msg), err, params);
-    fprintf(stderr, "%s%s\n", prefix, msg);
+    if (log_to_syslog)
+        syslog(priority, "%s", msg);
+    else
+        fprintf(stderr, "%s%s\n", prefix, msg);
 }
 
 static void debug_builtin(const char *debug, va_list params)
 {
-    report("[Debug] ", debug, params);
+    report(LOG_DEBUG, "[Debug] ", debug, params);
 }
 
 static void info_builtin(const char *info, va_list params)
 {
-    report("[Info] ", info, params);
+    report(LOG_INFO, "[Info] ", info, params);
 }
 
 static void warn_builtin(const char *warn, va_list params)
 {
-    report("[Warning] ", warn, params);
+    report(LOG_WARNING, "[Warning] ", warn, params);
 }
 
 static void error_builtin(const char *err, va_list params)
 {
-    report("[Error] ", err, params);
+    report(LOG_ERR, "[Error] ", err, params);
 }
 
 static void die_builtin(const char *err, va_list params)
 {
-    report("[Fatal] ", err, params);
+    report(LOG_CRIT, "[Fatal] ", err, params);
+    if (xfatal_jmp)
+        longjmp(*xfatal_jmp, 1);
     exit(128);
 }
 
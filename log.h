@@ -23,6 +23,7 @@
 #define LOGLEVEL_MAX        4
 
 void log_init(int level);
+void log_syslog(const char *ident);
 
 void pr_err(const char *err, ...);
 void pr_warning(const char *err, ...);
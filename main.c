@@ -14,6 +14,7 @@
  */
 
 #include <stdio.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <ctype.h>
 #include <fcntl.h>
@@ -28,293 +29,15 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 
+#include "xutil.h"
 #include "log.h"
 #include "defs.h"
 #include "client.h"
 #include "version.h"
 #include "printk.h"
-
-struct machine_specific x86_64_machine_specific = { 0 };
-
-static ulong * x86_64_kpgd_offset(ulong kvaddr)
-{
-    ulong *pgd;
-    pgd = ((ulong *)machdep->pgd) + pgd_index(kvaddr);
-    return pgd;
-}
-
-ulong x86_64_pud_offset(ulong pgd_pte, ulong vaddr)
-{
-    ulong *pud;
-    ulong pud_paddr;
-    ulong pud_pte;
-
-    pud_paddr = pgd_pte & PHYSICAL_PAGE_MASK;
-
-    FILL_PUD(pud_paddr, PAGESIZE());
-    pud = ((ulong *)pud_paddr) + pud_index(vaddr);
-    pud_pte = ULONG(machdep->pud + PAGEOFFSET(pud));
-
-    return pud_pte;
-}
-
-ulong x86_64_pmd_offset(ulong pud_pte, ulong vaddr)
-{
-    ulong *pmd;
-    ulong pmd_paddr;
-    ulong pmd_pte;
-
-    pmd_paddr = pud_pte & PHYSICAL_PAGE_MASK;
-
-    FILL_PMD(pmd_paddr, PAGESIZE());
-
-    pmd = ((ulong *)pmd_paddr) + pmd_index(vaddr);
-    pmd_pte = ULONG(machdep->pmd + PAGEOFFSET(pmd));
-    return pmd_pte;
-}
-
-ulong x86_64_pte_offset(ulong pmd_pte, ulong vaddr)
-{
-    ulong *ptep;
-    ulong pte_paddr;
-    ulong pte;
-
-    pte_paddr = pmd_pte & PHYSICAL_PAGE_MASK;
-
-    FILL_PTBL(pte_paddr, PAGESIZE());
-    ptep = ((ulong *)pte_paddr) + pte_index(vaddr);
-    pte = ULONG(machdep->ptbl + PAGEOFFSET(ptep));
-
-    return pte;
-}
-
-int x86_64_kvtop(ulong kvaddr, physaddr_t *paddr)
-{
-    ulong *pgd;
-    ulong pud_pte;
-    ulong pmd_pte;
-    ulong pte;
-
-    pgd = x86_64_kpgd_offset(kvaddr);
-    pud_pte = x86_64_pud_offset(*pgd, kvaddr);
-    pmd_pte = x86_64_pmd_offset(pud_pte, kvaddr);
-    pte = x86_64_pte_offset(pmd_pte, kvaddr);
-    *paddr = (PAGEBASE(pte) & PHYSICAL_PAGE_MASK) + PAGEOFFSET(kvaddr);
-
-    return 0;
-}
-
-ulong get_vec0_addr(ulong idtr)
-{
-    struct gate_struct64 {
-        uint16_t offset_low;
-        uint16_t segment;
-        uint32_t ist : 3, zero0 : 5, type : 5, dpl : 2, p : 1;
-        uint16_t offset_middle;
-        uint32_t offset_high;
-        uint32_t zero1;
-    } __attribute__((packed)) gate;
-
-    readmem(idtr, PHYSADDR, &gate, sizeof(gate));
-
-    return ((ulong)gate.offset_high << 32)
-        + ((ulong)gate.offset_middle << 16)
-        + gate.offset_low;
-}
-
-void write_data_to_file(const char *filename, void *data, size_t size) {
-    FILE *file = fopen(filename, "wb");
-    if (file == NULL) {
-        pr_err("Failed to open file");
-        return;
-    }
-
-    size_t written = fwrite(data, 1, size, file);
-    if (written != size) {
-        pr_err("Failed to write data to file");
-    }
-
-    fclose(file);
-}
-
-#define PTI_USER_PGTABLE_BIT    PAGE_SHIFT
-#define PTI_USER_PGTABLE_MASK   (1 << PTI_USER_PGTABLE_BIT)
-#define CR3_PCID_MASK           0xFFFull
-int calc_kaslr_offset(ulong *kaslr_offset, ulong *phys_base)
-{
-    uint64_t cr3 = 0, idtr = 0, pgd = 0, idtr_paddr;
-    ulong divide_error_vmcore;
-
-    get_cr3_idtr(&cr3, &idtr);
-
-    pgd = cr3 & ~(CR3_PCID_MASK|PTI_USER_PGTABLE_MASK);
-
-    vt->kernel_pgd[0] = pgd;
-    machdep->last_pgd_read = vt->kernel_pgd[0];
-    machdep->machspec->physical_mask_shift = __PHYSICAL_MASK_SHIFT_2_6;
-    machdep->machspec->pgdir_shift = PGDIR_SHIFT;
-    machdep->machspec->ptrs_per_pgd = PTRS_PER_PGD;
-
-    readmem(pgd, PHYSADDR, machdep->pgd, PAGESIZE());
-    x86_64_kvtop(idtr, &idtr_paddr);
-
-    divide_error_vmcore = get_vec0_addr(idtr_paddr);
-    *kaslr_offset = divide_error_vmcore - st->divide_error_vmlinux;
-    *phys_base = idtr_paddr -
-        (st->idt_table_vmlinux + *kaslr_offset - __START_KERNEL_map);
-
-    if (KDEBUG(1)) {
-        pr_debug("kaslr_offset: idtr=%lx", idtr);
-        pr_debug("kaslr_offset: pgd=%lx", pgd);
-        pr_debug("kaslr_offset: idtr(phys)=%lx", idtr_paddr);
-        pr_debug("kaslr_offset: divide_error(vmcore): %lx", divide_error_vmcore);
-        pr_debug("kaslr_offset: kaslr_offset=%lx", *kaslr_offset);
-        pr_debug("kaslr_offset: phys_base   =%lx", *phys_base);
-    }
-
-    return 0;
-}
-
-void x86_64_init()
-{
-    machdep->machspec = &x86_64_machine_specific;
-
-    machdep->pagesize = 4096;
-    machdep->pageoffset = machdep->pagesize - 1;
-    machdep->pagemask = ~((ulonglong)machdep->pageoffset);
-
-    machdep->pgd = malloc(PAGESIZE());
-    machdep->pud = malloc(PAGESIZE());
-    machdep->pmd = malloc(PAGESIZE());
-    machdep->ptbl = malloc(PAGESIZE());
-
-    machdep->machspec->page_offset = PAGE_OFFSET_2_6_27;
-}
-
-void x86_64_post_reloc()
-{
-    if (kernel_symbol_exists("page_offset_base")) {
-        get_symbol_data("page_offset_base", sizeof(ulong),
-            &machdep->machspec->page_offset);
-    }
-}
-
-void derive_kaslr_offset()
-{
-    ulong kaslr_offset = 0;
-    ulong phys_base = 0;
-
-    calc_kaslr_offset(&kaslr_offset, &phys_base);
-
-    if (kaslr_offset) {
-        kt->relocate = kaslr_offset * -1;
-        kt->flags |= RELOC_SET;
-    }
-
-    machdep->machspec->phys_base = phys_base;
-}
-
-int ascii(int c)
-{
-    return ((c >= 0) && ( c <= 0x7f));
-}
-
-static char* log_from_idx(uint32_t idx, char *logbuf)
-{
-    char *logptr;
-    uint16_t msglen;
-
-    logptr = logbuf + idx;
-
-    msglen = USHORT(logptr + offsetof(struct log, len));
-    if (!msglen)
-        logptr = logbuf;
-
-    return logptr;
-}
-
-static uint32_t log_next(uint32_t idx, char *logbuf)
-{
-    char *logptr;
-    uint16_t msglen;
-
-    logptr = logbuf + idx;
-
-    msglen = USHORT(logptr + offsetof(struct log, len));
-    if (!msglen) {
-        msglen = USHORT(logbuf + offsetof(struct log, len));
-        return msglen;
-    }
-
-    return idx + msglen;
-}
-
-static void dump_log_entry(char *logptr)
-{
-    char *msg, *p;
-    uint16_t i, text_len;
-    uint64_t ts_nsec;
-    ulonglong nanos;
-    ulong rem;
-    char buf[64];
-
-    text_len = USHORT(logptr + offsetof(struct log, text_len));
-
-    ts_nsec = ULONGLONG(logptr);
-    msg = logptr + sizeof(struct log);
-
-    nanos = (ulonglong)ts_nsec / (ulonglong)1000000000;
-    rem = (ulonglong)ts_nsec % (ulonglong)1000000000;
-    sprintf(buf, "[%5lld.%06ld] ", nanos, rem/1000);
-    fprintf(fp, "%s", buf);
-
-    for (i = 0, p = msg; i < text_len; i++, p++) {
-        if (*p == '\n')
-            fprintf(fp, "\n");
-        else if (isprint(*p) || isspace(*p))
-            fputc(*p, fp);
-        else
-            fputc('.', fp);
-    }
-
-    fprintf(fp, "\n");
-}
-
-static void dump_variable_length_record_log(void)
-{
-    uint32_t idx, log_first_idx, log_next_idx, log_buf_len;
-    ulong log_buf;
-    char *logptr, *logbuf;
-
-    get_symbol_data("log_first_idx", sizeof(uint32_t), &log_first_idx);
-    get_symbol_data("log_next_idx", sizeof(uint32_t), &log_next_idx);
-    get_symbol_data("log_buf_len", sizeof(uint32_t), &log_buf_len);
-    get_symbol_data("log_buf", sizeof(char *), &log_buf);
-
-    if (KDEBUG(1)) {
-        pr_debug("log_buf: %lx", (ulong)log_buf);
-        pr_debug("log_buf_len: %d", log_buf_len);
-        pr_debug("log_first_idx: %d", log_first_idx);
-        pr_debug("log_next_idx: %d", log_next_idx);
-    }
-
-    log_buf_len &= ((1<<20) | ((1<<20) - 1));
-    logbuf = (char *)malloc(log_buf_len);
-
-    readmem(log_buf, KVADDR, logbuf, log_buf_len);
-
-    idx = log_first_idx;
-    while (idx != log_next_idx) {
-        logptr = log_from_idx(idx, logbuf);
-        dump_log_entry(logptr);
-
-        idx = log_next(idx, logbuf);
-
-        if (idx >= log_buf_len) {
-            break;
-        }
-    }
-}
+#include "filter.h"
+#include "output.h"
+#include "session.h"
 
 static int is_text_file(const char *path)
 {
@@ -345,10 +68,48 @@ static void usage(void)
     fprintf(fp, "Print the kernel messages from a virtual machine running under KVM\n");
     fprintf(fp, "\n");
     fprintf(fp, "Usage: kvm-dmesg <domain_name/socket_path> <system.map> [options]\n");
+    fprintf(fp, "       kvm-dmesg --load FILE [system.map] [options]\n");
+    fprintf(fp, "       kvm-dmesg --batch FILE [options]\n");
+    fprintf(fp, "       kvm-dmesg --daemon DIR --batch FILE [options]\n");
     fprintf(fp, "\n");
     fprintf(fp, "  -h, --help       display this help and exit\n");
     fprintf(fp, "  -v, --version    output version information and exit\n");
     fprintf(fp, "  -d, --debug      specify debug level\n");
+    fprintf(fp, "  -c, --cache DIR  keep a per-guest session cache in DIR\n");
+    fprintf(fp, "  -p, --probe      with --cache, print nothing and stop at once if nothing\n");
+    fprintf(fp, "                   was logged since the last run\n");
+    fprintf(fp, "  -a, --annotate   print kernel text addresses as symbol+off/size\n");
+    fprintf(fp, "  -n, --tail N     print only the last N messages\n");
+    fprintf(fp, "  -w, --follow     wait for new messages\n");
+    fprintf(fp, "  -i, --interval MSEC\n");
+    fprintf(fp, "                   poll interval for --follow (default 1000)\n");
+    fprintf(fp, "  -l, --level LIST restrict output to the given levels, e.g. err,warn or warn+\n");
+    fprintf(fp, "  -f, --facility LIST\n");
+    fprintf(fp, "                   restrict output to the given facilities, e.g. kern,daemon\n");
+    fprintf(fp, "      --caller LIST\n");
+    fprintf(fp, "                   restrict output to the given callers, e.g. T1,C0\n");
+    fprintf(fp, "      --seq FIRST-LAST\n");
+    fprintf(fp, "                   restrict output to a range of sequence numbers\n");
+    fprintf(fp, "      --since SEC  print only messages logged at or after SEC seconds\n");
+    fprintf(fp, "      --until SEC  print only messages logged at or before SEC seconds\n");
+    fprintf(fp, "  -g, --grep TEXT  print only messages containing TEXT, may be repeated\n");
+    fprintf(fp, "  -C, --context N  with --grep, also print N messages around each match\n");
+    fprintf(fp, "  -e, --escape     print unprintable bytes as \\xNN instead of '.'\n");
+    fprintf(fp, "  -j, --jobs N     decode large rings with N threads (default: one per CPU)\n");
+    fprintf(fp, "      --format FMT print records as text (default), json lines or kmsg\n");
+    fprintf(fp, "      --cursor FILE\n");
+    fprintf(fp, "                   print only messages newer than the last run, kept in FILE\n");
+    fprintf(fp, "      --save FILE  write a raw snapshot of the log to FILE instead of printing it\n");
+    fprintf(fp, "      --load FILE  print the log from a snapshot written by --save\n");
+    fprintf(fp, "      --batch FILE collect the guests listed in FILE, one per line as\n");
+    fprintf(fp, "                   GUEST SYSTEM.MAP [OUTPUT], with -j N guests at a time\n");
+    fprintf(fp, "      --daemon DIR keep the guests of --batch attached and append their new\n");
+    fprintf(fp, "                   messages to DIR/GUEST.log (or OUTPUT), resuming from\n");
+    fprintf(fp, "                   DIR/GUEST.log.cursor; --cursor is ignored\n");
+    fprintf(fp, "      --atomic     pause the guest while its log is copied, for an exact snapshot\n");
+    fprintf(fp, "  -m, --max-memory SIZE\n");
+    fprintf(fp, "                   stream the log through windows of at most SIZE bytes,\n");
+    fprintf(fp, "                   with an optional K, M or G suffix\n");
     fprintf(fp, "\n");
 }
 
@@ -357,15 +118,103 @@ static void version(void)
     fprintf(fp, "Version %s\n", get_version_text());
 }
 
+/* a count of at least 1, e.g. milliseconds or messages */
+static int parse_count(const char *arg, const char *what, ulong *count)
+{
+    char *end;
+    long v;
+
+    errno = 0;
+    v = strtol(arg, &end, 10);
+    if (end == arg || *end || errno || v < 1) {
+        pr_err("Invalid %s '%s', expected a number of at least 1", what, arg);
+        return -1;
+    }
+
+    *count = v;
+    return 0;
+}
+
+/* a byte count with an optional K, M or G suffix */
+static int parse_size(const char *arg, ulong *size)
+{
+    char *end;
+    ulong v = strtoul(arg, &end, 10);
+
+    if (end == arg)
+        goto err;
+
+    switch (toupper(*end)) {
+        case 'G':
+            v <<= 10;
+            /* fall through */
+        case 'M':
+            v <<= 10;
+            /* fall through */
+        case 'K':
+            v <<= 10;
+            end++;
+            break;
+    }
+
+    if (*end || !v)
+        goto err;
+
+    *size = v;
+    return 0;
+
+err:
+    pr_err("Invalid size '%s', expected bytes such as 512K or 4M", arg);
+    return -1;
+}
+
+enum {
+    OPT_CALLER = 256,
+    OPT_SEQ,
+    OPT_SINCE,
+    OPT_UNTIL,
+    OPT_ATOMIC,
+    OPT_FORMAT,
+    OPT_CURSOR,
+    OPT_SAVE,
+    OPT_LOAD,
+    OPT_BATCH,
+    OPT_DAEMON,
+};
+
 static int parse_options(int argc, char **argv)
 {
     int ch;
     int idx = 0;
-    const char *short_opts = "hvd:";
+    const char *short_opts = "hvd:c:pawi:n:l:f:g:C:ej:m:";
     static const struct option long_opts[] = {
         {"help",      no_argument,       NULL, 'h'},
         {"version",   no_argument,       NULL, 'v'},
         {"debug",     required_argument, NULL, 'd'},
+        {"cache",     required_argument, NULL, 'c'},
+        {"probe",     no_argument,       NULL, 'p'},
+        {"annotate",  no_argument,       NULL, 'a'},
+        {"tail",      required_argument, NULL, 'n'},
+        {"follow",    no_argument,       NULL, 'w'},
+        {"interval",  required_argument, NULL, 'i'},
+        {"level",     required_argument, NULL, 'l'},
+        {"facility",  required_argument, NULL, 'f'},
+        {"caller",    required_argument, NULL, OPT_CALLER},
+        {"seq",       required_argument, NULL, OPT_SEQ},
+        {"since",     required_argument, NULL, OPT_SINCE},
+        {"until",     required_argument, NULL, OPT_UNTIL},
+        {"grep",      required_argument, NULL, 'g'},
+        {"context",   required_argument, NULL, 'C'},
+        {"escape",    no_argument,       NULL, 'e'},
+        {"jobs",      required_argument, NULL, 'j'},
+        {"max-memory", required_argument, NULL, 'm'},
+        {"atomic",    no_argument,       NULL, OPT_ATOMIC},
+        {"format",    required_argument, NULL, OPT_FORMAT},
+        {"cursor",    required_argument, NULL, OPT_CURSOR},
+        {"save",      required_argument, NULL, OPT_SAVE},
+        {"load",      required_argument, NULL, OPT_LOAD},
+        {"batch",     required_argument, NULL, OPT_BATCH},
+        {"daemon",    required_argument, NULL, OPT_DAEMON},
         {NULL,        0,                 NULL, 0  }
     };
 
@@ -383,6 +232,100 @@ static int parse_options(int argc, char **argv)
                     log_init(LOGLEVEL_DEBUG);
                 }
                 break;
+            case 'c':
+                pc->cache_dir = optarg;
+                break;
+            case 'p':
+                pc->probe = TRUE;
+                break;
+            case 'a':
+                pc->annotate = TRUE;
+                break;
+            case 'n':
+                if (parse_count(optarg, "count", &pc->tail)) {
+                    fprintf(fp, "Try `%s --help' for more information.\n", argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'w':
+                pc->follow = TRUE;
+                break;
+            case 'i':
+                if (parse_count(optarg, "interval", &pc->interval)) {
+                    fprintf(fp, "Try `%s --help' for more information.\n", argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'l':
+                if (filter_parse_levels(optarg))
+                    exit(1);
+                break;
+            case 'f':
+                if (filter_parse_facilities(optarg))
+                    exit(1);
+                break;
+            case OPT_CALLER:
+                if (filter_parse_callers(optarg))
+                    exit(1);
+                break;
+            case OPT_SEQ:
+                if (filter_parse_seq(optarg))
+                    exit(1);
+                break;
+            case 'g':
+                if (filter_add_pattern(optarg))
+                    exit(1);
+                break;
+            case 'C':
+                if (filter_parse_context(optarg))
+                    exit(1);
+                break;
+            case 'e':
+                pc->escape = TRUE;
+                break;
+            case 'j':
+                if (parse_count(optarg, "number of jobs", &pc->jobs)) {
+                    fprintf(fp, "Try `%s --help' for more information.\n", argv[0]);
+                    exit(1);
+                }
+                break;
+            case 'm':
+                if (parse_size(optarg, &pc->max_memory))
+                    exit(1);
+                break;
+            case OPT_SINCE:
+                if (filter_parse_time(optarg, &record_filter->ts_min))
+                    exit(1);
+                break;
+            case OPT_UNTIL:
+                if (filter_parse_time(optarg, &record_filter->ts_max))
+                    exit(1);
+                break;
+            case OPT_FORMAT:
+                if (output_parse_format(optarg))
+                    exit(1);
+                break;
+            case OPT_CURSOR:
+                pc->cursor = optarg;
+                break;
+            case OPT_SAVE:
+                pc->save = optarg;
+                break;
+            case OPT_LOAD:
+                pc->load = optarg;
+                break;
+            case OPT_BATCH:
+                pc->batch = optarg;
+                break;
+            case OPT_DAEMON:
+                pc->daemon = optarg;
+                break;
+            case OPT_ATOMIC:
+                pc->atomic = TRUE;
+                /* the pause time is reported */
+                if (!pc->debug)
+                    log_init(LOGLEVEL_INFO);
+                break;
             case '?':
                 fprintf(fp, "Try `%s --help' for more information.\n", argv[0]);
                 exit(0);
@@ -400,13 +343,14 @@ int main(int argc, char *argv[])
     struct stat path_stat;
     char *symmap_file = NULL;
     char *guest_ac = NULL;
-    guest_access_t ac_type;
-    int ind;
+    int ind, ret = 0;
 
     pc->debug = 0;
+    pc->interval = 1000;
     fp = stdout;
 
     ind = parse_options(argc, argv);
+    output_init();
     if (ind < argc) {
         arg1 = argv[ind];
         ind++;
@@ -416,6 +360,29 @@ int main(int argc, char *argv[])
         ind++;
     }
 
+    if (pc->daemon)
+        return daemon_run(pc->daemon, pc->batch) ? 1 : 0;
+
+    /*
+     * The parent only runs the pool, each worker goes on for one guest.
+     * System.map comes first, as an image file can pass for text.
+     */
+    if (pc->batch) {
+        if ((ret = batch_run(pc->batch, &arg2, &arg1)) != 1)
+            return ret ? 1 : 0;
+        ret = 0;
+    }
+
+    if (pc->load) {
+        if (pc->follow || pc->save)
+            pr_warning("--follow and --save do not apply to a snapshot, ignored");
+        pc->follow = FALSE;
+        pc->atomic = FALSE;
+        if (session_load(pc->load, arg1))
+            return -1;
+        goto decode;
+    }
+
     if (!stat(arg1, &path_stat) && S_ISREG(path_stat.st_mode)) {
         if (is_text_file(arg1) == 1) {
             symmap_file = arg1;
@@ -434,74 +401,33 @@ int main(int argc, char *argv[])
         pr_err("System.map file not found");
         return -1;
     }
-    if (stat(guest_ac, &path_stat) == 0) {
-        if (S_ISREG(path_stat.st_mode)) {
-            ac_type = GUEST_MEMORY;
-        } else if (S_ISSOCK(path_stat.st_mode)) {
-            ac_type = QMP_SOCKET;
-        } else {
-            pr_err("Unknown file type: %s", guest_ac);
-            return -1;
-        }
-    } else {
-        ac_type = GUEST_NAME;
-    }
 
-    if (KDEBUG(1)) {
-        pr_debug("Guest     : %s", guest_ac);
-        pr_debug("System.map: %s", symmap_file);
+    switch (session_open(guest_ac, symmap_file)) {
+        case 0:
+            break;
+        case 1:
+            goto exit;
+        default:
+            return -1;
     }
 
-    if (guest_client_new(guest_ac, ac_type))
-        return -1;
-    symtab_init(symmap_file);
-    x86_64_init();
-    derive_kaslr_offset();
-    x86_64_post_reloc();
-
-    vmcoreinfo_init();
-    kernel_init();
-
-    if (kernel_symbol_exists("prb")) {
-        dump_lockless_record_log();
-        goto exit;
-    } else if (kernel_symbol_exists("log_first_idx") &&
-            kernel_symbol_exists("log_next_idx")) {
-        dump_variable_length_record_log();
+    if (pc->save) {
+        if (snapshot_save(pc->save))
+            ret = 1;
         goto exit;
     }
 
-    ulong log_buf_len = 0;
-    ulong log_buf = 0;
-    get_symbol_data("log_buf", sizeof(char *), &log_buf);
-    get_symbol_data("log_buf_len", sizeof(uint32_t), &log_buf_len);
-
-    log_buf_len &= ((1<<20) | ((1<<20) - 1));
-    char *logbuf_arry = malloc(log_buf_len);
-
-    if (KDEBUG(1)) {
-        pr_debug("log_buf len: %ld (0x%lx)", log_buf_len, log_buf_len);
-        pr_debug("log_buf addr: 0x%lx", log_buf);
-    }
-    readmem(log_buf, KVADDR, logbuf_arry, log_buf_len);
-
-    int next_line = FALSE;
-    for (ulong i = 0; i < log_buf_len; i++) {
-        if (logbuf_arry[i]) {
-            if (ascii(logbuf_arry[i])) {
-                next_line = TRUE;
-                fputc(logbuf_arry[i], fp);
-            }
-        } else {
-            if (next_line)
-                fputc('\n', fp);
-            next_line = FALSE;
-        }
-    }
-    fprintf(fp, "\n");
-    write_data_to_file("dmesg.data", logbuf_arry, log_buf_len);
+decode:
+    if (session_dump())
+        ret = 1;
 
 exit:
-    guest_client_release();
-    return 0;
+    /* neither the cursor nor the probe marker gets ahead of the output */
+    if (!output_flush()) {
+        cursor_store();
+        if (pc->probe && !ret)
+            session_cache_store(guest_ac, symmap_file);
+    }
+    session_close();
+    return ret;
 }
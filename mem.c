@@ -25,11 +25,11 @@
 #include "log.h"
 #include "xutil.h"
 #include "mem.h"
-
-static proc_mem_t *proc_mem = NULL;
+#include "client.h"
 
 int mem_init(pid_t pid, uint64_t hva_base)
 {
+    proc_mem_t *proc_mem = guest_client->proc_mem;
     int fd;
     char mem_path[32];
     if (proc_mem && proc_mem->mem_fd > 0)
@@ -43,6 +43,7 @@ int mem_init(pid_t pid, uint64_t hva_base)
 
     if (!proc_mem) {
         proc_mem = (proc_mem_t *)xmalloc(sizeof(proc_mem_t));
+        guest_client->proc_mem = proc_mem;
     }
 
     proc_mem->mem_fd = fd;
@@ -53,6 +54,8 @@ int mem_init(pid_t pid, uint64_t hva_base)
 
 int mem_uninit()
 {
+    proc_mem_t *proc_mem = guest_client->proc_mem;
+
     if (!proc_mem) {
         return 0;
     }
@@ -60,11 +63,14 @@ int mem_uninit()
         close(proc_mem->mem_fd);
     }
     xfree(proc_mem);
+    guest_client->proc_mem = NULL;
     return 0;
 }
 
 int mem_read(uint64_t addr, void *buffer, size_t size)
 {
+    proc_mem_t *proc_mem = guest_client->proc_mem;
+
     if (!proc_mem || proc_mem->mem_fd <= 0)
         return -1;
 
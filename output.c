@@ -0,0 +1,712 @@
+/* output.c
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "xutil.h"
+#include "log.h"
+#include "defs.h"
+#include "output.h"
+#include "session.h"
+
+/*
+ * Records go to the calling thread's current output: the session's,
+ * which writes itself out when full, or a worker's buffer, which grows
+ * until the main thread emits it.  NULL stands for the session's.
+ */
+static __thread struct output *output;
+
+static inline struct output *output_current(void)
+{
+    return output ? output : &session->output;
+}
+
+static const char output_digits[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static void output_add_chunk(struct output *o)
+{
+    int i = o->nr_chunks;
+
+    o->chunks = xrealloc(o->chunks, (i + 1) * sizeof(*o->chunks));
+    o->used = xrealloc(o->used, (i + 1) * sizeof(*o->used));
+    if (posix_memalign((void **)&o->chunks[i], 4096, OUTPUT_CHUNK_SIZE)) {
+        pr_err("Cannot allocate output buffer");
+        xfatal();
+    }
+    o->used[i] = 0;
+    o->nr_chunks++;
+}
+
+static void output_setup(void)
+{
+    while (session->output.nr_chunks < OUTPUT_CHUNKS)
+        output_add_chunk(&session->output);
+}
+
+/* an output buffer for one thread, see output_select() */
+void output_buffer_init(struct output *o)
+{
+    memset(o, 0, sizeof(*o));
+    o->grow = TRUE;
+    output_add_chunk(o);
+}
+
+void output_buffer_free(struct output *o)
+{
+    int i;
+
+    for (i = 0; i < o->nr_chunks; i++)
+        free(o->chunks[i]);
+    xfree(o->chunks);
+    xfree(o->used);
+    memset(o, 0, sizeof(*o));
+}
+
+/*
+ * Make o (NULL for the session's output) the calling thread's output
+ * and return the previous one.
+ */
+struct output *output_select(struct output *o)
+{
+    struct output *old = output;
+
+    output = o;
+    return old;
+}
+
+static void output_writev(struct output *o)
+{
+    struct iovec iov[OUTPUT_CHUNKS], *v;
+    int i = 0, nr;
+    int *failed = &session->output.failed;
+    ssize_t n;
+
+    while (i <= o->cur && !*failed) {
+        for (nr = 0; nr < OUTPUT_CHUNKS && i <= o->cur; i++) {
+            if (!o->used[i])
+                continue;
+            iov[nr].iov_base = o->chunks[i];
+            iov[nr].iov_len = o->used[i];
+            nr++;
+        }
+
+        for (v = iov; nr && !*failed; ) {
+            n = writev(fileno(fp), v, nr);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                pr_err("Cannot write output: %s", strerror(errno));
+                *failed = TRUE;
+                break;
+            }
+            for (; nr && (size_t)n >= v->iov_len; v++, nr--)
+                n -= v->iov_len;
+            if (nr) {
+                v->iov_base = (char *)v->iov_base + n;
+                v->iov_len -= n;
+            }
+        }
+    }
+
+    for (i = 0; i <= o->cur && i < o->nr_chunks; i++)
+        o->used[i] = 0;
+    o->cur = 0;
+}
+
+int output_flush(void)
+{
+    /* anything already written through stdio goes first */
+    fflush(fp);
+    output_writev(&session->output);
+
+    return session->output.failed ? -1 : 0;
+}
+
+/*
+ * Write out everything before o, then o itself.  Main thread only.
+ */
+void output_emit(struct output *o)
+{
+    output_flush();
+    output_writev(o);
+}
+
+/*
+ * Room for len contiguous bytes, to be claimed with output_advance().
+ */
+char *output_reserve(size_t len)
+{
+    struct output *o = output_current();
+
+    if (!o->nr_chunks)
+        output_setup();
+
+    if (o->used[o->cur] + len > OUTPUT_CHUNK_SIZE) {
+        if (o->cur < o->nr_chunks - 1)
+            o->cur++;
+        else if (o->grow) {
+            output_add_chunk(o);
+            o->cur++;
+        } else
+            output_flush();
+    }
+
+    return o->chunks[o->cur] + o->used[o->cur];
+}
+
+void output_advance(size_t len)
+{
+    struct output *o = output_current();
+
+    o->used[o->cur] += len;
+}
+
+void output_write(const char *buf, size_t len)
+{
+    size_t part;
+
+    while (len) {
+        part = len < OUTPUT_CHUNK_SIZE ? len : OUTPUT_CHUNK_SIZE;
+        memcpy(output_reserve(part), buf, part);
+        output_advance(part);
+        buf += part;
+        len -= part;
+    }
+}
+
+/*
+ * "[%5llu.%06lu] " of seconds and microseconds, without printf.
+ */
+void output_timestamp(uint64_t ts_nsec)
+{
+    char *start = output_reserve(32), *p = start;
+    uint64_t sec = ts_nsec / 1000000000;
+    uint32_t usec = (uint32_t)(ts_nsec - sec * 1000000000) / 1000;
+    char tmp[20];
+    int i, n = 0;
+
+    do {
+        tmp[n++] = '0' + sec % 10;
+        sec /= 10;
+    } while (sec);
+
+    *p++ = '[';
+    for (i = n; i < 5; i++)
+        *p++ = ' ';
+    while (n)
+        *p++ = tmp[--n];
+
+    *p++ = '.';
+    memcpy(p + 4, output_digits + (usec % 100) * 2, 2);
+    usec /= 100;
+    memcpy(p + 2, output_digits + (usec % 100) * 2, 2);
+    usec /= 100;
+    memcpy(p, output_digits + usec * 2, 2);
+    p += 6;
+    *p++ = ']';
+    *p++ = ' ';
+
+    output_advance(p - start);
+}
+
+/*
+ * Terminate a record.  Chunks are only written out between records,
+ * so a reader of the output never sees half a line.
+ */
+void output_record_end(void)
+{
+    struct output *o;
+
+    output_char('\n');
+    o = output_current();
+    if (!o->grow && o->cur == o->nr_chunks - 1)
+        output_flush();
+}
+
+/*
+ * Text sanitisation.  Record text is almost always clean, so the work
+ * is finding the length of each clean run sixteen or thirty-two bytes
+ * at a time; runs are copied unchanged and only the offending bytes are
+ * patched.  The widest routine the CPU supports is picked on first use.
+ */
+static unsigned char text_class_table[TEXT_CLASSES][256];
+
+static size_t text_clean_span_scalar(const unsigned char *p, size_t len, int class)
+{
+    const unsigned char *table = text_class_table[class];
+    size_t i = 0;
+
+    while (i < len && table[p[i]])
+        i++;
+
+    return i;
+}
+
+#ifdef __SSE2__
+static size_t text_clean_span_sse2(const unsigned char *p, size_t len, int class)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i v, ok;
+    unsigned int bad;
+    size_t i;
+
+    /* signed compares: bytes >= 0x80 are negative and never clean */
+    for (i = 0; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128((const __m128i *)(p + i));
+        if (class == TEXT_ASCII) {
+            ok = _mm_cmpgt_epi8(v, zero);
+        } else if (class == TEXT_PRINTABLE) {
+            ok = _mm_or_si128(
+                    _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(0x1f)),
+                        _mm_cmplt_epi8(v, _mm_set1_epi8(0x7f))),
+                    _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(0x08)),
+                        _mm_cmplt_epi8(v, _mm_set1_epi8(0x0e))));
+        } else {
+            /* JSON: 0x20-0x7f, KMSG: 0x20-0x7e; neither '\\' */
+            ok = _mm_cmpgt_epi8(v, _mm_set1_epi8(0x1f));
+            if (class == TEXT_KMSG)
+                ok = _mm_and_si128(ok, _mm_cmplt_epi8(v, _mm_set1_epi8(0x7f)));
+            ok = _mm_andnot_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\\')), ok);
+            if (class == TEXT_JSON)
+                ok = _mm_andnot_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')), ok);
+        }
+        bad = ~_mm_movemask_epi8(ok) & 0xffff;
+        if (bad)
+            return i + __builtin_ctz(bad);
+    }
+
+    return i + text_clean_span_scalar(p + i, len - i, class);
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static size_t text_clean_span_avx2(const unsigned char *p, size_t len, int class)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i v, ok;
+    unsigned int bad;
+    size_t i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *)(p + i));
+        if (class == TEXT_ASCII) {
+            ok = _mm256_cmpgt_epi8(v, zero);
+        } else if (class == TEXT_PRINTABLE) {
+            ok = _mm256_or_si256(
+                    _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(0x1f)),
+                        _mm256_cmpgt_epi8(_mm256_set1_epi8(0x7f), v)),
+                    _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8(0x08)),
+                        _mm256_cmpgt_epi8(_mm256_set1_epi8(0x0e), v)));
+        } else {
+            ok = _mm256_cmpgt_epi8(v, _mm256_set1_epi8(0x1f));
+            if (class == TEXT_KMSG)
+                ok = _mm256_and_si256(ok,
+                        _mm256_cmpgt_epi8(_mm256_set1_epi8(0x7f), v));
+            ok = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')), ok);
+            if (class == TEXT_JSON)
+                ok = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')), ok);
+        }
+        bad = ~(unsigned int)_mm256_movemask_epi8(ok);
+        if (bad)
+            return i + __builtin_ctz(bad);
+    }
+
+    return i + text_clean_span_scalar(p + i, len - i, class);
+}
+#endif
+
+static size_t text_clean_span_init(const unsigned char *p, size_t len, int class);
+
+static size_t (*text_clean_span_fn)(const unsigned char *, size_t, int) =
+    text_clean_span_init;
+
+static size_t text_clean_span_init(const unsigned char *p, size_t len, int class)
+{
+    int c;
+
+    for (c = 1; c < 256; c++) {
+        text_class_table[TEXT_PRINTABLE][c] = (c >= 0x20 && c < 0x7f) ||
+            (c >= 0x09 && c <= 0x0d);
+        text_class_table[TEXT_ASCII][c] = (c < 0x80);
+    }
+    for (c = 0; c < 256; c++) {
+        text_class_table[TEXT_JSON][c] = (c >= 0x20 && c < 0x80 &&
+                c != '"' && c != '\\');
+        text_class_table[TEXT_KMSG][c] = (c >= 0x20 && c < 0x7f && c != '\\');
+    }
+
+    text_clean_span_fn = text_clean_span_scalar;
+#ifdef __SSE2__
+    text_clean_span_fn = text_clean_span_sse2;
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        text_clean_span_fn = text_clean_span_avx2;
+#endif
+
+    return text_clean_span_fn(p, len, class);
+}
+
+/*
+ * Resolve everything that is otherwise set up on first use, before any
+ * worker thread may format output.
+ */
+void output_init(void)
+{
+    output_setup();
+    text_clean_span_init(NULL, 0, TEXT_PRINTABLE);
+}
+
+/*
+ * Length of the run of bytes at the start of text that belong to class.
+ */
+size_t text_clean_span(const char *text, size_t len, int class)
+{
+    return text_clean_span_fn((const unsigned char *)text, len, class);
+}
+
+/*
+ * Copy printk text to dst, replacing every byte that is not printable
+ * or whitespace with '.', or with "\xNN" under --escape.  dst needs room
+ * for 4 * len bytes when escaping.  Returns the length written.
+ */
+size_t text_sanitize(char *dst, const char *text, size_t len)
+{
+    static const char hex[] = "0123456789abcdef";
+    char *q = dst;
+    size_t n;
+
+    for (;;) {
+        n = text_clean_span(text, len, TEXT_PRINTABLE);
+        memcpy(q, text, n);
+        q += n;
+        if (n == len)
+            break;
+
+        if (pc->escape) {
+            *q++ = '\\';
+            *q++ = 'x';
+            *q++ = hex[(unsigned char)text[n] >> 4];
+            *q++ = hex[(unsigned char)text[n] & 0xf];
+        } else {
+            *q++ = '.';
+        }
+        text += n + 1;
+        len -= n + 1;
+    }
+
+    return q - dst;
+}
+
+/* sanitised text in pieces whose worst case fits one chunk */
+#define OUTPUT_TEXT_PIECE   (OUTPUT_CHUNK_SIZE / 4)
+
+void output_text(const char *text, size_t len)
+{
+    size_t part;
+
+    while (len) {
+        part = len < OUTPUT_TEXT_PIECE ? len : OUTPUT_TEXT_PIECE;
+        output_advance(text_sanitize(output_reserve(pc->escape ? 4 * part : part),
+                    text, part));
+        text += part;
+        len -= part;
+    }
+}
+
+/*
+ * Structured records for --format.  The encoders write straight into
+ * the output chunks; strings are escaped run by run with the same span
+ * scanner as record text.
+ */
+int output_parse_format(const char *arg)
+{
+    if (!strcmp(arg, "text"))
+        pc->format = FORMAT_TEXT;
+    else if (!strcmp(arg, "json"))
+        pc->format = FORMAT_JSON;
+    else if (!strcmp(arg, "kmsg"))
+        pc->format = FORMAT_KMSG;
+    else {
+        pr_err("Unknown format '%s', expected text, json or kmsg", arg);
+        return -1;
+    }
+
+    return 0;
+}
+
+static char *output_put_u64(char *p, uint64_t v)
+{
+    char tmp[20];
+    int n = 0;
+
+    do {
+        tmp[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+
+    while (n)
+        *p++ = tmp[--n];
+
+    return p;
+}
+
+static char *output_put_str(char *p, const char *s)
+{
+    size_t len = strlen(s);
+
+    memcpy(p, s, len);
+    return p + len;
+}
+
+static char *output_put_caller(char *p, uint32_t caller_id)
+{
+    *p++ = (caller_id & 0x80000000U) ? 'C' : 'T';
+    return output_put_u64(p, caller_id & ~0x80000000U);
+}
+
+/* worst case growth of one byte: "\u00NN" */
+#define OUTPUT_ESCAPE_PIECE (OUTPUT_CHUNK_SIZE / 6)
+
+/*
+ * Length of the well-formed UTF-8 sequence (RFC 3629) that starts at p,
+ * 0 if there is none: no overlong forms, surrogates or code points past
+ * U+10FFFF.
+ */
+static size_t utf8_sequence(const unsigned char *p, size_t len)
+{
+    unsigned char lo = 0x80, hi = 0xbf;
+    size_t n, i;
+
+    if (p[0] >= 0xc2 && p[0] <= 0xdf) {
+        n = 2;
+    } else if (p[0] >= 0xe0 && p[0] <= 0xef) {
+        n = 3;
+        if (p[0] == 0xe0)
+            lo = 0xa0;
+        else if (p[0] == 0xed)
+            hi = 0x9f;
+    } else if (p[0] >= 0xf0 && p[0] <= 0xf4) {
+        n = 4;
+        if (p[0] == 0xf0)
+            lo = 0x90;
+        else if (p[0] == 0xf4)
+            hi = 0x8f;
+    } else {
+        return 0;
+    }
+
+    if (n > len || p[1] < lo || p[1] > hi)
+        return 0;
+    for (i = 2; i < n; i++) {
+        if (p[i] < 0x80 || p[i] > 0xbf)
+            return 0;
+    }
+    return n;
+}
+
+/*
+ * JSON string contents, or /dev/kmsg text where everything outside
+ * printable ASCII and the backslash itself become "\xNN".  JSON keeps
+ * well-formed UTF-8 as is; any other byte above 0x7f becomes "\u00NN",
+ * so the output stays valid UTF-8 whatever the guest logged.
+ */
+static void output_escaped(const char *text, size_t len, int class)
+{
+    static const char hex[] = "0123456789abcdef";
+    const char *end;
+    char *start, *q;
+    unsigned char c;
+    size_t part, n;
+
+    while (len) {
+        part = len < OUTPUT_ESCAPE_PIECE ? len : OUTPUT_ESCAPE_PIECE;
+        start = q = output_reserve(6 * part);
+        end = text + part;
+        len -= part;
+
+        for (;;) {
+            n = text_clean_span(text, end - text, class);
+            memcpy(q, text, n);
+            q += n;
+            text += n;
+            if (text == end)
+                break;
+
+            /* a sequence may run past the piece, it is taken whole */
+            if (class == TEXT_JSON && (unsigned char)*text >= 0x80 &&
+                    (n = utf8_sequence((const unsigned char *)text,
+                                       end - text + len))) {
+                memcpy(q, text, n);
+                q += n;
+                text += n;
+                if (text > end) {
+                    len -= text - end;
+                    end = text;
+                }
+                if (text == end)
+                    break;
+                continue;
+            }
+
+            c = *text++;
+            *q++ = '\\';
+            if (class == TEXT_KMSG) {
+                *q++ = 'x';
+            } else if (c == '"' || c == '\\') {
+                *q++ = c;
+                continue;
+            } else if (c == '\n') {
+                *q++ = 'n';
+                continue;
+            } else if (c == '\t') {
+                *q++ = 't';
+                continue;
+            } else if (c == '\r') {
+                *q++ = 'r';
+                continue;
+            } else {
+                q = output_put_str(q, "u00");
+            }
+            *q++ = hex[c >> 4];
+            *q++ = hex[c & 0xf];
+        }
+
+        output_advance(q - start);
+    }
+}
+
+static void output_json_field(const char *name, const char *s, size_t len)
+{
+    char *start = output_reserve(32), *p = start;
+
+    *p++ = ',';
+    *p++ = '"';
+    p = output_put_str(p, name);
+    *p++ = '"';
+    *p++ = ':';
+    *p++ = '"';
+    output_advance(p - start);
+
+    output_escaped(s, len, TEXT_JSON);
+    output_char('"');
+}
+
+/*
+ * {"seq":N,"time":S.UUUUUU,"level":L,"facility":F,"caller":"T1",
+ *  "subsystem":"...","device":"...","msg":"..."}
+ */
+static void output_json_record(const struct output_record *r)
+{
+    char *start = output_reserve(160), *p = start;
+    uint64_t sec = r->ts_nsec / 1000000000;
+    uint32_t usec = (uint32_t)(r->ts_nsec - sec * 1000000000) / 1000;
+
+    p = output_put_str(p, "{\"seq\":");
+    p = output_put_u64(p, r->seq);
+    p = output_put_str(p, ",\"time\":");
+    p = output_put_u64(p, sec);
+    *p++ = '.';
+    memcpy(p, output_digits + (usec / 10000) * 2, 2);
+    memcpy(p + 2, output_digits + (usec / 100 % 100) * 2, 2);
+    memcpy(p + 4, output_digits + (usec % 100) * 2, 2);
+    p += 6;
+    p = output_put_str(p, ",\"level\":");
+    p = output_put_u64(p, r->level);
+    p = output_put_str(p, ",\"facility\":");
+    p = output_put_u64(p, r->facility);
+    if (r->has_caller) {
+        p = output_put_str(p, ",\"caller\":\"");
+        p = output_put_caller(p, r->caller_id);
+        *p++ = '"';
+    }
+    output_advance(p - start);
+
+    if (r->subsystem_len)
+        output_json_field("subsystem", r->subsystem, r->subsystem_len);
+    if (r->device_len)
+        output_json_field("device", r->device, r->device_len);
+    output_json_field("msg", r->text, r->text_len);
+    output_char('}');
+}
+
+/*
+ * As read from /dev/kmsg: "prefix,seq,usec,flag[,caller=T1];text",
+ * followed by " SUBSYSTEM=" and " DEVICE=" lines.
+ */
+static void output_kmsg_record(const struct output_record *r)
+{
+    char *start = output_reserve(96), *p = start;
+
+    p = output_put_u64(p, (r->facility << 3) | r->level);
+    *p++ = ',';
+    p = output_put_u64(p, r->seq);
+    *p++ = ',';
+    p = output_put_u64(p, r->ts_nsec / 1000);
+    *p++ = ',';
+    *p++ = (r->flags & OUTPUT_LOG_CONT) ? 'c' : '-';
+    if (r->has_caller) {
+        p = output_put_str(p, ",caller=");
+        p = output_put_caller(p, r->caller_id);
+    }
+    *p++ = ';';
+    output_advance(p - start);
+
+    output_escaped(r->text, r->text_len, TEXT_KMSG);
+
+    if (r->subsystem_len) {
+        output_write("\n SUBSYSTEM=", 12);
+        output_escaped(r->subsystem, r->subsystem_len, TEXT_KMSG);
+    }
+    if (r->device_len) {
+        output_write("\n DEVICE=", 9);
+        output_escaped(r->device, r->device_len, TEXT_KMSG);
+    }
+}
+
+/* FORMAT_RECORD hands each record to fn, nothing is written */
+void output_set_record_fn(output_record_fn_t fn, void *arg)
+{
+    session->output.record_fn = fn;
+    session->output.record_arg = arg;
+}
+
+void output_record(const struct output_record *r)
+{
+    if (pc->format == FORMAT_RECORD) {
+        session->output.record_fn(r, session->output.record_arg);
+        return;
+    }
+
+    if (pc->format == FORMAT_KMSG)
+        output_kmsg_record(r);
+    else
+        output_json_record(r);
+
+    output_record_end();
+}
@@ -0,0 +1,113 @@
+/* output.h
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __OUTPUT_H__
+#define __OUTPUT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Records are assembled in OUTPUT_CHUNKS page aligned chunks and written
+ * with one writev() once the last chunk is in use, or on output_flush().
+ * A single reservation never exceeds one chunk.  Worker threads format
+ * into their own struct output, emitted by the main thread in order.
+ */
+#define OUTPUT_CHUNK_SIZE   (64 * 1024)
+#define OUTPUT_CHUNKS       (8)
+
+struct output_record;
+
+typedef void (*output_record_fn_t)(const struct output_record *r, void *arg);
+
+struct output {
+    char **chunks;
+    size_t *used;
+    int nr_chunks;
+    int cur;
+    int grow;               /* keep adding chunks instead of writing */
+
+    /* a session's own output only */
+    int failed;             /* a write failed, nothing more is written */
+    output_record_fn_t record_fn;   /* FORMAT_RECORD */
+    void *record_arg;
+};
+
+void output_buffer_init(struct output *o);
+void output_buffer_free(struct output *o);
+struct output *output_select(struct output *o);
+void output_emit(struct output *o);
+void output_init(void);
+char *output_reserve(size_t len);
+void output_advance(size_t len);
+void output_write(const char *buf, size_t len);
+void output_timestamp(uint64_t ts_nsec);
+void output_record_end(void);
+int output_flush(void);
+
+/*
+ * Byte classes for text_clean_span().  TEXT_PRINTABLE is what printk
+ * record text may contain as is (printable ASCII and whitespace),
+ * TEXT_ASCII is any 7-bit byte but NUL, as kept from the legacy buffer.
+ */
+#define TEXT_PRINTABLE      (0)
+#define TEXT_ASCII          (1)
+#define TEXT_JSON           (2)     /* JSON string contents as is, ASCII */
+#define TEXT_KMSG           (3)     /* /dev/kmsg text as is */
+#define TEXT_CLASSES        (4)
+
+size_t text_clean_span(const char *text, size_t len, int class);
+size_t text_sanitize(char *dst, const char *text, size_t len);
+void output_text(const char *text, size_t len);
+
+/* --format */
+#define FORMAT_TEXT         (0)
+#define FORMAT_JSON         (1)
+#define FORMAT_KMSG         (2)
+#define FORMAT_RECORD       (3)     /* records go to output_set_record_fn() */
+
+#define OUTPUT_LOG_CONT     (8)     /* printk_info.flags, a continuation */
+
+/*
+ * One record for the structured formats.  Strings need not be NUL
+ * terminated, a zero length leaves an optional field out.
+ */
+struct output_record {
+    uint64_t seq;
+    uint64_t ts_nsec;
+    uint8_t level;
+    uint8_t facility;
+    uint8_t flags;
+    int has_caller;
+    uint32_t caller_id;
+    const char *subsystem;
+    size_t subsystem_len;
+    const char *device;
+    size_t device_len;
+    const char *text;
+    size_t text_len;
+};
+
+int output_parse_format(const char *arg);
+void output_set_record_fn(output_record_fn_t fn, void *arg);
+void output_record(const struct output_record *r);
+
+static inline void output_char(char c)
+{
+    *output_reserve(1) = c;
+    output_advance(1);
+}
+
+#endif
@@ -15,13 +15,21 @@
 
 #include <stdlib.h>
 #include <unistd.h>
-#include <ctype.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "xutil.h"
 #include "client.h"
 #include "log.h"
 #include "defs.h"
 #include "printk.h"
+#include "filter.h"
+#include "output.h"
 
 #define DESC_SV_BITS		(sizeof(unsigned long) * 8)
 #define DESC_FLAGS_SHIFT	(DESC_SV_BITS - 2)
@@ -38,105 +46,7 @@ enum desc_state {
     desc_reusable	= 0x3,	/* free, not yet used by any writer */
 };
 
-static char *vmcoreinfo_buf = NULL;
-
-char *vmcoreinfo_read_string(const char *key)
-{
-    const char *buf = vmcoreinfo_buf;
-    char *value_string = NULL;
-    char *p1, *p2;
-    size_t value_length;
-    char keybuf[80] = {0};
-
-    snprintf(keybuf, sizeof(keybuf), "%s=", key);
-
-    if ((p1 = strstr(buf, keybuf))) {
-        p2 = p1 + strlen(keybuf);
-        p1 = strstr(p2, "\n");
-        value_length = p1 - p2;
-        value_string = xcalloc(value_length + 1, sizeof(char));
-        strncpy(value_string, p2, value_length);
-        value_string[value_length] = '\0';
-    }
-
-    return value_string;
-}
-
-long datatype_info(char *name, char *member, int datatype)
-{
-    char buf[64] = {0};
-    char *value_string;
-    char *endptr;
-    long value  = 0;
-
-    if (datatype == STRUCT_SIZE_REQUEST){
-        snprintf(buf, sizeof(buf), "SIZE(%s)", name);
-    } else if (datatype == MEMBER_OFFSET_REQUEST) {
-        snprintf(buf, sizeof(buf), "OFFSET(%s.%s)", name, member);
-    }
-
-    if (strlen(buf)) {
-        value_string = vmcoreinfo_read_string(buf);
-        if (value_string) {
-            value = strtol(value_string, &endptr, 10);
-            xfree(value_string);
-        }
-   }
-
-    return value;
-}
-
-void vmcoreinfo_init()
-{
-    char *buf;
-    size_t vmcoreinfo_size;
-    ulong vmcoreinfo_data;
-    ulong osrelease;
-
-    // ASCII value of "OSRELEAS"
-    // crash> rd vmcoreinfo_data 1
-    // ffffffffbd56ca60:  5341454c4552534f                    OSRELEAS
-    osrelease=0x5341454c4552534f;
-
-    get_symbol_data("vmcoreinfo_size", sizeof(vmcoreinfo_size), &vmcoreinfo_size);
-    vmcoreinfo_size &= ((1<<13) - 1);
-
-    vmcoreinfo_buf = xmalloc(vmcoreinfo_size + 1);
-    buf = vmcoreinfo_buf;
-
-    get_symbol_data("vmcoreinfo_data", sizeof(vmcoreinfo_data), &vmcoreinfo_data);
-
-    // For legacy kernels like CentOS 3.10.x, the type of vmcoreinfo_data is string array
-    // instead of char pointer, get_symbol_data would simply return the string itself
-    // instead of address, which is not what we want.
-    //
-    // The best way to deal with it is get vmcoreinfo_data data type via tools like
-    // gdb, just like crash utility
-    if (vmcoreinfo_data == osrelease)
-    {
-        vmcoreinfo_data = symbol_value("vmcoreinfo_data");
-        vmcoreinfo_data -= kt->relocate;
-    }
-
-    if (readmem(vmcoreinfo_data, KVADDR, buf, vmcoreinfo_size)) {
-        pr_err("cannot read vmcoreinfo_data\n");
-        goto err;
-    }
-
-    buf[vmcoreinfo_size] = '\n';
-
-    if (KDEBUG(2)) {
-        for (size_t i = 0; i < vmcoreinfo_size; i++) {
-            fprintf(fp, "%c", buf[i]);
-        }
-        fprintf(fp, "\n");
-    }
-    return;
-err:
-    xfree(vmcoreinfo_buf);
-}
-
-static void offsets_init()
+void offsets_init()
 {
     char *n;
 
@@ -165,6 +75,26 @@ static void offsets_init()
     MEMBER_OFFSET_INIT(prb_data_ring_data, n, "data");
 }
 
+/*
+ * Print the text of one record, replacing unprintable bytes with '.'
+ * (or \xNN with --escape).
+ */
+void dump_text(const char *text, size_t text_len)
+{
+    char *buf;
+    size_t len;
+
+    if (!pc->annotate) {
+        output_text(text, text_len);
+        return;
+    }
+
+    buf = xmalloc(4 * text_len + 1);
+    len = text_sanitize(buf, text, text_len);
+    symbol_annotate_text(buf, len);
+    xfree(buf);
+}
+
 static enum desc_state get_desc_state(unsigned long id,
         unsigned long state_val)
 {
@@ -174,22 +104,154 @@ static enum desc_state get_desc_state(unsigned long id,
     return DESC_STATE(state_val);
 }
 
-static void dump_record(struct prb_map *m, unsigned long id)
+static inline char *prb_desc(struct prb_map *m, unsigned long id)
+{
+    return m->descs + ((id % m->desc_slots) * sizeof(struct prb_desc));
+}
+
+static inline char *prb_info(struct prb_map *m, unsigned long id)
+{
+    return m->infos + ((id % m->desc_slots) * sizeof(struct printk_info));
+}
+
+/*
+ * Logical positions of the data block of a record whose descriptor is
+ * local, FALSE for a dataless one.  A block that did not fit at the end
+ * of the ring lives at the start of the next wrap.
+ */
+static int prb_text_blk(struct prb_map *m, unsigned long id,
+        unsigned long *lo, unsigned long *hi)
+{
+    unsigned long size = m->text_data_ring_size;
+    unsigned long begin_lpos, next_lpos, begin, next;
+    char *desc = prb_desc(m, id);
+
+    begin_lpos = ULONG(desc + offsetof(struct prb_desc, text_blk_lpos) +
+            offsetof(struct prb_data_blk_lpos, begin));
+    next_lpos = ULONG(desc + offsetof(struct prb_desc, text_blk_lpos) +
+            offsetof(struct prb_data_blk_lpos, next));
+
+    begin = begin_lpos % size;
+    next = next_lpos % size;
+
+    if (begin == next)
+        return FALSE;
+
+    if (begin > next)
+        begin = 0;
+
+    *lo = next_lpos - next + begin;
+    *hi = next_lpos;
+    return TRUE;
+}
+
+/*
+ * Text of a record whose descriptor is local, NULL for a dataless one
+ * or, when streaming, one outside the current text window.
+ */
+static char *prb_record_text(struct prb_map *m, unsigned long id,
+        unsigned short *len)
+{
+    unsigned short text_len;
+    unsigned long lo, hi;
+    char *text;
+
+    if (!prb_text_blk(m, id, &lo, &hi))
+        return NULL;
+
+    if (m->text_window) {
+        if (lo - m->text_base > m->text_len || hi - m->text_base > m->text_len)
+            return NULL;
+        text = m->text_data + (lo - m->text_base);
+    } else {
+        text = m->text_data + lo % m->text_data_ring_size;
+    }
+
+    text_len = USHORT(prb_info(m, id) + offsetof(struct printk_info, text_len));
+
+    text += sizeof(unsigned long);
+    lo += sizeof(unsigned long);
+
+    if (hi - lo < text_len)
+        text_len = hi - lo;
+
+    *len = text_len;
+    return text;
+}
+
+static void print_record_structured(struct prb_map *m, unsigned long id)
+{
+    struct printk_info *pi = (struct printk_info *)prb_info(m, id);
+    struct output_record r;
+    unsigned short text_len = 0;
+
+    r.seq = pi->seq;
+    r.ts_nsec = pi->ts_nsec;
+    r.level = pi->level;
+    r.facility = pi->facility;
+    r.flags = pi->flags;
+    r.has_caller = TRUE;
+    r.caller_id = pi->caller_id;
+    r.subsystem = pi->dev_info.subsystem;
+    r.subsystem_len = strnlen(pi->dev_info.subsystem, sizeof(pi->dev_info.subsystem));
+    r.device = pi->dev_info.device;
+    r.device_len = strnlen(pi->dev_info.device, sizeof(pi->dev_info.device));
+    r.text = prb_record_text(m, id, &text_len);
+    r.text_len = r.text ? text_len : 0;
+
+    output_record(&r);
+}
+
+static void print_record(void *arg, unsigned long id)
+{
+    struct prb_map *m = arg;
+    unsigned short text_len;
+    char *info, *text;
+    uint64_t ts_nsec;
+
+    if (pc->format != FORMAT_TEXT) {
+        print_record_structured(m, id);
+        return;
+    }
+
+    info = prb_info(m, id);
+
+    if (!(text = prb_record_text(m, id, &text_len)))
+        goto out;
+
+    ts_nsec = ULONGLONG(info + offsetof(struct printk_info, ts_nsec));
+    output_timestamp(ts_nsec);
+
+    dump_text(text, text_len);
+
+out:
+    output_record_end();
+}
+
+static int prb_text_match(struct prb_map *m, unsigned long id)
 {
     unsigned short text_len;
+    char *text;
+
+    if (!(text = prb_record_text(m, id, &text_len)))
+        return FALSE;
+
+    return text_filter_match(text, text_len);
+}
+
+static int prb_record_selected(struct prb_map *m, unsigned long id);
+
+static void dump_record(struct prb_map *m, unsigned long id)
+{
     unsigned long state_var;
-    char *desc, *info, *text, *p;
     enum desc_state state;
-    unsigned long begin;
-    unsigned long next;
-    uint64_t ts_nsec;
-    unsigned long long nanos;
-    unsigned long rem;
-    char buf[1024];
-    int i;
+    char *desc;
 
-    desc = m->descs + ((id % m->desc_ring_count) * sizeof(struct prb_desc));
+    if (!prb_record_selected(m, id))
+        return;
 
+    /* a torn record may have been dropped since it was selected */
+    desc = prb_desc(m, id);
     state_var = ULONG(desc + offsetof(struct prb_desc, state_var) +
             offsetof(atomic_long_t, counter));
     state = get_desc_state(id, state_var);
@@ -197,114 +259,1322 @@ static void dump_record(struct prb_map *m, unsigned long id)
     if (state != desc_committed && state != desc_finalized)
         return;
 
-    info = m->infos + ((id % m->desc_ring_count) * sizeof(struct printk_info));
+    if (text_filter->nr_patterns)
+        text_filter_record(prb_text_match(m, id), print_record, m, id);
+    else
+        print_record(m, id);
+}
 
-    text_len = USHORT(info + offsetof(struct printk_info, text_len));
+/* the smallest windows worth streaming with */
+#define PRB_MIN_SLOTS       (256)
+#define PRB_MIN_TEXT_WINDOW (64 << 10)
 
-    begin = ULONG(desc + offsetof(struct prb_desc, text_blk_lpos) +
-            offsetof(struct prb_data_blk_lpos, begin)) % m->text_data_ring_size;
-    next = ULONG(desc + offsetof(struct prb_desc, text_blk_lpos) +
-            offsetof(struct prb_data_blk_lpos, next)) % m->text_data_ring_size;
+/*
+ * Under --max-memory, keep only a window of the rings local when whole
+ * copies would not fit: half of the budget for descriptors and infos,
+ * half for text.  --tail, --follow and --grep context refer back to
+ * records that a window may have moved past, and --atomic copies
+ * everything in one pause, so they keep whole copies.
+ */
+static void prb_map_limit(struct prb_map *m)
+{
+    unsigned long per_id = SIZE(prb_desc) + SIZE(printk_info);
+    unsigned long budget = pc->max_memory / 2;
 
-    if (begin == next)
-        goto out;
+    if (!pc->max_memory || pc->tail || pc->follow || pc->atomic ||
+            text_filter->context ||
+            per_id * m->desc_ring_count + m->text_data_ring_size <= pc->max_memory)
+        return;
 
-    ts_nsec = ULONGLONG(info + offsetof(struct printk_info, ts_nsec));
-    nanos = (unsigned long long)ts_nsec / (unsigned long long)1000000000;
-    rem = (unsigned long long)ts_nsec % (unsigned long long)1000000000;
-    snprintf(buf, sizeof(buf), "[%5lld.%06ld] ", nanos, rem/1000);
-    fprintf(fp, "%s", buf);
+    while (m->desc_slots > PRB_MIN_SLOTS && m->desc_slots * per_id > budget)
+        m->desc_slots /= 2;
 
-    if (begin > next)
-        begin = 0;
+    m->text_window = budget < PRB_MIN_TEXT_WINDOW ? PRB_MIN_TEXT_WINDOW : budget;
+    if (m->text_window > m->text_data_ring_size)
+        m->text_window = m->text_data_ring_size;
+
+    if (KDEBUG(1))
+        pr_debug("streaming: %lu of %lu descriptors, %lu of %lu text bytes",
+                m->desc_slots, m->desc_ring_count, m->text_window,
+                m->text_data_ring_size);
+}
 
-    begin += sizeof(unsigned long);
+/* the ring buffer structure and the geometry of its rings */
+static int prb_map_read(struct prb_map *m)
+{
+    memset(m, 0, sizeof(*m));
 
-    if (next - begin < text_len)
-        text_len = next - begin;
+    if (SIZE(printk_info) == 0) {
+        offsets_init();
+    }
 
-    text = m->text_data + begin;
+    if (!(m->prb_kaddr = kt->prb) &&
+            get_symbol_data("prb", sizeof(char *), &m->prb_kaddr))
+        return -1;
+    m->prb = xmalloc(SIZE(printk_ringbuffer));
 
-    for (i = 0, p = text; i < text_len; i++, p++) {
-        if (*p == '\n')
-            fprintf(fp, "\n");
-        else if (isprint(*p) || isspace(*p))
-            fputc(*p, fp);
-        else
-            fputc('.', fp);
+    if (readmem(m->prb_kaddr, KVADDR, m->prb, SIZE(printk_ringbuffer))) {
+        pr_err("Cannot read printk_ringbuffer contents");
+        xfree(m->prb);
+        return -1;
     }
 
-out:
-    fprintf(fp, "\n");
+    m->desc_ring = m->prb + OFFSET(prb_desc_ring);
+    m->desc_ring_count = 1 << UINT(m->desc_ring + OFFSET(prb_desc_ring_count_bits));
+    m->descs_kaddr = ULONG(m->desc_ring + OFFSET(prb_desc_ring_descs));
+    m->infos_kaddr = ULONG(m->desc_ring + OFFSET(prb_desc_ring_infos));
+
+    m->text_data_ring = m->prb + OFFSET(prb_text_data_ring);
+    m->text_data_ring_size = 1 << UINT(m->text_data_ring + OFFSET(prb_data_ring_size_bits));
+    m->text_data_kaddr = ULONG(m->text_data_ring + OFFSET(prb_data_ring_data));
+
+    return 0;
 }
 
-void dump_lockless_record_log()
+static int prb_map_init(struct prb_map *m)
 {
-    unsigned long head_id;
-    unsigned long tail_id;
-    unsigned long kaddr;
-    unsigned long id;
-    struct prb_map m;
+    if (prb_map_read(m))
+        return -1;
 
-    if (SIZE(printk_info) == 0) {
-        offsets_init();
+    m->desc_slots = m->desc_ring_count;
+    prb_map_limit(m);
+
+    m->descs = xmalloc(SIZE(prb_desc) * m->desc_slots);
+    m->infos = xmalloc(SIZE(printk_info) * m->desc_slots);
+    m->selected = xcalloc(m->desc_slots / 64 + 1, sizeof(uint64_t));
+    m->text_data = xmalloc(m->text_window ? m->text_window : m->text_data_ring_size);
+
+    return 0;
+}
+
+static void prb_map_free(struct prb_map *m)
+{
+    xfree(m->selected);
+    xfree(m->text_data);
+    xfree(m->infos);
+    xfree(m->descs);
+    xfree(m->prb);
+}
+
+static void prb_head_tail(struct prb_map *m, unsigned long *head_id,
+        unsigned long *tail_id)
+{
+    *tail_id = ULONG(m->desc_ring + OFFSET(prb_desc_ring_tail_id) +
+            offsetof(atomic_long_t, counter));
+    *head_id = ULONG(m->desc_ring + OFFSET(prb_desc_ring_head_id) +
+            offsetof(atomic_long_t, counter));
+}
+
+/*
+ * Refresh head_id and tail_id, which sit next to each other in the
+ * guest's prb_desc_ring, with one small read.
+ */
+static int prb_read_head_tail(struct prb_map *m)
+{
+    long lo = OFFSET(prb_desc_ring_head_id);
+    long hi = OFFSET(prb_desc_ring_tail_id);
+
+    if (lo > hi) {
+        lo = OFFSET(prb_desc_ring_tail_id);
+        hi = OFFSET(prb_desc_ring_head_id);
     }
+    hi += sizeof(atomic_long_t);
 
-    get_symbol_data("prb", sizeof(char *), &kaddr);
-    m.prb = xmalloc(SIZE(printk_ringbuffer));
+    return readmem(m->prb_kaddr + OFFSET(prb_desc_ring) + lo, KVADDR,
+            m->desc_ring + lo, hi - lo);
+}
 
-    if (readmem(kaddr, KVADDR, m.prb, SIZE(printk_ringbuffer))) {
-        pr_err("Cannot read printk_ringbuffer contents");
-        goto out_prb;
+/*
+ * Read nr consecutive slots of a guest array of count elements, starting
+ * at slot first and wrapping around the end of the array, into slot
+ * first % dst_count on of a local array of dst_count elements.
+ */
+static int prb_read_slots(char *dst, unsigned long dst_count,
+        unsigned long kaddr, long size, unsigned long count,
+        unsigned long first, unsigned long nr)
+{
+    unsigned long slot, local, part;
+
+    while (nr) {
+        slot = first % count;
+        local = first % dst_count;
+        part = count - slot;
+        if (part > dst_count - local)
+            part = dst_count - local;
+        if (part > nr)
+            part = nr;
+
+        if (readmem(kaddr + slot * size, KVADDR, dst + local * size, part * size))
+            return -1;
+
+        first += part;
+        nr -= part;
     }
 
-    m.desc_ring = m.prb + OFFSET(prb_desc_ring);
-    m.desc_ring_count = 1 << UINT(m.desc_ring + OFFSET(prb_desc_ring_count_bits));
+    return 0;
+}
+
+/*
+ * Record selection runs over columns instead of the local desc and info
+ * arrays.  A block of ids is transposed into one column per field that
+ * is tested, each test is one pass over its column that narrows a byte
+ * mask, and the mask is packed into m->selected, a bit per local slot.
+ * The byte columns (state, level, facility) are compared sixteen ids at
+ * a time; SSE2 has no 64-bit compares, so seq and ts passes are plain
+ * loops left to the compiler.  Decoders then only test a bit per id.
+ */
+#define PRB_SCAN_BLOCK  (256)
 
-    kaddr = ULONG(m.desc_ring + OFFSET(prb_desc_ring_descs));
-    m.descs = xmalloc(SIZE(prb_desc) * m.desc_ring_count);
+#define PRB_STATE_MISS  (0xff)
 
-    if (readmem(kaddr, KVADDR, m.descs, SIZE(prb_desc) * m.desc_ring_count)) {
-        pr_err("Cannot read prb_desc_ring contents");
-        goto out_descs;
+struct prb_scan {
+    uint8_t state[PRB_SCAN_BLOCK];
+    uint8_t level[PRB_SCAN_BLOCK];
+    uint8_t facility[PRB_SCAN_BLOCK];
+    uint8_t sel[PRB_SCAN_BLOCK];
+    uint32_t caller[PRB_SCAN_BLOCK];
+    uint64_t seq[PRB_SCAN_BLOCK];
+    uint64_t ts[PRB_SCAN_BLOCK];
+};
+
+
+static void prb_scan_columns(struct prb_map *m, struct prb_scan *s,
+        unsigned long id, unsigned long n)
+{
+    struct printk_info *pi;
+    unsigned long sv, i;
+    char *desc;
+
+    for (i = 0; i < n; i++, id = (id + 1) & DESC_ID_MASK) {
+        desc = prb_desc(m, id);
+        sv = ULONG(desc + offsetof(struct prb_desc, state_var) +
+                offsetof(atomic_long_t, counter));
+        s->state[i] = (DESC_ID(sv) == id) ? DESC_STATE(sv) : PRB_STATE_MISS;
+
+        pi = (struct printk_info *)prb_info(m, id);
+        s->level[i] = pi->level;
+        s->facility[i] = pi->facility;
+        s->caller[i] = pi->caller_id;
+        s->seq[i] = pi->seq;
+        s->ts[i] = pi->ts_nsec;
+    }
+}
+
+/* sel[i] &= (col[i] is one of the values whose bit is set in mask) */
+static void prb_scan_in_set(uint8_t *sel, const uint8_t *col, unsigned long n,
+        uint32_t mask)
+{
+    unsigned long i = 0;
+#ifdef __SSE2__
+    __m128i v, hit;
+    int b;
+
+    for (; i + 16 <= n; i += 16) {
+        v = _mm_loadu_si128((const __m128i *)(col + i));
+        hit = _mm_setzero_si128();
+        for (b = 0; b < 32; b++) {
+            if (mask & (1U << b))
+                hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, _mm_set1_epi8(b)));
+        }
+        _mm_storeu_si128((__m128i *)(sel + i),
+                _mm_and_si128(hit, _mm_loadu_si128((const __m128i *)(sel + i))));
+    }
+#endif
+
+    for (; i < n; i++)
+        sel[i] &= (col[i] < 32 && (mask & (1U << col[i]))) ? 0xff : 0;
+}
+
+/* n bits of bits at bit pos of bm */
+static void prb_bits_store(uint64_t *bm, unsigned long pos, uint64_t bits, int n)
+{
+    unsigned long w = pos / 64, off = pos % 64;
+    uint64_t mask = (n == 64) ? ~0ULL : (1ULL << n) - 1;
+
+    bm[w] = (bm[w] & ~(mask << off)) | (bits << off);
+    if (off + n > 64)
+        bm[w + 1] = (bm[w + 1] & ~(mask >> (64 - off))) | (bits >> (64 - off));
+}
+
+static void prb_scan_pack(uint64_t *bm, unsigned long pos, const uint8_t *sel,
+        unsigned long n)
+{
+    unsigned long i = 0, j;
+    uint64_t bits;
+
+#ifdef __SSE2__
+    for (; i + 16 <= n; i += 16) {
+        bits = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(sel + i)));
+        prb_bits_store(bm, pos + i, bits, 16);
+    }
+#endif
+
+    for (; i < n; i += j) {
+        for (bits = 0, j = 0; j < 16 && i + j < n; j++)
+            bits |= (uint64_t)(sel[i + j] & 1) << j;
+        prb_bits_store(bm, pos + i, bits, j);
+    }
+}
+
+/*
+ * Select the records of n ids from id on, whose slots do not wrap: a
+ * writer is done with them and their metadata passes the record filter.
+ */
+static void prb_scan_block(struct prb_map *m, struct prb_scan *s,
+        unsigned long id, unsigned long n)
+{
+    struct record_filter *f = record_filter;
+    unsigned long i, j;
+
+    prb_scan_columns(m, s, id, n);
+
+    /* desc_committed or desc_finalized */
+    memset(s->sel, 0xff, n);
+    prb_scan_in_set(s->sel, s->state, n,
+            (1U << desc_committed) | (1U << desc_finalized));
+
+    if (f->active) {
+        if (f->levels)
+            prb_scan_in_set(s->sel, s->level, n, f->levels);
+        if (f->facilities)
+            prb_scan_in_set(s->sel, s->facility, n, f->facilities);
+        if (f->seq_min || f->seq_max != UINT64_MAX) {
+            for (i = 0; i < n; i++)
+                s->sel[i] &= (s->seq[i] >= f->seq_min && s->seq[i] <= f->seq_max) ? 0xff : 0;
+        }
+        if (f->ts_min || f->ts_max != UINT64_MAX) {
+            for (i = 0; i < n; i++)
+                s->sel[i] &= (s->ts[i] >= f->ts_min && s->ts[i] <= f->ts_max) ? 0xff : 0;
+        }
+        if (f->nr_callers) {
+            for (i = 0; i < n; i++) {
+                for (j = 0; j < (unsigned long)f->nr_callers; j++) {
+                    if (f->callers[j] == s->caller[i])
+                        break;
+                }
+                if (j == (unsigned long)f->nr_callers)
+                    s->sel[i] = 0;
+            }
+        }
+    }
+
+    prb_scan_pack(m->selected, id % m->desc_slots, s->sel, n);
+}
+
+static void prb_select(struct prb_map *m, unsigned long id, unsigned long nr)
+{
+    struct timespec t0, t1;
+    struct prb_scan *s;
+    unsigned long n;
+
+    if (KDEBUG(1))
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    s = xmalloc(sizeof(*s));
+    if (nr > m->desc_slots)
+        nr = m->desc_slots;
+    m->scan_ids += nr;
+
+    while (nr) {
+        n = m->desc_slots - id % m->desc_slots;
+        if (n > PRB_SCAN_BLOCK)
+            n = PRB_SCAN_BLOCK;
+        if (n > nr)
+            n = nr;
+        prb_scan_block(m, s, id, n);
+        id = (id + n) & DESC_ID_MASK;
+        nr -= n;
+    }
+    xfree(s);
+
+    if (KDEBUG(1)) {
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        m->scan_time.tv_sec += t1.tv_sec - t0.tv_sec;
+        m->scan_time.tv_nsec += t1.tv_nsec - t0.tv_nsec;
     }
+}
+
+static void prb_report_scan(struct prb_map *m)
+{
+    double sec = m->scan_time.tv_sec + m->scan_time.tv_nsec / 1e9;
+
+    if (!KDEBUG(1) || !m->scan_ids)
+        return;
+
+    pr_debug("scan: %lu records in %.3f ms, %.0f records/s", m->scan_ids,
+            sec * 1e3, sec > 0 ? m->scan_ids / sec : 0.0);
+}
 
-    kaddr = ULONG(m.desc_ring + OFFSET(prb_desc_ring_infos));
-    m.infos = xmalloc(SIZE(printk_info) * m.desc_ring_count);
+static int prb_record_selected(struct prb_map *m, unsigned long id)
+{
+    unsigned long slot = id % m->desc_slots;
+
+    return (m->selected[slot / 64] >> (slot % 64)) & 1;
+}
+
+/*
+ * Read the descriptors and infos of nr ids starting at id, and select
+ * among them.
+ */
+static int prb_read_ids(struct prb_map *m, unsigned long id, unsigned long nr)
+{
+    if (prb_read_slots(m->descs, m->desc_slots, m->descs_kaddr,
+                SIZE(prb_desc), m->desc_ring_count, id, nr)) {
+        pr_err("Cannot read prb_desc_ring contents");
+        return -1;
+    }
 
-    if (readmem(kaddr, KVADDR, m.infos, SIZE(printk_info) * m.desc_ring_count)) {
+    if (prb_read_slots(m->infos, m->desc_slots, m->infos_kaddr,
+                SIZE(printk_info), m->desc_ring_count, id, nr)) {
         pr_err("Cannot read prb_info_ring contents");
-        goto out_infos;
+        return -1;
     }
 
-    m.text_data_ring = m.prb + OFFSET(prb_text_data_ring);
-    m.text_data_ring_size = 1 << UINT(m.text_data_ring + OFFSET(prb_data_ring_size_bits));
+    prb_select(m, id, nr);
+    return 0;
+}
+
+/*
+ * Read the part of the text data ring between two logical positions.
+ */
+static int prb_read_text(struct prb_map *m, unsigned long begin,
+        unsigned long next)
+{
+    unsigned long size = m->text_data_ring_size;
+    unsigned long len = next - begin;
 
-    kaddr = ULONG(m.text_data_ring + OFFSET(prb_data_ring_data));
-    m.text_data = xmalloc(m.text_data_ring_size);
+    if (len >= size)
+        return readmem(m->text_data_kaddr, KVADDR, m->text_data, size);
 
-    if (readmem(kaddr, KVADDR, m.text_data, m.text_data_ring_size)) {
+    if (prb_read_slots(m->text_data, size, m->text_data_kaddr, 1, size,
+                begin, len)) {
         pr_err("Cannot read prb_text_data_ring contents");
-        goto out_text_data;
+        return -1;
     }
 
-    tail_id = ULONG(m.desc_ring + OFFSET(prb_desc_ring_tail_id) +
-            offsetof(atomic_long_t, counter));
-    head_id = ULONG(m.desc_ring + OFFSET(prb_desc_ring_head_id) +
-            offsetof(atomic_long_t, counter));
+    return 0;
+}
+
+static enum desc_state prb_desc_state(struct prb_map *m, unsigned long id)
+{
+    char *desc = prb_desc(m, id);
+
+    return get_desc_state(id, ULONG(desc + offsetof(struct prb_desc, state_var) +
+                offsetof(atomic_long_t, counter)));
+}
+
+static inline uint64_t prb_info_seq(struct prb_map *m, unsigned long id)
+{
+    return ULONGLONG(prb_info(m, id) + offsetof(struct printk_info, seq));
+}
+
+/* ids are DESC_ID_MASK wide and wrap, a is older than b if b - a is small */
+static inline int prb_id_before(unsigned long a, unsigned long b)
+{
+    unsigned long d = (b - a) & DESC_ID_MASK;
+
+    return d && d <= (DESC_ID_MASK >> 1);
+}
+
+/*
+ * Fetch the info of one id for a seek probe.  Sequence numbers advance
+ * with the id, so an info whose seq is not first_seq plus the distance
+ * from the first id still belongs to an older record (its slot has been
+ * reserved but not yet filled) and is treated as lying past any bound.
+ */
+static struct printk_info *prb_probe_info(struct prb_map *m,
+        unsigned long id, uint64_t seq)
+{
+    struct printk_info *pi;
+
+    if (prb_read_slots(m->infos, m->desc_slots, m->infos_kaddr,
+                SIZE(printk_info), m->desc_ring_count, id, 1))
+        return NULL;
+
+    pi = (struct printk_info *)prb_info(m, id);
+    return (pi->seq == seq) ? pi : NULL;
+}
 
-    for (id = tail_id; id != head_id; id = (id + 1) & DESC_ID_MASK) {
-        dump_record(&m, id);
+/*
+ * Offset from first of the first of nr records whose seq (or ts_nsec)
+ * is not below value.
+ */
+static unsigned long prb_lower_bound(struct prb_map *m, unsigned long first,
+        unsigned long nr, uint64_t first_seq, int by_ts, uint64_t value)
+{
+    unsigned long lo = 0, hi = nr, mid;
+    struct printk_info *pi;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        pi = prb_probe_info(m, (first + mid) & DESC_ID_MASK, first_seq + mid);
+        if (pi && (by_ts ? pi->ts_nsec : pi->seq) < value)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/*
+ * Narrow [*first, *last] to the records that can pass the sequence and
+ * time bounds of the record filter.  Both grow with the id, so each bound
+ * is a binary search that reads one info per probe instead of the whole
+ * ring.  The filter is still applied per record, the seek only limits
+ * what is read.
+ */
+static int prb_seek(struct prb_map *m, unsigned long *first, unsigned long *last)
+{
+    struct record_filter *f = record_filter;
+    unsigned long nr, lo, hi;
+    struct printk_info *pi;
+    uint64_t first_seq;
+
+    if (!f->seq_min && !f->ts_min && f->seq_max == UINT64_MAX &&
+            f->ts_max == UINT64_MAX)
+        return 0;
+
+    if (prb_read_slots(m->infos, m->desc_slots, m->infos_kaddr,
+                SIZE(printk_info), m->desc_ring_count, *first, 1)) {
+        pr_err("Cannot read prb_info_ring contents");
+        return -1;
     }
+    pi = (struct printk_info *)prb_info(m, *first);
+    first_seq = pi->seq;
+
+    nr = ((*last - *first) & DESC_ID_MASK) + 1;
+    lo = 0;
+    hi = nr;
+
+    if (f->seq_min)
+        lo = prb_lower_bound(m, *first, hi, first_seq, FALSE, f->seq_min);
+    if (f->ts_min)
+        lo = lo + prb_lower_bound(m, (*first + lo) & DESC_ID_MASK, hi - lo,
+                first_seq + lo, TRUE, f->ts_min);
+    if (f->seq_max != UINT64_MAX)
+        hi = lo + prb_lower_bound(m, (*first + lo) & DESC_ID_MASK, hi - lo,
+                first_seq + lo, FALSE, f->seq_max + 1);
+    if (f->ts_max != UINT64_MAX)
+        hi = lo + prb_lower_bound(m, (*first + lo) & DESC_ID_MASK, hi - lo,
+                first_seq + lo, TRUE, f->ts_max + 1);
+
+    if (KDEBUG(1))
+        pr_debug("seek: ids %lu-%lu of %lu", lo, hi, nr);
 
-    dump_record(&m, id);
+    /* an empty window keeps one id, which the filter then rejects */
+    if (lo == nr)
+        lo = nr - 1;
+    if (hi <= lo)
+        hi = lo + 1;
 
-out_text_data:
-    xfree(m.text_data);
-out_infos:
-    xfree(m.infos);
-out_descs:
-    xfree(m.descs);
-out_prb:
-    xfree(m.prb);
+    *last = (*first + hi - 1) & DESC_ID_MASK;
+    *first = (*first + lo) & DESC_ID_MASK;
+    return 0;
+}
+
+/* selected blocks closer than this are read together */
+#define PRB_TEXT_GAP  (4096)
+
+/*
+ * Read the text of the selected records among the nr ids starting at
+ * id, whose descriptors are already local.  Blocks are allocated in id
+ * order, so runs of selected records are read as one lpos span (two
+ * reads when it wraps) and only far apart records cost a read each.
+ */
+static int prb_read_text_ids(struct prb_map *m, unsigned long id, unsigned long nr)
+{
+    unsigned long begin, next, lo = 0, hi = 0;
+    int have_text = FALSE;
+    char *desc;
+
+    for (; nr--; id = (id + 1) & DESC_ID_MASK) {
+        if (!prb_record_selected(m, id))
+            continue;
+        desc = prb_desc(m, id);
+        begin = ULONG(desc + offsetof(struct prb_desc, text_blk_lpos) +
+                offsetof(struct prb_data_blk_lpos, begin));
+        next = ULONG(desc + offsetof(struct prb_desc, text_blk_lpos) +
+                offsetof(struct prb_data_blk_lpos, next));
+        if (begin == next || (begin & 1UL))
+            continue;
+        if (have_text && ((long)(begin - hi) > PRB_TEXT_GAP ||
+                    (long)(begin - lo) < 0)) {
+            if (prb_read_text(m, lo, hi))
+                return -1;
+            have_text = FALSE;
+        }
+        if (!have_text) {
+            lo = begin;
+            hi = next;
+            have_text = TRUE;
+            continue;
+        }
+        if ((long)(next - hi) > 0)
+            hi = next;
+    }
+
+    if (!have_text)
+        return 0;
+
+    return prb_read_text(m, lo, hi);
+}
+
+/* reads of a record that changed under us before it is given up */
+#define PRB_RETRIES         (3)
+
+/*
+ * The data block of a record starts with the record's id, another id
+ * means the block was reused before its text was copied.
+ */
+static int prb_text_intact(struct prb_map *m, unsigned long id)
+{
+    unsigned short len;
+    char *text;
+
+    if (!(text = prb_record_text(m, id, &len)))
+        return TRUE;
+
+    return (ULONG(text - sizeof(unsigned long)) & DESC_ID_MASK) == id;
+}
+
+/*
+ * A record that was committed or finalized when first read is intact if
+ * its descriptor, read again after the text, still names it, is not
+ * being reused and points at the same data block.
+ */
+static int prb_desc_unchanged(unsigned long id, char *old, char *desc)
+{
+    enum desc_state state;
+
+    state = get_desc_state(id, ULONG(desc + offsetof(struct prb_desc, state_var) +
+                offsetof(atomic_long_t, counter)));
+    if (state != desc_committed && state != desc_finalized)
+        return FALSE;
+
+    return !memcmp(old + offsetof(struct prb_desc, text_blk_lpos),
+            desc + offsetof(struct prb_desc, text_blk_lpos),
+            sizeof(struct prb_data_blk_lpos));
+}
+
+/* text of one record again, into the ring copy or the streaming window */
+static int prb_reread_text(struct prb_map *m, unsigned long lo, unsigned long hi)
+{
+    if (!m->text_window)
+        return prb_read_text(m, lo, hi);
+
+    if (lo - m->text_base > m->text_len || hi - m->text_base > m->text_len)
+        return -1;
+
+    return readmem(m->text_data_kaddr + lo % m->text_data_ring_size, KVADDR,
+            m->text_data + (lo - m->text_base), hi - lo);
+}
+
+/*
+ * Fetch a torn record again until its descriptor stays the same across
+ * the copy of its text.  One that was reopened by a writer is given a
+ * moment to be committed again.  A record that is gone, or keeps
+ * changing, is marked reusable in the local copy so it is not printed.
+ */
+static void prb_refetch(struct prb_map *m, unsigned long id)
+{
+    struct timespec ts = { 0, 1000000 };
+    struct prb_desc old;
+    enum desc_state state;
+    unsigned long lo, hi;
+    int i;
+
+    for (i = 0; i < PRB_RETRIES; i++) {
+        if (i)
+            nanosleep(&ts, NULL);
+
+        if (prb_read_ids(m, id, 1))
+            break;
+
+        state = prb_desc_state(m, id);
+        if (state == desc_reserved)
+            continue;
+        if (state != desc_committed && state != desc_finalized)
+            break;
+
+        memcpy(&old, prb_desc(m, id), sizeof(old));
+        if (prb_text_blk(m, id, &lo, &hi) && prb_reread_text(m, lo, hi))
+            break;
+        if (prb_read_slots(m->descs, m->desc_slots, m->descs_kaddr,
+                    SIZE(prb_desc), m->desc_ring_count, id, 1))
+            break;
+
+        if (prb_desc_unchanged(id, (char *)&old, prb_desc(m, id)) &&
+                prb_text_intact(m, id)) {
+            m->reread++;
+            return;
+        }
+    }
+
+    m->dropped++;
+    ULONG(prb_desc(m, id) + offsetof(struct prb_desc, state_var) +
+            offsetof(atomic_long_t, counter)) =
+        ((unsigned long)desc_reusable << DESC_FLAGS_SHIFT) | id;
+}
+
+/*
+ * The guest keeps logging while we read it.  Read the descriptors of
+ * the nr ids from id on again once their text has been copied, as the
+ * kernel's own readers do, and fetch again every selected record whose
+ * descriptor or data block changed in between.  Records that were not
+ * complete at the first read keep that state, their text was not read.
+ */
+static int prb_revalidate(struct prb_map *m, unsigned long id, unsigned long nr)
+{
+    size_t size = sizeof(struct prb_desc);
+    char *old, *desc, *prev;
+    enum desc_state state;
+    unsigned long i, cur;
+
+    old = xmalloc(nr * size);
+    for (i = 0, cur = id; i < nr; i++, cur = (cur + 1) & DESC_ID_MASK)
+        memcpy(old + i * size, prb_desc(m, cur), size);
+
+    if (prb_read_slots(m->descs, m->desc_slots, m->descs_kaddr,
+                SIZE(prb_desc), m->desc_ring_count, id, nr)) {
+        pr_err("Cannot read prb_desc_ring contents");
+        xfree(old);
+        return -1;
+    }
+
+    for (i = 0, cur = id; i < nr; i++, cur = (cur + 1) & DESC_ID_MASK) {
+        desc = prb_desc(m, cur);
+        prev = old + i * size;
+
+        state = get_desc_state(cur, ULONG(prev + offsetof(struct prb_desc, state_var) +
+                    offsetof(atomic_long_t, counter)));
+        if (state != desc_committed && state != desc_finalized) {
+            memcpy(desc, prev, size);
+            continue;
+        }
+
+        if (!prb_record_selected(m, cur))
+            continue;
+
+        if (prb_desc_unchanged(cur, prev, desc) && prb_text_intact(m, cur))
+            continue;
+
+        m->torn++;
+        prb_refetch(m, cur);
+    }
+
+    xfree(old);
+    return 0;
+}
+
+static void prb_report_torn(struct prb_map *m)
+{
+    if (!m->torn)
+        return;
+
+    pr_warning("%lu messages changed while being read: %lu read again, %lu dropped",
+            m->torn, m->reread, m->dropped);
+    m->torn = m->reread = m->dropped = 0;
+}
+
+/*
+ * Find the first of the last pc->tail printable records.  Only a window
+ * of descriptors and infos below head_id is read, grown until it holds
+ * enough records or reaches tail_id, followed by the text those records
+ * cover.  With text patterns the window's text is read on every step.
+ */
+static int prb_read_tail(struct prb_map *m, unsigned long head_id,
+        unsigned long tail_id, unsigned long *first_id)
+{
+    unsigned long avail, window, found, id, i;
+
+    avail = ((head_id - tail_id) & DESC_ID_MASK) + 1;
+    if (avail > m->desc_ring_count)
+        avail = m->desc_ring_count;
+
+    window = pc->tail + 16;
+    for (;;) {
+        if (window > avail)
+            window = avail;
+
+        id = (head_id - window + 1) & DESC_ID_MASK;
+        if (prb_read_ids(m, id, window))
+            return -1;
+
+        /* patterns need the text before records can be counted */
+        if (text_filter->nr_patterns && prb_read_text_ids(m, id, window))
+            return -1;
+
+        found = 0;
+        for (i = 0, id = head_id; i < window; i++, id = (id - 1) & DESC_ID_MASK) {
+            if (prb_record_selected(m, id) &&
+                    (!text_filter->nr_patterns || prb_text_match(m, id)) &&
+                    ++found == pc->tail)
+                break;
+        }
+
+        if (found == pc->tail || window == avail) {
+            if (i == window)
+                id = (id + 1) & DESC_ID_MASK;
+            break;
+        }
+        window *= 2;
+    }
+
+    *first_id = id;
+
+    return prb_read_text_ids(m, id, ((head_id - id) & DESC_ID_MASK) + 1);
+}
+
+static volatile sig_atomic_t follow_stop;
+
+static void follow_signal(int sig)
+{
+    (void)sig;
+    follow_stop = TRUE;
+}
+
+void follow_init(void)
+{
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = follow_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+}
+
+int follow_wait(void)
+{
+    struct timespec ts;
+
+    /* the cursor never gets ahead of what was written */
+    if (!output_flush())
+        cursor_store();
+    if (follow_stop)
+        return FALSE;
+
+    ts.tv_sec = pc->interval / 1000;
+    ts.tv_nsec = (pc->interval % 1000) * 1000000;
+    nanosleep(&ts, NULL);
+
+    return !follow_stop;
+}
+
+struct prb_follow {
+    unsigned long next_id;      /* first id not printed yet */
+    uint64_t next_seq;          /* seq expected for next_id */
+    int seq_valid;
+    unsigned long lost;
+};
+
+/*
+ * Print finalized records from f->next_id up to head_id, stopping at the
+ * first record a writer still owns, like the kernel's own readers do.
+ */
+static void prb_dump_finalized(struct prb_map *m, struct prb_follow *f,
+        unsigned long head_id)
+{
+    unsigned long id = f->next_id;
+    enum desc_state state;
+    uint64_t seq;
+
+    for (;; id = (id + 1) & DESC_ID_MASK) {
+        state = prb_desc_state(m, id);
+        if (state == desc_reserved || state == desc_committed)
+            break;
+
+        if (state == desc_finalized) {
+            seq = prb_info_seq(m, id);
+            if (f->seq_valid && seq > f->next_seq)
+                f->lost += seq - f->next_seq;
+            f->next_seq = seq + 1;
+            f->seq_valid = TRUE;
+            dump_record(m, id);
+            cursor_advance(seq, ULONGLONG(prb_info(m, id) +
+                        offsetof(struct printk_info, ts_nsec)));
+        }
+
+        if (id == head_id) {
+            id = (id + 1) & DESC_ID_MASK;
+            break;
+        }
+    }
+
+    f->next_id = id;
+}
+
+/*
+ * Follow the ring: poll head_id and fetch only the descriptors, infos
+ * and text blocks of ids that appeared since the last poll.
+ */
+static void prb_follow(struct prb_map *m, struct prb_follow *f)
+{
+    unsigned long head_id, tail_id, nr;
+
+    while (follow_wait()) {
+        if (prb_read_head_tail(m))
+            continue;
+        prb_head_tail(m, &head_id, &tail_id);
+
+        if (f->next_id == ((head_id + 1) & DESC_ID_MASK))
+            continue;
+
+        /* the writers lapped us, resume at the oldest record left */
+        if (prb_id_before(f->next_id, tail_id))
+            f->next_id = tail_id;
+
+        nr = ((head_id - f->next_id) & DESC_ID_MASK) + 1;
+        if (nr > m->desc_ring_count) {
+            f->next_id = (head_id - m->desc_ring_count + 1) & DESC_ID_MASK;
+            nr = m->desc_ring_count;
+        }
+
+        if (prb_read_ids(m, f->next_id, nr))
+            continue;
+
+        if (prb_read_text_ids(m, f->next_id, nr))
+            continue;
+
+        if (prb_revalidate(m, f->next_id, nr))
+            continue;
+
+        prb_dump_finalized(m, f, head_id);
+        prb_report_torn(m);
+
+        if (f->lost) {
+            pr_warning("%lu messages lost, the ring was overwritten", f->lost);
+            f->lost = 0;
+        }
+    }
+}
+
+/*
+ * Read the text between two logical positions into the streaming window.
+ */
+static int prb_read_window(struct prb_map *m, unsigned long lo, unsigned long hi)
+{
+    unsigned long size = m->text_data_ring_size;
+    unsigned long len = hi - lo, off = lo % size, part;
+
+    if (len > m->text_window)
+        len = m->text_window;
+    part = size - off;
+    if (part > len)
+        part = len;
+
+    m->text_len = 0;
+    if (readmem(m->text_data_kaddr + off, KVADDR, m->text_data, part) ||
+            (len > part && readmem(m->text_data_kaddr, KVADDR,
+                                   m->text_data + part, len - part))) {
+        pr_err("Cannot read prb_text_data_ring contents");
+        return -1;
+    }
+
+    m->text_base = lo;
+    m->text_len = len;
+    return 0;
+}
+
+/*
+ * With --cursor, only the records before the first one a writer still
+ * owns are printed, the next run starts at that one: the cursor can not
+ * pass it, and records printed past it would be printed again.  Returns
+ * how many of the nr ids from id on to print, their descriptors must be
+ * local.
+ */
+static unsigned long prb_cursor_limit(struct prb_map *m, unsigned long id,
+        unsigned long nr)
+{
+    unsigned long i;
+
+    if (!pc->cursor)
+        return nr;
+
+    for (i = 0; i < nr; i++, id = (id + 1) & DESC_ID_MASK) {
+        if (prb_desc_state(m, id) == desc_reserved)
+            break;
+    }
+    return i;
+}
+
+/*
+ * Note the first of nr records from id on that a writer still owns: the
+ * --probe and --daemon marker must not cover it, or a run after the
+ * writer is done would see nothing new and never print it.
+ */
+static void prb_marker_limit(struct prb_map *m, unsigned long id,
+        unsigned long nr)
+{
+    for (; nr && !m->reserved; nr--, id = (id + 1) & DESC_ID_MASK) {
+        if (prb_desc_state(m, id) == desc_reserved) {
+            m->marker_id = (id - 1) & DESC_ID_MASK;
+            m->reserved = TRUE;
+        }
+    }
+}
+
+/*
+ * Print nr records from id on with only windows of the rings local:
+ * desc_slots descriptors and infos at a time, and their text in runs of
+ * at most text_window bytes that follow the blocks' logical positions.
+ * Each run is printed before the next one is read.  *done is set to the
+ * number of ids handled, fewer than nr if prb_cursor_limit() stopped.
+ */
+static int prb_dump_stream(struct prb_map *m, unsigned long id, unsigned long nr,
+        unsigned long *done)
+{
+    unsigned long n, lim, first, lo = 0, hi = 0, begin, next;
+    int have_text;
+
+    *done = 0;
+    while (nr) {
+        n = nr < m->desc_slots ? nr : m->desc_slots;
+        if (prb_read_ids(m, id, n))
+            return -1;
+        nr -= n;
+
+        prb_marker_limit(m, id, n);
+        if ((lim = prb_cursor_limit(m, id, n)) < n) {
+            n = lim;
+            nr = 0;
+        }
+        *done += n;
+
+        first = id;
+        have_text = FALSE;
+        for (; n; n--, id = (id + 1) & DESC_ID_MASK) {
+            if (!prb_record_selected(m, id) || !prb_text_blk(m, id, &begin, &next))
+                continue;
+            if (have_text && ((long)(begin - hi) > PRB_TEXT_GAP ||
+                        (long)(begin - lo) < 0 || next - lo > m->text_window)) {
+                if (prb_read_window(m, lo, hi) ||
+                        prb_revalidate(m, first, (id - first) & DESC_ID_MASK))
+                    return -1;
+                for (; first != id; first = (first + 1) & DESC_ID_MASK)
+                    dump_record(m, first);
+                have_text = FALSE;
+            }
+            if (!have_text) {
+                lo = begin;
+                hi = next;
+                have_text = TRUE;
+            } else if ((long)(next - hi) > 0) {
+                hi = next;
+            }
+        }
+
+        if (have_text && prb_read_window(m, lo, hi))
+            return -1;
+        if (prb_revalidate(m, first, (id - first) & DESC_ID_MASK))
+            return -1;
+        for (; first != id; first = (first + 1) & DESC_ID_MASK)
+            dump_record(m, first);
+    }
+
+    return 0;
+}
+
+/*
+ * Records per decoding thread below which another thread does not pay
+ * for itself.
+ */
+#define PRB_JOB_MIN_IDS     (4096)
+#define PRB_MAX_JOBS        (16)
+
+struct prb_job {
+    pthread_t thread;
+    struct prb_map *m;
+    unsigned long first_id;
+    unsigned long nr;
+    struct output out;
+};
+
+static void *prb_job_run(void *arg)
+{
+    struct prb_job *job = arg;
+    unsigned long id = job->first_id;
+    unsigned long i;
+
+    output_select(&job->out);
+    for (i = 0; i < job->nr; i++, id = (id + 1) & DESC_ID_MASK)
+        dump_record(job->m, id);
+    output_select(NULL);
+
+    return NULL;
+}
+
+static int prb_jobs(unsigned long nr)
+{
+    long jobs = pc->jobs;
+
+    if (!jobs) {
+        jobs = sysconf(_SC_NPROCESSORS_ONLN);
+        if (jobs > 8)
+            jobs = 8;
+    }
+    if ((unsigned long)jobs > nr / PRB_JOB_MIN_IDS)
+        jobs = nr / PRB_JOB_MIN_IDS;
+    if (jobs > PRB_MAX_JOBS)
+        jobs = PRB_MAX_JOBS;
+
+    return jobs < 1 ? 1 : jobs;
+}
+
+/*
+ * Print nr records from id on, all of them local already.  Large ranges
+ * are split into contiguous slices formatted by separate threads into
+ * their own buffers, which are written out in id order, so the output
+ * is the same as from one thread.
+ */
+static void prb_dump_range(struct prb_map *m, unsigned long id, unsigned long nr)
+{
+    struct prb_job jobs[PRB_MAX_JOBS];
+    int nr_jobs = prb_jobs(nr);
+    unsigned long part;
+    int i, started;
+
+    if (nr_jobs > 1 && !text_filter->nr_patterns) {
+        for (started = 0; started < nr_jobs; started++) {
+            part = nr / (nr_jobs - started);
+            jobs[started].m = m;
+            jobs[started].first_id = id;
+            jobs[started].nr = part;
+            output_buffer_init(&jobs[started].out);
+            if (pthread_create(&jobs[started].thread, NULL, prb_job_run,
+                        &jobs[started])) {
+                output_buffer_free(&jobs[started].out);
+                break;
+            }
+            id = (id + part) & DESC_ID_MASK;
+            nr -= part;
+        }
+
+        for (i = 0; i < started; i++) {
+            pthread_join(jobs[i].thread, NULL);
+            output_emit(&jobs[i].out);
+            output_buffer_free(&jobs[i].out);
+        }
+
+        if (KDEBUG(1))
+            pr_debug("decoded with %d threads", started);
+    }
+
+    /* the whole range, or what is left if a thread could not start */
+    for (; nr; nr--, id = (id + 1) & DESC_ID_MASK)
+        dump_record(m, id);
+}
+
+/*
+ * Start after the --cursor of the last run.  The seq of the oldest
+ * record gives the records lost to a wrap, the one of the record the
+ * cursor ends at tells whether this is still the same boot.
+ */
+static int prb_cursor_resume(struct prb_map *m, unsigned long head_id,
+        unsigned long tail_id)
+{
+    unsigned long nr = ((head_id - tail_id) & DESC_ID_MASK) + 1;
+    uint64_t first_seq, seq, ts_nsec;
+    struct printk_info *pi;
+    int match = -1;
+
+    if (prb_read_slots(m->infos, m->desc_slots, m->infos_kaddr,
+                SIZE(printk_info), m->desc_ring_count, tail_id, 1)) {
+        pr_err("Cannot read prb_info_ring contents");
+        return -1;
+    }
+    first_seq = prb_info_seq(m, tail_id);
+
+    if (!cursor_last(&seq, &ts_nsec) && seq >= first_seq && seq - first_seq < nr) {
+        pi = prb_probe_info(m, (tail_id + (seq - first_seq)) & DESC_ID_MASK, seq);
+        match = pi ? pi->ts_nsec == ts_nsec : FALSE;
+    }
+
+    cursor_resume(first_seq, first_seq + nr, match);
+    return 0;
+}
+
+/*
+ * Move the cursor past the records of the nr ids up to last_id that were
+ * handled, up to the first one a writer still owns.  Only the ids whose
+ * descriptors are still local are looked at.
+ */
+static void prb_cursor_advance(struct prb_map *m, unsigned long last_id,
+        unsigned long nr)
+{
+    enum desc_state state;
+    unsigned long id;
+    char *info;
+
+    if (nr > m->desc_slots)
+        nr = m->desc_slots;
+
+    for (id = (last_id - nr + 1) & DESC_ID_MASK; nr--; id = (id + 1) & DESC_ID_MASK) {
+        state = prb_desc_state(m, id);
+        if (state == desc_reserved)
+            break;
+        if (state != desc_committed && state != desc_finalized)
+            continue;
+        info = prb_info(m, id);
+        cursor_advance(ULONGLONG(info + offsetof(struct printk_info, seq)),
+                ULONGLONG(info + offsetof(struct printk_info, ts_nsec)));
+    }
+}
+
+/* head_id stays put until the next record, once the ring was decoded */
+static void prb_observe_marker(struct prb_map *m)
+{
+    session_cache_observe(m->prb_kaddr + OFFSET(prb_desc_ring) +
+            OFFSET(prb_desc_ring_head_id), sizeof(m->marker_id), m->marker_id);
+}
+
+/* 0 once the log was printed, -1 if it could not be read */
+int dump_lockless_record_log()
+{
+    unsigned long head_id;
+    unsigned long tail_id;
+    unsigned long last_id;
+    unsigned long id, nr;
+    struct prb_follow f;
+    struct prb_map m;
+    int ret = -1;
+
+    if (prb_map_init(&m))
+        return -1;
+
+    /*
+     * Everything slow is done and the buffers are allocated, the guest
+     * is stopped only while the ring is copied.
+     */
+    if (pc->atomic && (guest_pause() || prb_read_head_tail(&m)))
+        goto out;
+
+    prb_head_tail(&m, &head_id, &tail_id);
+    id = tail_id;
+    last_id = head_id;
+    m.marker_id = head_id;
+
+    if (pc->cursor && prb_cursor_resume(&m, head_id, tail_id))
+        goto out;
+
+    if (record_filter->active && prb_seek(&m, &id, &last_id))
+        goto out;
+
+    if (m.text_window) {
+        if (!prb_dump_stream(&m, id, ((last_id - id) & DESC_ID_MASK) + 1, &nr)) {
+            if (nr)
+                prb_cursor_advance(&m, (id + nr - 1) & DESC_ID_MASK, nr);
+            prb_observe_marker(&m);
+            ret = 0;
+        }
+        prb_report_torn(&m);
+        goto out;
+    }
+
+    if (pc->tail) {
+        if (prb_read_tail(&m, last_id, id, &id))
+            goto out;
+    } else if (record_filter->active) {
+        /* metadata first, then only the text of the records that match */
+        nr = ((last_id - id) & DESC_ID_MASK) + 1;
+
+        if (prb_read_ids(&m, id, nr) || prb_read_text_ids(&m, id, nr))
+            goto out;
+    } else {
+        if (readmem(m.descs_kaddr, KVADDR, m.descs, SIZE(prb_desc) * m.desc_ring_count)) {
+            pr_err("Cannot read prb_desc_ring contents");
+            goto out;
+        }
+
+        if (readmem(m.infos_kaddr, KVADDR, m.infos, SIZE(printk_info) * m.desc_ring_count)) {
+            pr_err("Cannot read prb_info_ring contents");
+            goto out;
+        }
+
+        if (readmem(m.text_data_kaddr, KVADDR, m.text_data, m.text_data_ring_size)) {
+            pr_err("Cannot read prb_text_data_ring contents");
+            goto out;
+        }
+        prb_select(&m, id, ((last_id - id) & DESC_ID_MASK) + 1);
+    }
+
+    /* a paused guest cannot tear records */
+    if (pc->atomic)
+        guest_resume();
+    else if (prb_revalidate(&m, id, ((last_id - id) & DESC_ID_MASK) + 1))
+        goto out;
+
+    prb_marker_limit(&m, id, ((last_id - id) & DESC_ID_MASK) + 1);
+
+    if (pc->follow) {
+        memset(&f, 0, sizeof(f));
+        f.next_id = id;
+        prb_dump_finalized(&m, &f, last_id);
+        prb_report_torn(&m);
+        f.lost = 0;
+        prb_follow(&m, &f);
+        ret = 0;
+        goto out;
+    }
+
+    nr = prb_cursor_limit(&m, id, ((last_id - id) & DESC_ID_MASK) + 1);
+    if (nr) {
+        prb_dump_range(&m, id, nr);
+        prb_cursor_advance(&m, (id + nr - 1) & DESC_ID_MASK, nr);
+    }
+    prb_observe_marker(&m);
+    prb_report_torn(&m);
+    ret = 0;
+
+out:
+    guest_resume();
+    prb_report_scan(&m);
+    prb_map_free(&m);
+    return ret;
+}
+
+/*
+ * The guest memory the decoders read besides symbol data, for --save:
+ * the ring buffer structure and its three arrays, or all of log_buf.
+ */
+int printk_regions(printk_region_t add, void *arg)
+{
+    unsigned long log_buf = kt->log_buf;
+    uint32_t log_buf_len;
+    struct prb_map m;
+
+    if (kernel_symbol_exists("prb")) {
+        if (prb_map_read(&m))
+            return -1;
+        add(m.prb_kaddr, SIZE(printk_ringbuffer), arg);
+        add(m.descs_kaddr, SIZE(prb_desc) * m.desc_ring_count, arg);
+        add(m.infos_kaddr, SIZE(printk_info) * m.desc_ring_count, arg);
+        add(m.text_data_kaddr, m.text_data_ring_size, arg);
+        xfree(m.prb);
+        return 0;
+    }
+
+    if (!log_buf && get_symbol_data("log_buf", sizeof(char *), &log_buf))
+        return -1;
+    if (get_symbol_data("log_buf_len", sizeof(uint32_t), &log_buf_len))
+        return -1;
+    log_buf_len &= ((1<<20) | ((1<<20) - 1));
+
+    add(log_buf, log_buf_len, arg);
+    return 0;
+}
+
+/*
+ * Resolve the pointer to the guest's log buffer and, for the lockless
+ * ring, the structure layout needed to walk it.
+ */
+void printk_init()
+{
+    if (kernel_symbol_exists("prb")) {
+        offsets_init();
+        get_symbol_data("prb", sizeof(ulong), &kt->prb);
+    } else if (kernel_symbol_exists("log_buf")) {
+        MEMBER_OFFSET_INIT(printk_log_caller_id, "printk_log", "caller_id");
+        get_symbol_data("log_buf", sizeof(ulong), &kt->log_buf);
+    }
 }
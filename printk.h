@@ -17,6 +17,7 @@
 #define __PRINTK_H__
 
 #include <stdint.h>
+#include <time.h>
 
 struct log {
     uint64_t ts_nsec;
@@ -81,17 +82,44 @@ struct printk_ringbuffer {
 
 struct prb_map {
     char *prb;
+    unsigned long prb_kaddr;
 
     char *desc_ring;
     unsigned long desc_ring_count;
+    unsigned long desc_slots;       /* local descs/infos, id % desc_slots */
     char *descs;
     char *infos;
+    uint64_t *selected;             /* bit per slot, set if printable */
+    unsigned long descs_kaddr;
+    unsigned long infos_kaddr;
 
     char *text_data_ring;
     unsigned long text_data_ring_size;
     char *text_data;
+    unsigned long text_data_kaddr;
+    unsigned long text_window;      /* streaming window size, 0 = whole ring */
+    unsigned long text_base;        /* lpos at text_data[0] when streaming */
+    unsigned long text_len;
+    unsigned long marker_id;        /* last id before one still reserved */
+    int reserved;                   /* marker_id is set */
+
+    /* for the reports at the end of a decode */
+    unsigned long scan_ids;
+    struct timespec scan_time;
+    unsigned long torn, reread, dropped;
 };
 
-void dump_lockless_record_log();
+#include <stddef.h>
+
+typedef void (*printk_region_t)(unsigned long kaddr, unsigned long len,
+        void *arg);
+
+void dump_text(const char *text, size_t text_len);
+void offsets_init();
+void printk_init();
+int dump_lockless_record_log();
+void follow_init(void);
+int follow_wait(void);
+int printk_regions(printk_region_t add, void *arg);
 
 #endif
@@ -19,9 +19,6 @@
 #include <inttypes.h>
 #include <errno.h>
 #include <unistd.h>
-#include <sys/socket.h>
-#include <sys/un.h>
-#include <poll.h>
 #include <stdint.h>
 #include <dirent.h>
 #include <sys/types.h>
@@ -30,19 +27,22 @@
 
 #include "xutil.h"
 #include "log.h"
+#include "defs.h"
 #include "parse_hmp.h"
-
-static int qmp_fd;
+#include "client.h"
+#include "qmp_reactor.h"
 
 #define MAX_PATH_LEN 512
 
-#define QMP_GREETING            "{\"QMP\":"
-#define QMP_ENTER_COMMAND_MODE  "{ \"execute\": \"qmp_capabilities\" }"
-#define QMP_COMMAND_MODE_OK     "{\"return\": {}}\r\n"
-
 #define QMP_COMMAND_INFO_REGS   "{\"execute\": \"human-monitor-command\", \"arguments\": {\"command-line\": \"info registers\"}}"
 #define QMP_COMMAND_XP          "{\"execute\": \"human-monitor-command\", \"arguments\": {\"command-line\": \"xp /%" PRIu64 "xb 0x%zx\"}}"
 #define QMP_COMMAND_GPA2HVA     "{\"execute\": \"human-monitor-command\", \"arguments\": {\"command-line\": \"gpa2hva 0x%lx\"}}"
+#define QMP_COMMAND_STOP        "{\"execute\": \"stop\"}"
+#define QMP_COMMAND_CONT        "{\"execute\": \"cont\"}"
+#define QMP_COMMAND_STATUS      "{\"execute\": \"query-status\"}"
+
+/* how long the monitor may take to answer a command (ms) */
+#define QMP_REPLY_TIMEOUT       5000
 
 static char* get_absolute_path(const char *file_path)
 {
@@ -185,139 +185,79 @@ pid_t qmp_get_pid(char *sock_path)
     return find_pid_by_inode(inode);
 }
 
-static int qmp_read(int fd, void *buf, size_t *len)
-{
-    struct pollfd pfd;
-    size_t tread = 0, nread;
-    int r;
-
-    pfd.fd = fd;
-    pfd.events = POLLIN;
-
-    while ((r = poll(&pfd, 1, 5)) != 0) {
-
-        if (r == -1)
-            return -1;
-
-        if (pfd.revents & POLLIN) {
-            /* read at max 1k at a time */
-            nread = xread(fd, buf, 1024);
-            tread += nread;
-            buf += nread;
-        }
-    }
-
-    *len = tread;
-    return 0;
-}
+/*
+ * The reply to a command run through qmp_call(), the connection is
+ * driven by the reactor until it arrives.
+ */
+struct qmp_reply {
+    int done;
+    int err;
+    char *buf;
+    size_t len;
+};
 
-static int qmp_establish_conn(char *sock_path)
+static void qmp_reply_copy(int err, const char *reply, size_t len, void *arg)
 {
-    int s;
-    struct sockaddr_un saddr;
-    size_t path_len;
-    size_t nread;
-
-    char buf[512];
-
-    path_len = strlen(sock_path);
-    if (path_len == 0) {
-        return -1;
-    }
-
-    if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
-        return -1;
-    }
-
-    memset(&saddr, 0, sizeof(struct sockaddr_un));
-    saddr.sun_family = AF_UNIX;
-
-    memcpy(saddr.sun_path, sock_path, path_len);
-    saddr.sun_path[path_len] = '\0';
-
-    qmp_fd = s;
-
-    /* connect */
-    if (connect(qmp_fd, (struct sockaddr *) &saddr,
-                sizeof(struct sockaddr_un)) == -1) {
-        pr_err("Failed to connect to '%s' ('%s')", sock_path, strerror(errno));
-        close(qmp_fd);
-
-        return -1;
+    struct qmp_reply *r = arg;
+
+    r->done = TRUE;
+    r->err = err;
+    if (reply) {
+        r->buf = xmalloc(len + 1);
+        memcpy(r->buf, reply, len + 1);
+        r->len = len;
     }
-
-    xsetnonblock(qmp_fd);
-
-    memset(buf, 0, sizeof(buf));
-
-    if (qmp_read(qmp_fd, buf, &nread) == -1) {
-        return -1;
-    }
-
-    if (nread == 0 && strncasecmp(buf, QMP_GREETING, strlen(QMP_GREETING))) {
-        pr_err("Failed to get QMP greeting message");
-        return -1;
-    }
-
-    return 0;
 }
 
-static int qmp_negotiate()
+/* run cmd and wait for its reply, to be freed by the caller if wanted */
+static int qmp_call(const char *cmd, char **reply, size_t *len)
 {
-    size_t cmd_len, nwrite, nread;
-    char buf[512];
+    struct qmp_reply r = { 0 };
 
-
-    cmd_len = strlen(QMP_ENTER_COMMAND_MODE);
-    nwrite = xwrite(qmp_fd, QMP_ENTER_COMMAND_MODE, cmd_len);
-    if (nwrite == 0) {
-        goto err_exit;
-    }
-
-    memset(buf, 0, sizeof(buf));
-    if (qmp_read(qmp_fd, buf, &nread) == -1) {
-        goto err_exit;
+    if (qmp_conn_submit(guest_client->qmp, cmd, qmp_reply_copy, &r) ||
+            qmp_conn_wait(guest_client->qmp, &r.done, QMP_REPLY_TIMEOUT) ||
+            r.err || !r.buf) {
+        xfree(r.buf);
+        return -1;
     }
 
-    if (strncasecmp(buf, QMP_COMMAND_MODE_OK, nread)) {
-        goto err_exit;
+    if (reply) {
+        *reply = r.buf;
+        *len = r.len;
+    } else {
+        xfree(r.buf);
     }
-
     return 0;
-
-err_exit:
-    pr_err("Failed to enter in command mode");
-    return -1;
 }
 
+/*
+ * Take the connection qmp_client_prepare() started, or connect now, and
+ * wait until it is in command mode.
+ */
 int qmp_client_init(char *sock_path)
 {
-    int r;
+    guest_client->qmp = qmp_conn_get(sock_path);
 
-    r = qmp_establish_conn(sock_path);
-    if (r == -1) {
+    if (!guest_client->qmp ||
+            qmp_conn_wait(guest_client->qmp, NULL, QMP_REPLY_TIMEOUT)) {
         pr_err("Unable to talk to qemu monitor");
-        goto err_exit;
-    }
-
-
-    r = qmp_negotiate();
-    if (r == -1) {
-        pr_err("Failed to negotiate qmp commands");
-        goto err_exit;
+        qmp_client_uninit();
+        return -1;
     }
 
     return 0;
+}
 
-err_exit:
-	return -1;
+/* start the handshake with a monitor that is attached to later */
+int qmp_client_prepare(char *sock_path)
+{
+    return qmp_conn_prepare(sock_path) ? 0 : -1;
 }
 
 int qmp_client_uninit()
 {
-    if (close(qmp_fd) == -1) {
-        return -1;
-    }
+    qmp_conn_free(guest_client->qmp);
+    guest_client->qmp = NULL;
 
     return 0;
 }
@@ -354,21 +294,12 @@ static int qmp_populate_reg(const char *buf, const char *reg_name, uint64_t *reg
 
 int qmp_get_registers(uint64_t *idtr, uint64_t *cr3, uint64_t *cr4)
 {
-	size_t nread, nwrite, cmd_len_regs;
+	size_t nread;
 	char *buf;
 
-	cmd_len_regs = strlen(QMP_COMMAND_INFO_REGS);
-
-	nwrite = xwrite(qmp_fd, QMP_COMMAND_INFO_REGS, cmd_len_regs);
-	if (nwrite != cmd_len_regs) {
-		return -1;
-	}
-
-	buf = xmalloc(8192);
-
-	if (qmp_read(qmp_fd, buf, &nread) == -1 || nread <= 0) {
+	if (qmp_call(QMP_COMMAND_INFO_REGS, &buf, &nread) == -1) {
 		pr_err("Failed to get read");
-		goto err_exit;
+		return -1;
 	}
 
 	if (qmp_populate_reg(buf, "CR3", cr3) == -1) {
@@ -436,93 +367,123 @@ int qmp_populate_mem(char *input, size_t len, uint8_t *buffer, size_t size)
     return 0;
 }
 
-static int qmp_readmem_part(uint64_t addr, uint8_t *buffer, size_t size)
-{
-	size_t nread, nwrite, cmd_len_regs;
-    char cmd[256] = {0};
-	char *buf;
-
-    if (size <= 0) {
-        pr_warning("Invalid input size: %ld", size);
-        return size;
-    }
-
-    snprintf(cmd, sizeof(cmd), QMP_COMMAND_XP, size, addr);
-	cmd_len_regs = strlen(cmd);
+/*
+ * A read through the monitor is split in QMP_XP_STEP bytes per xp
+ * command.  All of them are sent at once and the replies parsed as they
+ * come in, the round trips overlap instead of adding up.
+ */
+#define QMP_XP_STEP     (4096)
 
-	nwrite = xwrite(qmp_fd, cmd, cmd_len_regs);
-	if (nwrite != cmd_len_regs) {
-		return -1;
-	}
+struct qmp_xp_read {
+    int done;
+    int failed;
+    size_t pending;
+};
 
-    size_t buf_len = 1024 + size * 8;
-    buf= xmalloc(buf_len);
+struct qmp_xp_part {
+    struct qmp_xp_read *read;
+    uint8_t *buffer;
+    size_t size;
+};
 
-    if (qmp_read(qmp_fd, buf, &nread) == -1 || nread <= 0) {
-		pr_err("Failed to get read");
-		goto err_exit;
-	}
+static void qmp_xp_reply(int err, const char *reply, size_t len, void *arg)
+{
+    struct qmp_xp_part *part = arg;
+    struct qmp_xp_read *read = part->read;
 
-    qmp_populate_mem(buf, buf_len, buffer, size);
+    if (err || qmp_populate_mem((char *)reply, len, part->buffer, part->size))
+        read->failed = TRUE;
 
-    xfree(buf);
-	return 0;
-
-err_exit:
-    xfree(buf);
-	return -1;
+    if (--read->pending == 0)
+        read->done = TRUE;
 }
 
 int qmp_readmem(uint64_t addr, void *buffer, size_t size)
 {
-    int step = 4096;
-    uint8_t *buf = (uint8_t *)buffer;
-    size_t left = size % step;
-
-    for (size_t i = 0; i < size / step; i++) {
-        if (qmp_readmem_part(addr, buf, step) != 0) {
-            return -1;
+    struct qmp_xp_read read = { 0 };
+    struct qmp_xp_part *parts;
+    size_t nr = (size + QMP_XP_STEP - 1) / QMP_XP_STEP, i;
+    char cmd[256];
+
+    if (size == 0)
+        return 0;
+
+    parts = xcalloc(nr, sizeof(struct qmp_xp_part));
+    for (i = 0; i < nr; i++) {
+        parts[i].read = &read;
+        parts[i].buffer = (uint8_t *)buffer + i * QMP_XP_STEP;
+        parts[i].size = i < nr - 1 ? QMP_XP_STEP : size - i * QMP_XP_STEP;
+
+        snprintf(cmd, sizeof(cmd), QMP_COMMAND_XP, (uint64_t)parts[i].size,
+                (size_t)(addr + i * QMP_XP_STEP));
+        read.pending++;
+        if (qmp_conn_submit(guest_client->qmp, cmd, qmp_xp_reply, &parts[i])) {
+            read.pending--;
+            read.failed = TRUE;
+            break;
         }
-        addr += step;
-        buf += step;
     }
 
-    if (left > 0) {
-        if (qmp_readmem_part(addr, buf, left) != 0) {
-            return -1;
-        }
-    }
+    if (read.pending)
+        qmp_conn_wait(guest_client->qmp, &read.done, QMP_REPLY_TIMEOUT);
+    xfree(parts);
 
+    if (read.failed || !read.done) {
+        pr_err("Failed to read 0x%zx bytes at 0x%" PRIx64 " through the monitor",
+                size, addr);
+        return -1;
+    }
     return 0;
 }
 
 int qmp_gpa2hva(uint64_t gpa, uint64_t *hva)
 {
-    size_t nread, nwrite, cmd_len;
+    size_t nread;
     char *buf;
     char cmd[256] = {0};
 
     snprintf(cmd, sizeof(cmd), QMP_COMMAND_GPA2HVA, gpa);
 
-    cmd_len= strlen(cmd);
-
-    nwrite = xwrite(qmp_fd, cmd, cmd_len);
-    if (nwrite != cmd_len) {
-        return -1;
-    }
-
-    buf= xmalloc(256);
-
-    if (qmp_read(qmp_fd, buf, &nread) == -1 || nread <= 0) {
+    if (qmp_call(cmd, &buf, &nread) == -1) {
         pr_err("Failed to get read");
-        goto err_exit;
+        return -1;
     }
     hmp_gpa2hva(buf, hva);
 
     xfree(buf);
     return 0;
+}
+
+int qmp_stop(void)
+{
+    return qmp_call(QMP_COMMAND_STOP, NULL, NULL);
+}
+
+int qmp_cont(void)
+{
+    return qmp_call(QMP_COMMAND_CONT, NULL, NULL);
+}
+
+/* {"return": {"status": "paused", "singlestep": false, "running": false}} */
+int qmp_is_paused(void)
+{
+    char *buf, *running;
+    size_t len;
+    int ret = -1;
+
+    if (qmp_call(QMP_COMMAND_STATUS, &buf, &len) == -1)
+        return -1;
+
+    if ((running = strstr(buf, "\"running\""))) {
+        running += strlen("\"running\"");
+        while (*running == ' ' || *running == ':')
+            running++;
+        if (!strncmp(running, "false", 5))
+            ret = 1;
+        else if (!strncmp(running, "true", 4))
+            ret = 0;
+    }
 
-err_exit:
     xfree(buf);
-    return -1;
+    return ret;
 }
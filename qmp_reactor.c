@@ -0,0 +1,657 @@
+/* qmp_reactor.c
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "xutil.h"
+#include "log.h"
+#include "defs.h"
+#include "qmp_reactor.h"
+
+/*
+ * QMP transport.
+ *
+ * All monitor connections of the process share one epoll instance and
+ * are driven by whoever waits: qmp_conn_wait() for one reply runs the
+ * reactor, which also moves every other connection along.  A connection
+ * is a non-blocking socket and a state machine, from connect() through
+ * the greeting and qmp_capabilities to READY.  Commands submitted before
+ * that are queued; once READY they are written back to back without
+ * waiting for the replies, which QEMU sends in order.  Replies are framed
+ * by brace depth, so one is complete as soon as its last byte arrived,
+ * and matched to the oldest command sent; events are dropped.
+ *
+ * qmp_conn_prepare() starts a connection nobody owns yet, the next
+ * qmp_conn_get() of the same socket takes it over: attaching many guests
+ * one after the other then overlaps all of their handshakes.
+ */
+#define QMP_ENTER_COMMAND_MODE  "{ \"execute\": \"qmp_capabilities\" }"
+
+#define QMP_READ_SIZE           (16384)
+#define QMP_MAX_EVENTS          (64)
+
+struct qmp_cmd {
+    char *text;
+    qmp_reply_fn fn;
+    void *arg;
+    struct qmp_cmd *next;
+};
+
+struct qmp_conn {
+    int fd;
+    qmp_state_t state;
+    char *path;
+    int owned;                      /* FALSE until qmp_conn_get() */
+    uint32_t events;                /* as registered with epoll */
+
+    char *rbuf;                     /* an incomplete message */
+    size_t rlen;
+    size_t rsize;
+    size_t scan;                    /* framed up to here */
+    int depth;
+    int in_string;
+    int escape;
+
+    char *wbuf;
+    size_t wlen;
+    size_t wpos;
+    size_t wsize;
+
+    struct qmp_cmd *queue;          /* not written until READY */
+    struct qmp_cmd **queue_tail;
+    struct qmp_cmd *sent;           /* waiting for a reply, oldest first */
+    struct qmp_cmd **sent_tail;
+    unsigned long replies;
+
+    struct qmp_conn *next;
+};
+
+static struct {
+    int epfd;
+    pid_t pid;                      /* a forked worker needs its own */
+    struct qmp_conn *conns;
+} reactor = { .epfd = -1 };
+
+static int qmp_reactor_init(void)
+{
+    if (reactor.epfd >= 0 && reactor.pid == getpid())
+        return 0;
+
+    if (reactor.epfd >= 0)
+        close(reactor.epfd);
+    reactor.conns = NULL;
+    reactor.pid = getpid();
+
+    if ((reactor.epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        pr_err("epoll_create1: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void qmp_cmd_free(struct qmp_cmd *cmd)
+{
+    xfree(cmd->text);
+    xfree(cmd);
+}
+
+/* fail everything in the list, the callbacks may not touch it */
+static void qmp_cmd_fail_all(struct qmp_cmd *cmd)
+{
+    struct qmp_cmd *next;
+
+    for (; cmd; cmd = next) {
+        next = cmd->next;
+        if (cmd->fn)
+            cmd->fn(-1, NULL, 0, cmd->arg);
+        qmp_cmd_free(cmd);
+    }
+}
+
+static void qmp_conn_close(struct qmp_conn *c)
+{
+    struct qmp_cmd *sent = c->sent, *queue = c->queue;
+
+    if (c->state == QMP_CLOSED)
+        return;
+
+    c->state = QMP_CLOSED;
+    if (c->fd >= 0) {
+        epoll_ctl(reactor.epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+        c->fd = -1;
+    }
+
+    c->sent = c->queue = NULL;
+    c->sent_tail = &c->sent;
+    c->queue_tail = &c->queue;
+    qmp_cmd_fail_all(sent);
+    qmp_cmd_fail_all(queue);
+}
+
+/* ask for EPOLLOUT only while there is something to write */
+static void qmp_conn_update(struct qmp_conn *c)
+{
+    struct epoll_event ev;
+    uint32_t want = EPOLLIN;
+
+    if (c->state == QMP_CONNECTING || c->wpos < c->wlen)
+        want |= EPOLLOUT;
+    if (want == c->events)
+        return;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = want;
+    ev.data.ptr = c;
+    if (epoll_ctl(reactor.epfd, EPOLL_CTL_MOD, c->fd, &ev) == 0)
+        c->events = want;
+}
+
+static void qmp_conn_write(struct qmp_conn *c)
+{
+    ssize_t n;
+
+    while (c->wpos < c->wlen) {
+        n = write(c->fd, c->wbuf + c->wpos, c->wlen - c->wpos);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            break;
+        if (n <= 0) {
+            pr_err("QMP %s: write: %s", c->path, strerror(errno));
+            qmp_conn_close(c);
+            return;
+        }
+        c->wpos += n;
+    }
+
+    if (c->wpos == c->wlen)
+        c->wpos = c->wlen = 0;
+    qmp_conn_update(c);
+}
+
+/* put cmd on the wire, its reply is the next one not yet claimed */
+static void qmp_conn_send(struct qmp_conn *c, struct qmp_cmd *cmd)
+{
+    size_t len = strlen(cmd->text);
+
+    if (c->wlen + len > c->wsize) {
+        while (c->wlen + len > c->wsize)
+            c->wsize = c->wsize ? c->wsize * 2 : 4096;
+        c->wbuf = xrealloc(c->wbuf, c->wsize);
+    }
+    memcpy(c->wbuf + c->wlen, cmd->text, len);
+    c->wlen += len;
+
+    cmd->next = NULL;
+    *c->sent_tail = cmd;
+    c->sent_tail = &cmd->next;
+}
+
+static void qmp_conn_flush_queue(struct qmp_conn *c)
+{
+    struct qmp_cmd *cmd;
+
+    while ((cmd = c->queue)) {
+        c->queue = cmd->next;
+        qmp_conn_send(c, cmd);
+    }
+    c->queue_tail = &c->queue;
+}
+
+/* does the object in msg have key at its top level */
+static int qmp_has_key(const char *msg, size_t len, const char *key)
+{
+    size_t klen = strlen(key), i;
+    int depth = 0, in_string = FALSE, escape = FALSE;
+
+    for (i = 0; i < len; i++) {
+        if (in_string) {
+            if (escape)
+                escape = FALSE;
+            else if (msg[i] == '\\')
+                escape = TRUE;
+            else if (msg[i] == '"')
+                in_string = FALSE;
+            continue;
+        }
+
+        switch (msg[i]) {
+        case '"':
+            if (depth == 1 && !strncmp(msg + i + 1, key, klen) &&
+                    msg[i + 1 + klen] == '"') {
+                const char *p = msg + i + 2 + klen;
+
+                while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+                    p++;
+                if (*p == ':')
+                    return TRUE;
+            }
+            in_string = TRUE;
+            break;
+        case '{':
+        case '[':
+            depth++;
+            break;
+        case '}':
+        case ']':
+            depth--;
+            break;
+        }
+    }
+    return FALSE;
+}
+
+static void qmp_negotiated(int err, const char *reply, size_t len, void *arg)
+{
+    struct qmp_conn *c = arg;
+
+    (void)reply;
+    (void)len;
+    if (err) {
+        if (c->state != QMP_CLOSED) {
+            pr_err("QMP %s: failed to enter command mode", c->path);
+            qmp_conn_close(c);
+        }
+        return;
+    }
+
+    c->state = QMP_READY;
+    qmp_conn_flush_queue(c);
+    qmp_conn_write(c);
+}
+
+static void qmp_conn_dispatch(struct qmp_conn *c, const char *msg, size_t len)
+{
+    struct qmp_cmd *cmd;
+    int err;
+
+    if (c->state == QMP_GREETING) {
+        if (!qmp_has_key(msg, len, "QMP")) {
+            pr_err("QMP %s: no greeting message", c->path);
+            qmp_conn_close(c);
+            return;
+        }
+
+        cmd = xcalloc(1, sizeof(struct qmp_cmd));
+        cmd->text = xstrdup(QMP_ENTER_COMMAND_MODE);
+        cmd->fn = qmp_negotiated;
+        cmd->arg = c;
+        c->state = QMP_NEGOTIATING;
+        qmp_conn_send(c, cmd);
+        qmp_conn_write(c);
+        return;
+    }
+
+    if (qmp_has_key(msg, len, "return"))
+        err = 0;
+    else if (qmp_has_key(msg, len, "error"))
+        err = -1;
+    else
+        return;                     /* an event */
+
+    if (!(cmd = c->sent)) {
+        pr_debug("QMP %s: unexpected reply %s", c->path, msg);
+        return;
+    }
+    if (!(c->sent = cmd->next))
+        c->sent_tail = &c->sent;
+    c->replies++;
+
+    if (err)
+        pr_err("QMP %s: '%s' failed: %s", c->path, cmd->text, msg);
+    if (cmd->fn)
+        cmd->fn(err, msg, len, cmd->arg);
+    qmp_cmd_free(cmd);
+}
+
+/*
+ * Hand every complete message in rbuf to qmp_conn_dispatch() and keep
+ * the start of an incomplete one.  Strings are tracked so that braces
+ * in the output of a human monitor command do not count.
+ */
+static void qmp_conn_parse(struct qmp_conn *c)
+{
+    size_t start = 0, keep, i;
+    char saved;
+
+    for (i = c->scan; i < c->rlen && c->state != QMP_CLOSED; i++) {
+        char ch = c->rbuf[i];
+
+        if (c->in_string) {
+            if (c->escape)
+                c->escape = FALSE;
+            else if (ch == '\\')
+                c->escape = TRUE;
+            else if (ch == '"')
+                c->in_string = FALSE;
+            continue;
+        }
+
+        switch (ch) {
+        case '"':
+            if (c->depth)
+                c->in_string = TRUE;
+            break;
+        case '{':
+        case '[':
+            if (c->depth++ == 0)
+                start = i;
+            break;
+        case '}':
+        case ']':
+            if (c->depth == 0 || --c->depth)
+                break;
+
+            /* rsize is kept past rlen for this */
+            saved = c->rbuf[i + 1];
+            c->rbuf[i + 1] = NULLCHAR;
+            qmp_conn_dispatch(c, c->rbuf + start, i + 1 - start);
+            c->rbuf[i + 1] = saved;
+            break;
+        }
+    }
+
+    if (c->state == QMP_CLOSED) {
+        c->rlen = c->scan = 0;
+        return;
+    }
+
+    keep = c->depth ? start : c->rlen;
+    memmove(c->rbuf, c->rbuf + keep, c->rlen - keep);
+    c->rlen -= keep;
+    c->scan = c->rlen;
+}
+
+static void qmp_conn_read(struct qmp_conn *c)
+{
+    ssize_t n;
+
+    for (;;) {
+        if (c->rsize - c->rlen < QMP_READ_SIZE + 1) {
+            c->rsize = c->rsize ? c->rsize * 2 : QMP_READ_SIZE * 2;
+            c->rbuf = xrealloc(c->rbuf, c->rsize);
+        }
+
+        n = read(c->fd, c->rbuf + c->rlen, QMP_READ_SIZE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            break;
+        if (n <= 0) {
+            if (n < 0)
+                pr_err("QMP %s: read: %s", c->path, strerror(errno));
+            else if (c->sent || c->state != QMP_READY)
+                pr_err("QMP %s: connection closed", c->path);
+            qmp_conn_parse(c);
+            qmp_conn_close(c);
+            return;
+        }
+        c->rlen += n;
+
+        qmp_conn_parse(c);
+        if (c->state == QMP_CLOSED)
+            return;
+    }
+}
+
+static void qmp_conn_event(struct qmp_conn *c, uint32_t events)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    /* closed by an earlier event of the same round */
+    if (c->state == QMP_CLOSED)
+        return;
+
+    if (c->state == QMP_CONNECTING) {
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+            err = errno;
+        if (err) {
+            pr_err("Failed to connect to '%s' ('%s')", c->path, strerror(err));
+            qmp_conn_close(c);
+            return;
+        }
+        c->state = QMP_GREETING;
+        qmp_conn_update(c);
+    }
+
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+        qmp_conn_read(c);
+    if (c->state != QMP_CLOSED && (events & EPOLLOUT))
+        qmp_conn_write(c);
+}
+
+/*
+ * Connect to the monitor at sock_path.  The greeting and negotiation
+ * happen as the reactor runs; NULL only if the socket cannot be made.
+ */
+struct qmp_conn *qmp_conn_new(const char *sock_path)
+{
+    struct sockaddr_un saddr;
+    struct epoll_event ev;
+    struct qmp_conn *c;
+    size_t path_len = strlen(sock_path);
+    int s;
+
+    if (path_len == 0 || path_len >= sizeof(saddr.sun_path)) {
+        pr_err("Invalid QMP socket path '%s'", sock_path);
+        return NULL;
+    }
+
+    if (qmp_reactor_init())
+        return NULL;
+
+    if ((s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        return NULL;
+    xsetnonblock(s);
+
+    c = xcalloc(1, sizeof(struct qmp_conn));
+    c->fd = s;
+    c->path = xstrdup(sock_path);
+    c->owned = TRUE;
+    c->queue_tail = &c->queue;
+    c->sent_tail = &c->sent;
+    c->next = reactor.conns;
+    reactor.conns = c;
+
+    memset(&saddr, 0, sizeof(struct sockaddr_un));
+    saddr.sun_family = AF_UNIX;
+    memcpy(saddr.sun_path, sock_path, path_len);
+
+    if (connect(s, (struct sockaddr *)&saddr, sizeof(struct sockaddr_un)) == 0) {
+        c->state = QMP_GREETING;
+    } else if (errno == EINPROGRESS || errno == EAGAIN) {
+        c->state = QMP_CONNECTING;
+    } else {
+        pr_err("Failed to connect to '%s' ('%s')", sock_path, strerror(errno));
+        qmp_conn_close(c);
+        return c;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | (c->state == QMP_CONNECTING ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    if (epoll_ctl(reactor.epfd, EPOLL_CTL_ADD, s, &ev) == -1) {
+        pr_err("epoll_ctl: %s", strerror(errno));
+        qmp_conn_close(c);
+        return c;
+    }
+    c->events = ev.events;
+
+    return c;
+}
+
+/* start connecting to sock_path for a qmp_conn_get() to come */
+struct qmp_conn *qmp_conn_prepare(const char *sock_path)
+{
+    struct qmp_conn *c;
+
+    if (qmp_reactor_init())
+        return NULL;
+
+    for (c = reactor.conns; c; c = c->next) {
+        if (!c->owned && STREQ(c->path, sock_path))
+            return c;
+    }
+
+    if ((c = qmp_conn_new(sock_path)))
+        c->owned = FALSE;
+    return c;
+}
+
+/*
+ * The prepared connection to sock_path, or a new one.  A prepared one
+ * that failed is returned as it is, its error was reported.
+ */
+struct qmp_conn *qmp_conn_get(const char *sock_path)
+{
+    struct qmp_conn *c;
+
+    if (qmp_reactor_init())
+        return NULL;
+
+    for (c = reactor.conns; c; c = c->next) {
+        if (!c->owned && STREQ(c->path, sock_path)) {
+            c->owned = TRUE;
+            return c;
+        }
+    }
+
+    return qmp_conn_new(sock_path);
+}
+
+void qmp_conn_free(struct qmp_conn *c)
+{
+    struct qmp_conn **p;
+
+    if (!c)
+        return;
+
+    qmp_conn_close(c);
+    for (p = &reactor.conns; *p; p = &(*p)->next) {
+        if (*p == c) {
+            *p = c->next;
+            break;
+        }
+    }
+
+    xfree(c->path);
+    xfree(c->rbuf);
+    xfree(c->wbuf);
+    xfree(c);
+}
+
+qmp_state_t qmp_conn_state(const struct qmp_conn *c)
+{
+    return c->state;
+}
+
+/*
+ * Send cmd, or queue it until the connection is READY.  fn is called
+ * with the reply from within the reactor.
+ */
+int qmp_conn_submit(struct qmp_conn *c, const char *cmd,
+        qmp_reply_fn fn, void *arg)
+{
+    struct qmp_cmd *q;
+
+    if (c->state == QMP_CLOSED)
+        return -1;
+
+    q = xcalloc(1, sizeof(struct qmp_cmd));
+    q->text = xstrdup(cmd);
+    q->fn = fn;
+    q->arg = arg;
+
+    if (c->state != QMP_READY) {
+        *c->queue_tail = q;
+        c->queue_tail = &q->next;
+        return 0;
+    }
+
+    qmp_conn_send(c, q);
+    qmp_conn_write(c);
+    return 0;
+}
+
+/* wait for one round of events on all connections, at most timeout_ms */
+int qmp_reactor_run(int timeout_ms)
+{
+    struct epoll_event events[QMP_MAX_EVENTS];
+    int n, i;
+
+    if (qmp_reactor_init())
+        return -1;
+
+    n = epoll_wait(reactor.epfd, events, QMP_MAX_EVENTS, timeout_ms);
+    if (n == -1)
+        return errno == EINTR ? 0 : -1;
+
+    for (i = 0; i < n; i++)
+        qmp_conn_event(events[i].data.ptr, events[i].events);
+
+    return n;
+}
+
+static long qmp_elapsed_ms(const struct timespec *since)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 +
+        (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+/*
+ * Run the reactor until *done is set, or until c is READY if done is
+ * NULL.  A connection that goes timeout_ms without a reply is out of
+ * step with its monitor and is closed.
+ */
+int qmp_conn_wait(struct qmp_conn *c, const int *done, int timeout_ms)
+{
+    struct timespec start;
+    unsigned long replies = c->replies;
+    long left;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (c->state != QMP_CLOSED && !(done ? *done : c->state == QMP_READY)) {
+        /* a long pipeline is fine as long as it moves */
+        if (c->replies != replies) {
+            replies = c->replies;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+        }
+        if ((left = timeout_ms - qmp_elapsed_ms(&start)) <= 0) {
+            pr_err("QMP %s: no reply in %d ms", c->path, timeout_ms);
+            qmp_conn_close(c);
+            break;
+        }
+        if (qmp_reactor_run(left) == -1) {
+            pr_err("epoll_wait: %s", strerror(errno));
+            qmp_conn_close(c);
+            break;
+        }
+    }
+
+    return (done ? *done : c->state == QMP_READY) ? 0 : -1;
+}
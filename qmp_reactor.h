@@ -0,0 +1,49 @@
+/* qmp_reactor.h
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __QMP_REACTOR_H__
+#define __QMP_REACTOR_H__
+
+#include <stddef.h>
+
+struct qmp_conn;
+
+typedef enum {
+    QMP_CONNECTING,
+    QMP_GREETING,                   /* waiting for {"QMP": ...} */
+    QMP_NEGOTIATING,                /* qmp_capabilities sent */
+    QMP_READY,
+    QMP_CLOSED,
+} qmp_state_t;
+
+/*
+ * Called with the reply to a command: err is 0 for a "return", -1 for an
+ * "error" or when the connection went away (reply is NULL then).  reply
+ * is the whole JSON object, NUL terminated, valid during the call only.
+ * The callback may submit commands but must not free the connection.
+ */
+typedef void (*qmp_reply_fn)(int err, const char *reply, size_t len, void *arg);
+
+struct qmp_conn *qmp_conn_new(const char *sock_path);
+struct qmp_conn *qmp_conn_prepare(const char *sock_path);
+struct qmp_conn *qmp_conn_get(const char *sock_path);
+void qmp_conn_free(struct qmp_conn *c);
+qmp_state_t qmp_conn_state(const struct qmp_conn *c);
+int qmp_conn_submit(struct qmp_conn *c, const char *cmd,
+        qmp_reply_fn fn, void *arg);
+int qmp_conn_wait(struct qmp_conn *c, const int *done, int timeout_ms);
+int qmp_reactor_run(int timeout_ms);
+
+#endif
@@ -0,0 +1,219 @@
+/* session.c
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "xutil.h"
+#include "log.h"
+#include "defs.h"
+#include "client.h"
+#include "printk.h"
+#include "session.h"
+
+/*
+ * Sessions.
+ *
+ * The code reading a guest uses kt, machdep, vt, st, ot, szt,
+ * guest_client, pc, the filters and fp as it always did; they belong to
+ * the current session.  A program attached to several guests keeps a
+ * session for each and makes one current with session_switch() before
+ * it calls in.  Only one session is current at a time: calls for
+ * different guests are made one after the other, not concurrently.
+ */
+struct session *session_new(void)
+{
+    struct session *s = xcalloc(1, sizeof(struct session));
+
+    s->machdep_table.machspec = &s->machine_specific;
+
+    /* the options, not the state of a --grep in progress */
+    s->program_context = *pc;
+    s->record_filter = *record_filter;
+    memcpy(&s->text_filter, text_filter,
+            offsetof(struct text_filter, context_ring));
+    s->fp = fp;
+    return s;
+}
+
+void session_switch(struct session *s)
+{
+    if (s == session)
+        return;
+
+    session->client = guest_client;
+    session->fp = fp;
+
+    session = s;
+    kt = &s->kernel_table;
+    machdep = &s->machdep_table;
+    vt = &s->vm_table;
+    st = &s->symbol_table_data;
+    ot = &s->offset_table;
+    szt = &s->size_table;
+    guest_client = s->client;
+    pc = &s->program_context;
+    record_filter = &s->record_filter;
+    text_filter = &s->text_filter;
+    fp = s->fp;
+}
+
+/*
+ * Close s and free it.  The current session stays current if it is
+ * another one, otherwise session_default becomes current.
+ */
+void session_free(struct session *s)
+{
+    struct session *prev = session;
+
+    if (!s)
+        return;
+
+    session_switch(s);
+    session_close();
+    output_buffer_free(&s->output);
+    session_switch(prev != s ? prev : &session_default);
+    xfree(s);
+}
+
+static int session_access_type(const char *guest, guest_access_t *ac_type)
+{
+    struct stat path_stat;
+
+    if (stat(guest, &path_stat)) {
+        *ac_type = GUEST_NAME;
+        return 0;
+    }
+
+    if (S_ISREG(path_stat.st_mode)) {
+        *ac_type = GUEST_MEMORY;
+    } else if (S_ISSOCK(path_stat.st_mode)) {
+        *ac_type = QMP_SOCKET;
+    } else {
+        pr_err("Unknown file type: %s", guest);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Attach the current session to guest (libvirt domain, QMP socket or
+ * memory image) and resolve everything needed to read its log.
+ * Returns 1 if --probe found nothing new, the session is attached but
+ * System.map was not parsed.
+ */
+int session_open(const char *guest, const char *map_file)
+{
+    guest_access_t ac_type;
+
+    if (session_access_type(guest, &ac_type))
+        return -1;
+
+    if (KDEBUG(1)) {
+        pr_debug("Guest     : %s", guest);
+        pr_debug("System.map: %s", map_file);
+    }
+
+    session->guest = xstrdup(guest);
+    session->map_file = xstrdup(map_file);
+
+    if (guest_client_new(session->guest, ac_type))
+        return -1;
+    x86_64_init();
+
+    /* before System.map is even parsed */
+    if (pc->probe) {
+        if (!pc->cache_dir || pc->follow || pc->save) {
+            pr_warning("--probe needs --cache and no --follow or --save, ignored");
+            pc->probe = FALSE;
+        } else if (!session_cache_probe(session->guest, session->map_file)) {
+            return 1;
+        }
+    }
+
+    symtab_init(map_file);
+
+    if (session_cache_load(session->guest, session->map_file)) {
+        derive_kaslr_offset();
+        symbol_data_prefetch();
+        x86_64_post_reloc();
+
+        vmcoreinfo_init();
+        kernel_init();
+        printk_init();
+
+        session_cache_store(session->guest, session->map_file);
+    }
+
+    return 0;
+}
+
+/* everything comes from the snapshot, System.map only annotates */
+int session_load(const char *path, const char *map_file)
+{
+    session->map_file = map_file ? xstrdup(map_file) : NULL;
+
+    if (guest_client_new((char *)path, GUEST_SNAPSHOT))
+        return -1;
+    x86_64_init();
+
+    return snapshot_restore();
+}
+
+/* print the log of the current session as the options say, 0 on success */
+int session_dump(void)
+{
+    if (pc->annotate) {
+        if (session->map_file)
+            symtab_text_init(session->map_file);
+        else
+            pr_warning("--annotate needs System.map, ignored");
+        pc->annotate = session->map_file != NULL;
+    }
+
+    if (pc->follow)
+        follow_init();
+
+    if (pc->cursor)
+        cursor_load();
+
+    if (kernel_symbol_exists("prb"))
+        return dump_lockless_record_log();
+    if (kernel_symbol_exists("log_first_idx") &&
+            kernel_symbol_exists("log_next_idx"))
+        return dump_variable_length_record_log();
+    return dump_plain_log();
+}
+
+/* detach the current session from its guest and drop what was resolved */
+void session_close(void)
+{
+    struct session *s = session;
+
+    symbol_data_flush();
+    guest_client_release();
+    symtab_free();
+    x86_64_free();
+    vmcoreinfo_free();
+
+    xfree(s->guest);
+    xfree(s->map_file);
+    xfree(s->cursor);
+
+    /* the options stay for the next session_open() */
+    memset(s, 0, offsetof(struct session, program_context));
+    s->machdep_table.machspec = &s->machine_specific;
+}
@@ -0,0 +1,77 @@
+/* session.h
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#ifndef __SESSION_H__
+#define __SESSION_H__
+
+#include "defs.h"
+#include "client.h"
+#include "filter.h"
+#include "output.h"
+
+struct cursor_state;
+struct vmcoreinfo_table;
+
+/*
+ * Everything kvm-dmesg knows about one guest: the connection, the
+ * address translation, the symbols and the structure layout, and what
+ * is printed of it where.  kt, machdep, vt, st, ot, szt, guest_client,
+ * pc, record_filter, text_filter and fp belong to the current session;
+ * session_switch() makes another one current.
+ */
+struct session {
+    char *guest;
+    char *map_file;
+
+    struct kernel_table kernel_table;
+    struct machdep_table machdep_table;
+    struct machine_specific machine_specific;
+    struct vm_table vm_table;
+    struct symbol_table_data symbol_table_data;
+    struct offset_table offset_table;
+    struct size_table size_table;
+
+    guest_client_t *client;
+    struct cursor_state *cursor;    /* cursor.c */
+    struct vmcoreinfo_table *vmcoreinfo;    /* vmcoreinfo.c */
+
+    /* the --probe marker of the last decode, cache.c */
+    ulong probe_kaddr;
+    uint32_t probe_size;
+    uint64_t probe_value;
+
+    /*
+     * The options, kept by session_close().  A new session starts with
+     * those of the current one.
+     */
+    struct program_context program_context;
+    struct record_filter record_filter;
+    struct text_filter text_filter;
+    FILE *fp;
+    struct output output;           /* output.c, when no thread has its own */
+};
+
+extern struct session *session, session_default;
+
+struct session *session_new(void);
+void session_switch(struct session *s);
+void session_free(struct session *s);
+
+int session_open(const char *guest, const char *map_file);
+int session_load(const char *path, const char *map_file);
+int session_dump(void);
+void session_close(void);
+
+#endif
@@ -0,0 +1,396 @@
+/* snapshot.c
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "xutil.h"
+#include "log.h"
+#include "defs.h"
+#include "client.h"
+#include "printk.h"
+
+/*
+ * Raw log snapshots.
+ *
+ * --save FILE copies everything the decoders read from the guest into
+ * one file: the System.map symbols in use and the guest words they
+ * name, the KASLR offset, phys_base, page_offset_base, the SIZE/OFFSET
+ * tables and the log itself, i.e. the printk_ringbuffer with its desc,
+ * info and text rings, or log_buf.  --load FILE maps such a file and
+ * serves the decoders' reads from it, so it is decoded as often as
+ * needed without the guest or System.map.
+ *
+ * Layout: struct snapshot_header, nr_symbols struct snapshot_symbol,
+ * nr_regions struct snapshot_region sorted by guest physical address,
+ * then the contents of each region at its offset.
+ */
+#define SNAPSHOT_MAGIC        (0x534d444b)    /* "KDMS" */
+#define SNAPSHOT_VERSION      (1)
+#define SNAPSHOT_MAX_SYMBOLS  (64)
+#define SNAPSHOT_MAX_REGIONS  (SNAPSHOT_MAX_SYMBOLS + 8)
+#define SNAPSHOT_COPY_SIZE    (1 << 20)
+
+struct snapshot_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t tables_size;
+    uint32_t nr_symbols;
+    uint32_t nr_regions;
+    uint32_t pad;
+
+    ulong kt_flags;
+    ulong relocate;
+    ulong phys_base;
+    ulong page_offset;
+    ulong prb;
+    ulong log_buf;
+    char release[65];
+
+    struct offset_table offset_table;
+    struct size_table size_table;
+};
+
+struct snapshot_symbol {
+    char name[32];
+    uint64_t value;
+};
+
+struct snapshot_region {
+    uint64_t paddr;
+    uint64_t len;
+    uint64_t offset;                /* of the contents in the file */
+};
+
+struct snapshot_build {
+    int nr_symbols;
+    int nr_regions;
+    struct snapshot_symbol symbols[SNAPSHOT_MAX_SYMBOLS];
+    struct snapshot_region regions[SNAPSHOT_MAX_REGIONS];
+};
+
+static void snapshot_add_region(struct snapshot_build *b, uint64_t paddr,
+        uint64_t len)
+{
+    if (!len || b->nr_regions == SNAPSHOT_MAX_REGIONS)
+        return;
+
+    b->regions[b->nr_regions].paddr = paddr;
+    b->regions[b->nr_regions].len = len;
+    b->nr_regions++;
+}
+
+static void snapshot_add_kaddr(unsigned long kaddr, unsigned long len, void *arg)
+{
+    snapshot_add_region(arg, kvaddr_to_paddr(kaddr), len);
+}
+
+static void snapshot_add_symbol(const char *name, ulong value, void *arg)
+{
+    struct snapshot_build *b = arg;
+    struct snapshot_symbol *s;
+
+    if (b->nr_symbols == SNAPSHOT_MAX_SYMBOLS ||
+            strlen(name) >= sizeof(s->name))
+        return;
+
+    s = &b->symbols[b->nr_symbols++];
+    memset(s, 0, sizeof(*s));
+    strcpy(s->name, name);
+    s->value = value;
+
+    /* the guest word get_symbol_data() reads */
+    if (kt->flags & RELOC_SET)
+        value -= kt->relocate;
+    snapshot_add_kaddr(value, sizeof(ulong), b);
+}
+
+static int snapshot_region_cmp(const void *a, const void *b)
+{
+    uint64_t va = ((const struct snapshot_region *)a)->paddr;
+    uint64_t vb = ((const struct snapshot_region *)b)->paddr;
+
+    return (va > vb) - (va < vb);
+}
+
+/* sort the regions and merge the ones that overlap or touch */
+static void snapshot_merge_regions(struct snapshot_build *b)
+{
+    struct snapshot_region *r = b->regions, *last = NULL;
+    int i, n = 0;
+
+    qsort(r, b->nr_regions, sizeof(*r), snapshot_region_cmp);
+
+    for (i = 0; i < b->nr_regions; i++) {
+        if (last && r[i].paddr <= last->paddr + last->len) {
+            if (r[i].paddr + r[i].len > last->paddr + last->len)
+                last->len = r[i].paddr + r[i].len - last->paddr;
+            continue;
+        }
+        r[n] = r[i];
+        last = &r[n++];
+    }
+
+    b->nr_regions = n;
+}
+
+static int snapshot_copy_region(int fd, struct snapshot_region *r, char *buf)
+{
+    uint64_t done, part;
+
+    for (done = 0; done < r->len; done += part) {
+        part = r->len - done;
+        if (part > SNAPSHOT_COPY_SIZE)
+            part = SNAPSHOT_COPY_SIZE;
+
+        if (readmem(r->paddr + done, PHYSADDR, buf, part)) {
+            pr_err("Cannot read guest memory at %llx", (ulonglong)(r->paddr + done));
+            return -1;
+        }
+        if (xwrite(fd, buf, part) != part)
+            return -1;
+    }
+
+    return 0;
+}
+
+int snapshot_save(const char *path)
+{
+    struct snapshot_header h;
+    struct snapshot_build *b;
+    char tmp[PATH_MAX];
+    uint64_t offset;
+    char *buf = NULL;
+    int fd, i, ret = -1;
+
+    b = xcalloc(1, sizeof(*b));
+    symtab_for_each(snapshot_add_symbol, b);
+    if (printk_regions(snapshot_add_kaddr, b))
+        goto out;
+    snapshot_merge_regions(b);
+
+    memset(&h, 0, sizeof(h));
+    h.magic = SNAPSHOT_MAGIC;
+    h.version = SNAPSHOT_VERSION;
+    h.tables_size = sizeof(h.offset_table) + sizeof(h.size_table);
+    h.nr_symbols = b->nr_symbols;
+    h.nr_regions = b->nr_regions;
+    h.kt_flags = kt->flags;
+    h.relocate = kt->relocate;
+    h.phys_base = machdep->machspec->phys_base;
+    h.page_offset = machdep->machspec->page_offset;
+    h.prb = kt->prb;
+    h.log_buf = kt->log_buf;
+    memcpy(h.release, kt->release, sizeof(h.release));
+    h.offset_table = *ot;
+    h.size_table = *szt;
+
+    offset = sizeof(h) + b->nr_symbols * sizeof(struct snapshot_symbol) +
+        b->nr_regions * sizeof(struct snapshot_region);
+    for (i = 0; i < b->nr_regions; i++) {
+        b->regions[i].offset = offset;
+        offset += b->regions[i].len;
+    }
+
+    if ((size_t)snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid()) >= sizeof(tmp)) {
+        pr_err("Snapshot path too long: %s", path);
+        goto out;
+    }
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+        pr_err("Cannot create snapshot %s", tmp);
+        goto out;
+    }
+
+    if (xwrite(fd, (const char *)&h, sizeof(h)) != sizeof(h) ||
+            xwrite(fd, (const char *)b->symbols, b->nr_symbols *
+                sizeof(struct snapshot_symbol)) != b->nr_symbols * sizeof(struct snapshot_symbol) ||
+            xwrite(fd, (const char *)b->regions, b->nr_regions *
+                sizeof(struct snapshot_region)) != b->nr_regions * sizeof(struct snapshot_region))
+        goto fail;
+
+    /* only the copy of the guest's memory is done with the guest paused */
+    buf = xmalloc(SNAPSHOT_COPY_SIZE);
+    if (pc->atomic && guest_pause())
+        goto fail;
+    for (i = 0; i < b->nr_regions; i++) {
+        if (snapshot_copy_region(fd, &b->regions[i], buf))
+            break;
+    }
+    guest_resume();
+    if (i < b->nr_regions)
+        goto fail;
+
+    if (fsync(fd))
+        goto fail;
+    close(fd);
+
+    if (rename(tmp, path)) {
+        pr_err("Cannot install snapshot %s", path);
+        unlink(tmp);
+        goto out;
+    }
+
+    if (KDEBUG(1))
+        pr_debug("snapshot: %d symbols, %d regions, %llu bytes", b->nr_symbols,
+                b->nr_regions, (ulonglong)offset);
+    ret = 0;
+    goto out;
+
+fail:
+    pr_err("Cannot write snapshot %s", tmp);
+    close(fd);
+    unlink(tmp);
+out:
+    xfree(buf);
+    xfree(b);
+    return ret;
+}
+
+/* the mapping is kept by the guest client, the rest is found from it */
+#define snapshot            ((struct snapshot_header *)guest_client->snapshot_map)
+#define snapshot_symbols    ((struct snapshot_symbol *)(snapshot + 1))
+#define snapshot_regions    \
+    ((struct snapshot_region *)(snapshot_symbols + snapshot->nr_symbols))
+
+int snapshot_client_init(char *path)
+{
+    struct snapshot_header *h;
+    struct snapshot_region *r;
+    struct stat sb;
+    size_t tables, snapshot_size;
+    char *snapshot_map;
+    uint32_t i;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) == -1) {
+        pr_err("Cannot open snapshot %s", path);
+        return -1;
+    }
+    if (fstat(fd, &sb) || (size_t)sb.st_size < sizeof(*h)) {
+        pr_err("Invalid snapshot %s", path);
+        close(fd);
+        return -1;
+    }
+
+    snapshot_size = sb.st_size;
+    snapshot_map = mmap(NULL, snapshot_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (snapshot_map == MAP_FAILED) {
+        pr_err("Cannot map snapshot %s", path);
+        return -1;
+    }
+    guest_client->snapshot_map = snapshot_map;
+    guest_client->snapshot_size = snapshot_size;
+
+    h = (struct snapshot_header *)snapshot_map;
+    if (h->magic != SNAPSHOT_MAGIC || h->version != SNAPSHOT_VERSION ||
+            h->tables_size != sizeof(h->offset_table) + sizeof(h->size_table) ||
+            h->nr_symbols > SNAPSHOT_MAX_SYMBOLS ||
+            h->nr_regions > SNAPSHOT_MAX_REGIONS)
+        goto invalid;
+
+    tables = sizeof(*h) + h->nr_symbols * sizeof(struct snapshot_symbol) +
+        h->nr_regions * sizeof(struct snapshot_region);
+    if (tables > snapshot_size)
+        goto invalid;
+
+    for (i = 0; i < h->nr_regions; i++) {
+        r = &snapshot_regions[i];
+        if (r->offset < tables || r->offset > snapshot_size ||
+                r->len > snapshot_size - r->offset ||
+                (i && r->paddr < snapshot_regions[i - 1].paddr))
+            goto invalid;
+    }
+
+    return 0;
+
+invalid:
+    pr_err("Invalid snapshot %s", path);
+    snapshot_client_uninit();
+    return -1;
+}
+
+int snapshot_client_uninit()
+{
+    if (guest_client->snapshot_map)
+        munmap(guest_client->snapshot_map, guest_client->snapshot_size);
+    guest_client->snapshot_map = NULL;
+    return 0;
+}
+
+int snapshot_readmem(uint64_t addr, void *buffer, size_t size)
+{
+    int lo = 0, hi = snapshot->nr_regions, mid;
+    struct snapshot_region *r;
+
+    /* the last region that starts at or below addr */
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (snapshot_regions[mid].paddr <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo) {
+        r = &snapshot_regions[lo - 1];
+        if (addr - r->paddr <= r->len && size <= r->len - (addr - r->paddr)) {
+            memcpy(buffer, guest_client->snapshot_map + r->offset + (addr - r->paddr), size);
+            return 0;
+        }
+    }
+
+    if (KDEBUG(1))
+        pr_debug("snapshot: %llx+%zu was not saved", (ulonglong)addr, size);
+    return -1;
+}
+
+/*
+ * What a full init computes, from the snapshot.  Like a session cache
+ * hit, plus the symbols, which make System.map unnecessary.
+ */
+int snapshot_restore(void)
+{
+    struct snapshot_header *h = snapshot;
+    char release[sizeof(h->release)];
+    char name[sizeof(snapshot_symbols->name)];
+    uint32_t i;
+
+    kt->flags = h->kt_flags;
+    kt->relocate = h->relocate;
+    kt->prb = h->prb;
+    kt->log_buf = h->log_buf;
+    machdep->machspec->phys_base = h->phys_base;
+    machdep->machspec->page_offset = h->page_offset;
+    *ot = h->offset_table;
+    *szt = h->size_table;
+
+    for (i = 0; i < h->nr_symbols; i++) {
+        memcpy(name, snapshot_symbols[i].name, sizeof(name));
+        name[sizeof(name) - 1] = NULLCHAR;
+        symtab_install(name, snapshot_symbols[i].value);
+    }
+
+    memcpy(kt->release, h->release, sizeof(kt->release));
+    kt->release[sizeof(kt->release) - 1] = NULLCHAR;
+    memcpy(release, kt->release, sizeof(release));
+    parse_kernel_version(release);
+
+    return 0;
+}
@@ -13,11 +13,15 @@
  * GNU General Public License for more details.
  */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
+#include <ctype.h>
 
 #include "defs.h"
 #include "log.h"
 #include "client.h"
+#include "xutil.h"
+#include "output.h"
 
 #define MAX_LINE_LENGTH 256
 
@@ -25,7 +29,9 @@ int symbol_needed(const char *symbol)
 {
     static char *symtab_array[] = {
         "log_first_idx",
+        "log_first_seq",
         "log_next_idx",
+        "log_next_seq",
         "log_buf",
         "log_end",
         "log_buf_len",
@@ -112,6 +118,7 @@ static void symname_hash_init(const char *map_file)
 
         }
     }
+    fclose(file);
 }
 
 int kernel_symbol_exists(char *symbol)
@@ -141,23 +148,205 @@ ulong symbol_value(char *symbol)
     return (sp->value);
 }
 
-void get_symbol_data(char *symbol, long size, void *local)
+/*
+ * Globals read while attaching and by the log decoders.  Each of them
+ * is at most a long, and together they live in a handful of pages of
+ * the kernel image.
+ */
+static char *startup_symbols[] = {
+    "page_offset_base",
+    "vmcoreinfo_size",
+    "vmcoreinfo_data",
+    "prb",
+    "log_first_idx",
+    "log_first_seq",
+    "log_next_idx",
+    "log_next_seq",
+    "log_buf_len",
+    "log_buf",
+    "log_end",
+};
+
+static int syment_value_cmp(const void *a, const void *b)
+{
+    ulong va = (*(struct syment **)a)->value;
+    ulong vb = (*(struct syment **)b)->value;
+
+    return (va > vb) - (va < vb);
+}
+
+/*
+ * Fetch the startup globals with as few reads as possible: sort them by
+ * address and read each run that fits in one page with a single
+ * readmem(), which on the monitor backends is a single round trip
+ * instead of one per variable.  get_symbol_data() then serves them from
+ * the fetched copy until symbol_data_flush().  names must be startup
+ * symbols, the others are not flushed.
+ */
+void symbol_data_prefetch_list(char **names, size_t nr_syms)
+{
+    struct syment *syms[sizeof(startup_symbols) / sizeof(startup_symbols[0])];
+    struct syment *sp;
+    ulong start, end, addr;
+    size_t i, j, n = 0;
+    int reads = 0;
+    char *buf;
+
+    for (i = 0; i < nr_syms && n < sizeof(syms) / sizeof(syms[0]); i++) {
+        if ((sp = symname_hash_search(names[i])))
+            syms[n++] = sp;
+    }
+    if (!n)
+        return;
+
+    qsort(syms, n, sizeof(syms[0]), syment_value_cmp);
+    buf = xmalloc(PAGESIZE());
+
+    for (i = 0; i < n; i = j) {
+        start = syms[i]->value;
+        end = start + sizeof(ulong);
+        for (j = i + 1; j < n; j++) {
+            if (syms[j]->value + sizeof(ulong) - start > PAGESIZE())
+                break;
+            if (syms[j]->value + sizeof(ulong) > end)
+                end = syms[j]->value + sizeof(ulong);
+        }
+
+        addr = start;
+        if (kt->flags & RELOC_SET)
+            addr = addr - kt->relocate;
+        reads++;
+        if (readmem(addr, KVADDR, buf, end - start))
+            continue;
+
+        for (; i < j; i++) {
+            memcpy(&syms[i]->data, buf + (syms[i]->value - start), sizeof(ulong));
+            syms[i]->prefetched = TRUE;
+        }
+    }
+
+    xfree(buf);
+
+    if (KDEBUG(1))
+        pr_debug("prefetched %zu symbols with %d reads", n, reads);
+}
+
+void symbol_data_prefetch(void)
+{
+    symbol_data_prefetch_list(startup_symbols,
+            sizeof(startup_symbols) / sizeof(startup_symbols[0]));
+}
+
+void symbol_data_flush(void)
+{
+    size_t nr_syms = sizeof(startup_symbols) / sizeof(startup_symbols[0]);
+    struct syment *sp;
+    size_t i;
+
+    for (i = 0; i < nr_syms; i++) {
+        if ((sp = symname_hash_search(startup_symbols[i])))
+            sp->prefetched = FALSE;
+    }
+}
+
+/* the guest address get_symbol_data() reads symbol from, 0 if unknown */
+ulong symbol_data_kaddr(char *symbol)
+{
+    struct syment *sp;
+
+    if (!(sp = symbol_search(symbol)))
+        return 0;
+
+    if (kt->flags & RELOC_SET)
+        return sp->value - kt->relocate;
+
+    return sp->value;
+}
+
+/* 0 once symbol is read into local */
+int get_symbol_data(char *symbol, long size, void *local)
 {
     struct syment *sp;
 
     if ((sp = symbol_search(symbol))) {
         uint64_t addr = sp->value;
+
+        if (sp->prefetched && size <= (long)sizeof(sp->data)) {
+            memcpy(local, &sp->data, size);
+            return 0;
+        }
+
         if (kt->flags & RELOC_SET) {
             addr = addr - kt->relocate;
         }
-        readmem(addr, KVADDR, local, size);
+        return readmem(addr, KVADDR, local, size);
     }
-    else
-        pr_err("cannot resolve symbol");
+
+    pr_err("cannot resolve symbol");
+    return -1;
+}
+
+/*
+ * Text symbol table used to annotate raw kernel addresses in log text.
+ *
+ * All text symbols of System.map are relocated by the KASLR offset,
+ * sorted, and their addresses laid out in Eytzinger (BFS) order so that
+ * the binary search walks the array front to back and the next levels
+ * can be prefetched a cache line at a time.
+ */
+struct text_symtab {
+    size_t nr;              /* symbols, the last one only bounds its predecessor */
+    ulong *addr;            /* sorted runtime addresses */
+    uint32_t *name;         /* offsets into names */
+    char *names;
+    ulong *eytz;            /* addr[] in Eytzinger order, 1-based */
+    uint32_t *eytz_rank;    /* eytz[k] == addr[eytz_rank[k]] */
+};
+
+/* drop the symbols of the current session */
+/* drop the arrays of an earlier symtab_text_init() */
+static void text_symtab_free(struct text_symtab *text)
+{
+    xfree(text->addr);
+    xfree(text->name);
+    xfree(text->names);
+    xfree(text->eytz);
+    xfree(text->eytz_rank);
+    memset(text, 0, sizeof(*text));
+}
+
+void symtab_free(void)
+{
+    struct syment *sp, *next;
+    int i;
+
+    for (i = 0; i < SYMNAME_HASH; i++) {
+        for (sp = st->symname_hash[i]; sp; sp = next) {
+            next = sp->name_hash_next;
+            free(sp->name);
+            free(sp);
+        }
+        st->symname_hash[i] = NULL;
+    }
+
+    if (st->text) {
+        text_symtab_free(st->text);
+        xfree(st->text);
+        st->text = NULL;
+    }
+
+    xfree(st->map_file);
+    st->map_file = NULL;
 }
 
 void symtab_init(const char *map_file)
 {
+    /* the System.map the table was built from, kept across a fork by --batch */
+    if (st->map_file && STREQ(st->map_file, map_file))
+        return;
+
+    symtab_free();
+    st->map_file = xstrdup(map_file);
     symname_hash_init(map_file);
 
     if (kernel_symbol_exists("asm_exc_divide_error")) {
@@ -168,3 +357,216 @@ void symtab_init(const char *map_file)
 
     st->idt_table_vmlinux = symbol_value("idt_table");
 }
+
+/*
+ * The System.map symbols in use, saved with a snapshot so that it can
+ * be decoded without the map.
+ */
+void symtab_for_each(void (*fn)(const char *name, ulong value, void *arg),
+        void *arg)
+{
+    struct syment *sp;
+    int i;
+
+    for (i = 0; i < SYMNAME_HASH; i++) {
+        for (sp = st->symname_hash[i]; sp; sp = sp->name_hash_next)
+            fn(sp->name, sp->value, arg);
+    }
+}
+
+void symtab_install(const char *name, ulong value)
+{
+    struct syment *sp;
+
+    if (!symbol_needed(name) || kernel_symbol_exists((char *)name))
+        return;
+
+    sp = xcalloc(1, sizeof(struct syment));
+    sp->value = value;
+    sp->name = xstrdup(name);
+    symname_hash_install(sp);
+}
+
+struct text_sym_load {
+    ulong addr;
+    uint32_t name;
+};
+
+static int text_sym_cmp(const void *a, const void *b)
+{
+    ulong va = ((const struct text_sym_load *)a)->addr;
+    ulong vb = ((const struct text_sym_load *)b)->addr;
+
+    return (va > vb) - (va < vb);
+}
+
+static size_t text_symtab_eytzinger(size_t i, size_t k)
+{
+    if (k <= st->text->nr) {
+        i = text_symtab_eytzinger(i, 2 * k);
+        st->text->eytz[k] = st->text->addr[i];
+        st->text->eytz_rank[k] = i++;
+        i = text_symtab_eytzinger(i, 2 * k + 1);
+    }
+    return i;
+}
+
+int symtab_text_init(const char *map_file)
+{
+    struct text_sym_load *syms = NULL;
+    size_t nr = 0, max = 0, names_len = 0, names_max = 0, i, n;
+    char line[MAX_LINE_LENGTH];
+    char symbol[MAX_LINE_LENGTH];
+    char type;
+    ulong address;
+    size_t len;
+    FILE *file;
+
+    if (!(file = fopen(map_file, "r"))) {
+        pr_err("Error opening file");
+        return -1;
+    }
+
+    /* loaded again, e.g. with a new KASLR offset, nothing is reused */
+    if (st->text)
+        text_symtab_free(st->text);
+    else
+        st->text = xcalloc(1, sizeof(struct text_symtab));
+
+    while (fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "%lx %c %s", &address, &type, symbol) != 3)
+            continue;
+        if (type != 't' && type != 'T' && type != 'w' && type != 'W')
+            continue;
+
+        if (nr == max) {
+            max = max ? max * 2 : 4096;
+            syms = xrealloc(syms, max * sizeof(*syms));
+        }
+        len = strlen(symbol) + 1;
+        if (names_len + len > names_max) {
+            names_max = names_max ? names_max * 2 : 65536;
+            st->text->names = xrealloc(st->text->names, names_max);
+        }
+        memcpy(st->text->names + names_len, symbol, len);
+
+        syms[nr].addr = address;
+        if (kt->flags & RELOC_SET)
+            syms[nr].addr -= kt->relocate;
+        syms[nr].name = names_len;
+        names_len += len;
+        nr++;
+    }
+    fclose(file);
+
+    if (!nr)
+        return -1;
+
+    qsort(syms, nr, sizeof(*syms), text_sym_cmp);
+
+    st->text->addr = xmalloc(nr * sizeof(ulong));
+    st->text->name = xmalloc(nr * sizeof(uint32_t));
+    for (i = 0, n = 0; i < nr; i++) {
+        /* aliases share an address, keep the first one */
+        if (n && st->text->addr[n - 1] == syms[i].addr)
+            continue;
+        st->text->addr[n] = syms[i].addr;
+        st->text->name[n] = syms[i].name;
+        n++;
+    }
+    xfree(syms);
+
+    st->text->nr = n;
+    st->text->eytz = xmalloc((n + 1) * sizeof(ulong));
+    st->text->eytz_rank = xmalloc((n + 1) * sizeof(uint32_t));
+    text_symtab_eytzinger(0, 1);
+
+    if (KDEBUG(1))
+        pr_debug("text symbols: %zu", n);
+
+    return 0;
+}
+
+/*
+ * Find the symbol containing addr.  The search yields the first
+ * address greater than addr; its predecessor in sorted order is the
+ * containing symbol, and the greater address bounds its size.
+ */
+static int text_symbol_lookup(ulong addr, const char **name, ulong *offset, ulong *size)
+{
+    const ulong *eytz;
+    size_t nr = st->text->nr;
+    size_t k = 1, rank;
+
+    eytz = st->text->eytz;
+    if (nr < 2 || addr < st->text->addr[0] || addr >= st->text->addr[nr - 1])
+        return FALSE;
+
+    while (k <= nr) {
+        __builtin_prefetch(eytz + k * 8);
+        k = 2 * k + (eytz[k] <= addr);
+    }
+    k >>= __builtin_ffsl(~k);
+
+    rank = k ? st->text->eytz_rank[k] : nr;
+    *name = st->text->names + st->text->name[rank - 1];
+    *offset = addr - st->text->addr[rank - 1];
+    *size = st->text->addr[rank] - st->text->addr[rank - 1];
+
+    return TRUE;
+}
+
+static inline int is_word_char(char c)
+{
+    return isalnum((unsigned char)c) || c == '_';
+}
+
+/*
+ * Write text to the output with every 64-bit kernel address ("ffff" followed by
+ * twelve more hex digits, optionally 0x-prefixed) that falls inside a
+ * text symbol replaced by symbol+off/size.
+ */
+void symbol_annotate_text(const char *text, size_t len)
+{
+    const char *p = text, *end = text + len, *hit, *tok;
+    const char *name;
+    ulong addr, offset, size;
+    char buf[256];
+    int i, n;
+
+    if (!st->text || !st->text->nr) {
+        output_write(text, len);
+        return;
+    }
+
+    while (p < end && (hit = memmem(p, end - p, "ffff", 4))) {
+        tok = hit;
+        if (tok - text >= 2 && tok[-2] == '0' && (tok[-1] == 'x' || tok[-1] == 'X'))
+            tok -= 2;
+
+        if ((tok > text && is_word_char(tok[-1])) || end - hit < 16) {
+            p = hit + 1;
+            continue;
+        }
+
+        for (i = 4, addr = 0xffff; i < 16; i++) {
+            if (!isxdigit((unsigned char)hit[i]))
+                break;
+            addr = (addr << 4) | (isdigit((unsigned char)hit[i]) ?
+                    hit[i] - '0' : (tolower((unsigned char)hit[i]) - 'a' + 10));
+        }
+
+        if (i < 16 || (hit + 16 < end && is_word_char(hit[16])) ||
+                !text_symbol_lookup(addr, &name, &offset, &size)) {
+            p = hit + i;
+            continue;
+        }
+
+        output_write(text, tok - text);
+        n = snprintf(buf, sizeof(buf), "%s+0x%lx/0x%lx", name, offset, size);
+        output_write(buf, (size_t)n < sizeof(buf) ? (size_t)n : sizeof(buf) - 1);
+        text = p = hit + 16;
+    }
+
+    output_write(text, end - text);
+}
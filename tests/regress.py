@@ -0,0 +1,243 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+#
+# regress.py
+#
+# Copyright (C) 2024 Ray Lee <hburaylee@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+
+# Regression tests that need no guest: kvm-dmesg --load reads the
+# snapshots in snapshots/, written by --save from synthetic guests.
+#
+#   prb1, prb2  5.10+ ring buffer, prb2 is prb1 forty messages later;
+#               the newest record of each is still reserved by a writer
+#   prbr        prb1's kernel after a reboot, same sequence numbers
+#   var1, var2  3.5+ variable length buffer, var2 forty messages later
+#   varr        var1's kernel after a reboot, same sequence numbers
+#   leg         pre-3.5 plain text buffer
+#
+# expected/*.txt is what a plain --load prints.  The other checks are
+# made against the records of the full output; --format json and kmsg
+# keep the version banner off stdout.
+
+import json
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+KVMDMESG = "../kvm-dmesg"
+SNAPSHOTS = "snapshots"
+EXPECTED = "expected"
+
+class Colors:
+    GREEN = '\033[92m'
+    RED = '\033[91m'
+    ENDC = '\033[0m'
+
+class TestFailed(Exception):
+    pass
+
+def check(cond, what):
+    if not cond:
+        raise TestFailed(what)
+
+def snapshot(name):
+    return os.path.join(SNAPSHOTS, name + ".snap")
+
+def kvmdmesg(name, *args):
+    command = [KVMDMESG, '--load', snapshot(name)] + list(args)
+    p = subprocess.run(command, stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    check(p.returncode == 0, "%s exited with %d" % (' '.join(command), p.returncode))
+    return p.stdout, p.stderr.decode('utf-8', 'replace')
+
+def text_lines(name, *args):
+    out, _ = kvmdmesg(name, *args)
+    lines = out.decode('utf-8', 'replace').splitlines()
+    check(lines and lines[0].startswith("Linux version"), "no version banner")
+    return lines[1:]
+
+def records(name, *args):
+    out, _ = kvmdmesg(name, '--format', 'json', *args)
+    recs = []
+    for line in out.splitlines():
+        # keep "time" as printed, a float would round it
+        recs.append(json.loads(line.decode('utf-8'), parse_float=str))
+    return recs
+
+def usec(rec):
+    sec, frac = rec["time"].split('.')
+    return int(sec) * 1000000 + int(frac)
+
+def test_decoders():
+    for name in ("prb1", "var1", "leg"):
+        out, _ = kvmdmesg(name)
+        with open(os.path.join(EXPECTED, name + ".txt"), 'rb') as f:
+            check(out == f.read(), "%s differs from expected/%s.txt" % (name, name))
+
+def test_tail():
+    for name in ("prb1", "var1"):
+        full = records(name)
+        check(records(name, '--tail', '7') == full[-7:], name + " --tail 7")
+        check(records(name, '--tail', '1000') == full, name + " --tail 1000")
+        warn = [r for r in full if r["level"] <= 4]
+        check(records(name, '--tail', '5', '--level', 'warn+') == warn[-5:],
+                name + " --tail 5 --level warn+")
+
+def test_filters():
+    for name in ("prb1", "var1"):
+        full = records(name)
+        check(records(name, '--level', 'err,debug') ==
+                [r for r in full if r["level"] in (3, 7)], name + " --level")
+        check(records(name, '--level', '+notice') ==
+                [r for r in full if r["level"] >= 5], name + " --level +notice")
+        for facility, nr in (('kern', 0), ('daemon', 3)):
+            check(records(name, '--facility', facility) ==
+                    [r for r in full if r["facility"] == nr],
+                    name + " --facility " + facility)
+
+    full = records("prb1")
+    callers = sorted(set(r["caller"] for r in full[:20]))[:2]
+    check(records("prb1", '--caller', ','.join(callers)) ==
+            [r for r in full if r["caller"] in callers], "prb1 --caller")
+
+def test_seek():
+    for name in ("prb1", "var1"):
+        full = records(name)
+        first, last = full[40]["seq"], full[120]["seq"]
+        check(records(name, '--seq', '%d-%d' % (first, last)) == full[40:121],
+                name + " --seq")
+        check(records(name, '--seq', '%d-' % last) == full[120:],
+                name + " --seq FIRST-")
+
+        since, until = usec(full[60]), usec(full[150]) - 1
+        got = records(name, '--since', '%d.%06d' % divmod(since, 1000000),
+                '--until', '%d.%06d' % divmod(until, 1000000))
+        check(got == [r for r in full if since <= usec(r) <= until],
+                name + " --since/--until")
+
+        # the seek must not skip what the text filter would print
+        got = records(name, '--seq', '%d-%d' % (first, last), '--grep', 'Oops')
+        check(got == [r for r in full[40:121] if "Oops" in r["msg"]],
+                name + " --seq --grep")
+
+def grep_context(recs, pattern, context):
+    """The runs of records --grep PATTERN --context CONTEXT prints."""
+    keep = set()
+    for i, r in enumerate(recs):
+        if pattern in r["msg"]:
+            keep.update(range(max(0, i - context), min(len(recs), i + context + 1)))
+    runs = []
+    for i in sorted(keep):
+        if not runs or i != runs[-1][-1] + 1:
+            runs.append([])
+        runs[-1].append(i)
+    return [[recs[i] for i in run] for run in runs]
+
+def test_grep_context():
+    for name in ("prb1", "var1"):
+        full = records(name)
+        for context in (0, 1, 3):
+            args = ('--grep', 'lockup', '--context', str(context))
+            runs = grep_context(full, "lockup", context)
+            check(records(name, *args) == [r for run in runs for r in run],
+                    name + " --grep lockup --context %d" % context)
+
+            # text output puts "--" between runs that are not adjacent
+            lines = text_lines(name, *args)
+            check(lines.count("--") == (len(runs) - 1 if context else 0),
+                    name + " --context %d separators" % context)
+
+        got = records(name, '--grep', 'lockup', '--grep', 'hung_task')
+        check(got == [r for r in full if "lockup" in r["msg"] or "hung_task" in r["msg"]],
+                name + " two --grep patterns")
+
+def test_json_kmsg():
+    for name in ("prb1", "var1"):
+        out, _ = kvmdmesg(name, '--format', 'json')
+        for line in out.splitlines():
+            line.decode('utf-8')            # raises if not valid UTF-8
+            json.loads(line)
+        recs = records(name)
+        check(len(recs) == len(records(name, '--tail', '1000')), name + " json")
+        seqs = [r["seq"] for r in recs]
+        check(seqs == sorted(seqs), name + " json seq order")
+
+        out, _ = kvmdmesg(name, '--format', 'kmsg')
+        heads = [l for l in out.decode('utf-8', 'replace').split('\n')
+                if l and not l.startswith(' ')]
+        check(len(heads) == len(recs), name + " kmsg record count")
+        for head, r in zip(heads, recs):
+            m = re.match(r'(\d+),(\d+),(\d+),([-c])[;,]', head)
+            check(m, name + " kmsg header: " + head[:40])
+            check(int(m.group(1)) == r["facility"] * 8 + r["level"] and
+                    int(m.group(2)) == r["seq"] and int(m.group(3)) == usec(r),
+                    name + " kmsg header seq %d" % r["seq"])
+
+def test_cursor():
+    for old, new, reboot in (("prb1", "prb2", "prbr"), ("var1", "var2", "varr")):
+        with tempfile.TemporaryDirectory() as tmp:
+            cursor = os.path.join(tmp, "cursor")
+
+            check(records(old, '--cursor', cursor) == records(old),
+                    old + " --cursor first run")
+            check(records(old, '--cursor', cursor) == [],
+                    old + " --cursor nothing new")
+
+            last = records(old)[-1]["seq"]
+            check(records(new, '--cursor', cursor) ==
+                    [r for r in records(new) if r["seq"] > last],
+                    new + " --cursor resume")
+
+            # same sequence numbers, other timestamps: a reboot
+            out, err = kvmdmesg(reboot, '--cursor', cursor, '--format', 'json')
+            check("rebooted" in err, reboot + " --cursor reboot warning")
+            check(len(out.splitlines()) == len(records(reboot)),
+                    reboot + " --cursor starts over")
+
+TESTS = [
+    test_decoders,
+    test_tail,
+    test_filters,
+    test_seek,
+    test_grep_context,
+    test_json_kmsg,
+    test_cursor,
+]
+
+def test_all():
+    nr_passed = 0
+    for test in TESTS:
+        try:
+            test()
+            nr_passed += 1
+            print(Colors.GREEN + "ok     " + Colors.ENDC + test.__name__)
+        except (TestFailed, subprocess.SubprocessError, ValueError) as e:
+            print(Colors.RED + "FAILED " + Colors.ENDC + "%s: %s" % (test.__name__, e))
+
+    nr_tests = len(TESTS)
+    if nr_passed == nr_tests:
+        print("\n" + Colors.GREEN + f"Tests {nr_passed}/{nr_tests} passed!" + Colors.ENDC)
+        return 0
+    print("\n" + Colors.RED + f"Tests {nr_tests - nr_passed}/{nr_tests} failed." + Colors.ENDC)
+    return 1
+
+if __name__ == "__main__":
+    # the binary may be given, e.g. from a meson build directory
+    if len(sys.argv) > 1:
+        KVMDMESG = os.path.abspath(sys.argv[1])
+    os.chdir(os.path.dirname(os.path.abspath(__file__)))
+    if not os.path.exists(KVMDMESG):
+        print("Error: kvm-dmesg does not exist, run make first.")
+        sys.exit(1)
+    sys.exit(test_all())
@@ -0,0 +1,142 @@
+/* text_clean_span.c
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * Check every vector text_clean_span() routine against the scalar one,
+ * for each byte class, at every length and alignment up to a few
+ * vectors long.  output.c is included to reach its static routines.
+ */
+#include "../output.c"
+
+#define MAX_LEN         (100)
+#define ALIGNMENTS      (32)
+#define ROUNDS          (2000)
+
+typedef size_t (*span_fn)(const unsigned char *, size_t, int);
+
+/* the bytes either side of each class boundary */
+static const unsigned char edge_bytes[] = {
+    0x00, 0x01, 0x08, 0x09, 0x0a, 0x0d, 0x0e, 0x1f, 0x20, 0x21, '"', '\\',
+    'a', 0x7e, 0x7f, 0x80, 0x81, 0xc3, 0xfe, 0xff,
+};
+
+static const char *class_names[TEXT_CLASSES] = {
+    "printable", "ascii", "json", "kmsg",
+};
+
+static unsigned int seed = 1;
+
+static unsigned int next_rand(void)
+{
+    seed = seed * 1103515245 + 12345;
+    return seed >> 16;
+}
+
+/*
+ * Mostly clean text with a few edge bytes, so that spans of every
+ * length come up.
+ */
+static void fill(unsigned char *p, size_t len, int class)
+{
+    const unsigned char *table = text_class_table[class];
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (next_rand() % 16)
+            p[i] = 'a' + next_rand() % 26;
+        else
+            p[i] = edge_bytes[next_rand() % sizeof(edge_bytes)];
+    }
+
+    /* now and then a run that is clean to the end */
+    if (next_rand() % 4 == 0)
+        for (i = 0; i < len; i++)
+            if (!table[p[i]])
+                p[i] = 'x';
+}
+
+static int check(const char *name, span_fn fn)
+{
+    static unsigned char buf[ALIGNMENTS + MAX_LEN];
+    size_t len, off, want, got;
+    int class, round, failed = 0;
+
+    for (class = 0; class < TEXT_CLASSES; class++) {
+        for (round = 0; round < ROUNDS; round++) {
+            len = next_rand() % (MAX_LEN + 1);
+            off = next_rand() % ALIGNMENTS;
+            fill(buf + off, len, class);
+
+            want = text_clean_span_scalar(buf + off, len, class);
+            got = fn(buf + off, len, class);
+            if (got != want) {
+                fprintf(stderr, "%s: %s class, length %zu at offset %zu: "
+                        "%zu, expected %zu\n", name, class_names[class],
+                        len, off, got, want);
+                failed++;
+            }
+        }
+
+        /* every single bad byte at every position */
+        for (len = 1; len <= 64; len++) {
+            for (off = 0; off < len; off++) {
+                size_t b;
+
+                for (b = 0; b < sizeof(edge_bytes); b++) {
+                    memset(buf, 'a', len);
+                    buf[off] = edge_bytes[b];
+                    want = text_clean_span_scalar(buf, len, class);
+                    got = fn(buf, len, class);
+                    if (got != want) {
+                        fprintf(stderr, "%s: %s class, byte 0x%02x at %zu "
+                                "of %zu: %zu, expected %zu\n", name,
+                                class_names[class], edge_bytes[b], off, len,
+                                got, want);
+                        failed++;
+                    }
+                }
+            }
+        }
+    }
+
+    printf("%-9s %s\n", name, failed ? "FAILED" : "ok");
+    return failed;
+}
+
+static size_t text_clean_span_api(const unsigned char *p, size_t len, int class)
+{
+    return text_clean_span((const char *)p, len, class);
+}
+
+int main(void)
+{
+    int failed = 0;
+
+    /* fills text_class_table[] and picks the routine */
+    text_clean_span_init(NULL, 0, TEXT_PRINTABLE);
+
+#ifdef __SSE2__
+    failed += check("sse2", text_clean_span_sse2);
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2"))
+        failed += check("avx2", text_clean_span_avx2);
+    else
+        printf("%-9s skipped, no avx2\n", "avx2");
+#endif
+    failed += check("selected", text_clean_span_api);
+
+    return failed ? 1 : 0;
+}
@@ -15,6 +15,7 @@
 
 #include "version.h"
 #include "defs.h"
+#include "output.h"
 #include "log.h"
 #include <stdlib.h>
 
@@ -57,6 +58,9 @@ parse_kernel_version(char *str)
 		kt->kernel_version[2] = atoi(p1);
 	}
 
-	fprintf(fp, "Linux version: v%d.%d.%d\n", kt->kernel_version[0],
-			kt->kernel_version[1], kt->kernel_version[2]);
+	/* structured output carries records only, the library nothing */
+	if (pc->format != FORMAT_RECORD)
+		fprintf(pc->format == FORMAT_TEXT ? fp : stderr,
+				"Linux version: v%d.%d.%d\n", kt->kernel_version[0],
+				kt->kernel_version[1], kt->kernel_version[2]);
 }
@@ -0,0 +1,338 @@
+/* vmcoreinfo.c
+ *
+ * Copyright (C) 2024 Ray Lee
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdlib.h>
+
+#include "xutil.h"
+#include "client.h"
+#include "log.h"
+#include "defs.h"
+#include "session.h"
+
+/*
+ * The guest's vmcoreinfo note is read once and split into an
+ * open-addressing table keyed by (type, name).  Keys and string values
+ * are views into the copy of the note, numeric values are decoded up
+ * front, so that SIZE()/OFFSET() lookups neither scan the note nor
+ * allocate.  Each session has its own table.
+ */
+struct vmcoreinfo_entry {
+    const char *key;
+    const char *value;
+    unsigned short key_len;
+    unsigned short value_len;
+    unsigned char type;
+    ulong num;                      /* SYMBOL() addresses need all 64 bits */
+};
+
+#define VMCOREINFO_HASH_SIZE  (1024)
+#define VMCOREINFO_HASH_MASK  (VMCOREINFO_HASH_SIZE - 1)
+
+struct vmcoreinfo_table {
+    char *buf;
+    struct vmcoreinfo_entry hash[VMCOREINFO_HASH_SIZE];
+    int entries;
+};
+
+static const struct {
+    const char *prefix;
+    size_t len;
+    int type;
+    int base;
+} vmcoreinfo_prefixes[] = {
+    { "SIZE(",   5, VMCOREINFO_SIZE,   10 },
+    { "OFFSET(", 7, VMCOREINFO_OFFSET, 10 },
+    { "SYMBOL(", 7, VMCOREINFO_SYMBOL, 16 },
+    { "NUMBER(", 7, VMCOREINFO_NUMBER, 10 },
+    { "LENGTH(", 7, VMCOREINFO_LENGTH, 10 },
+};
+
+static inline uint32_t vmcoreinfo_hash_update(uint32_t h, const char *s, size_t len)
+{
+    while (len--) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static inline uint32_t vmcoreinfo_hash_seed(int type)
+{
+    return (2166136261u ^ (uint32_t)type) * 16777619u;
+}
+
+static void vmcoreinfo_insert(struct vmcoreinfo_table *v, int type,
+        const char *key, size_t key_len, const char *value, size_t value_len,
+        int base)
+{
+    struct vmcoreinfo_entry *e;
+    uint32_t h;
+
+    if (v->entries >= VMCOREINFO_HASH_SIZE / 2) {
+        pr_warning("vmcoreinfo: too many entries, ignoring %.*s",
+                (int)key_len, key);
+        return;
+    }
+
+    h = vmcoreinfo_hash_update(vmcoreinfo_hash_seed(type), key, key_len);
+    for (;; h++) {
+        e = &v->hash[h & VMCOREINFO_HASH_MASK];
+        if (!e->key)
+            break;
+        /* the kernel never emits a key twice, keep the first one */
+        if (e->type == type && e->key_len == key_len &&
+                !memcmp(e->key, key, key_len))
+            return;
+    }
+
+    e->key = key;
+    e->key_len = key_len;
+    e->value = value;
+    e->value_len = value_len;
+    e->type = type;
+    e->num = base ? strtoul(value, NULL, base) : 0;
+    v->entries++;
+}
+
+static void vmcoreinfo_parse(struct vmcoreinfo_table *v, const char *buf,
+        size_t size)
+{
+    const char *line, *end, *eq, *key, *close;
+    size_t key_len, i;
+    int type, base;
+
+    for (line = buf; line < buf + size; line = end + 1) {
+        if (!(end = memchr(line, '\n', buf + size - line)))
+            end = buf + size;
+        if (!(eq = memchr(line, '=', end - line)))
+            continue;
+
+        type = VMCOREINFO_STRING;
+        base = 0;
+        key = line;
+        key_len = eq - line;
+
+        for (i = 0; i < sizeof(vmcoreinfo_prefixes) / sizeof(vmcoreinfo_prefixes[0]); i++) {
+            if (key_len > vmcoreinfo_prefixes[i].len &&
+                    !memcmp(line, vmcoreinfo_prefixes[i].prefix, vmcoreinfo_prefixes[i].len) &&
+                    (close = memchr(line, ')', key_len)) && close == eq - 1) {
+                type = vmcoreinfo_prefixes[i].type;
+                base = vmcoreinfo_prefixes[i].base;
+                key = line + vmcoreinfo_prefixes[i].len;
+                key_len = close - key;
+                break;
+            }
+        }
+
+        vmcoreinfo_insert(v, type, key, key_len, eq + 1, end - eq - 1, base);
+    }
+
+    if (KDEBUG(1))
+        pr_debug("vmcoreinfo: %d entries", v->entries);
+}
+
+/*
+ * Look up "name" (or "name.member" when member is not NULL) of the given
+ * type without building the key string.
+ */
+static struct vmcoreinfo_entry *vmcoreinfo_find(int type,
+        const char *name, const char *member)
+{
+    struct vmcoreinfo_table *v = session->vmcoreinfo;
+    struct vmcoreinfo_entry *e;
+    size_t name_len, member_len = 0, key_len;
+    uint32_t h;
+
+    if (!v || !v->entries || !name)
+        return NULL;
+
+    name_len = strlen(name);
+    key_len = name_len;
+    h = vmcoreinfo_hash_update(vmcoreinfo_hash_seed(type), name, name_len);
+    if (member) {
+        member_len = strlen(member);
+        key_len += 1 + member_len;
+        h = vmcoreinfo_hash_update(h, ".", 1);
+        h = vmcoreinfo_hash_update(h, member, member_len);
+    }
+
+    for (;; h++) {
+        e = &v->hash[h & VMCOREINFO_HASH_MASK];
+        if (!e->key)
+            return NULL;
+        if (e->type != type || e->key_len != key_len)
+            continue;
+        if (memcmp(e->key, name, name_len))
+            continue;
+        if (member && (e->key[name_len] != '.' ||
+                    memcmp(e->key + name_len + 1, member, member_len)))
+            continue;
+        return e;
+    }
+}
+
+const char *vmcoreinfo_lookup(int type, const char *name, size_t *len)
+{
+    struct vmcoreinfo_entry *e;
+
+    if (!(e = vmcoreinfo_find(type, name, NULL)))
+        return NULL;
+
+    if (len)
+        *len = e->value_len;
+    return e->value;
+}
+
+int vmcoreinfo_get(int type, const char *name, const char *member, long *value)
+{
+    struct vmcoreinfo_entry *e;
+
+    if (!(e = vmcoreinfo_find(type, name, member)))
+        return FALSE;
+
+    *value = (long)e->num;
+    return TRUE;
+}
+
+long vmcoreinfo_size(const char *name)
+{
+    long value = 0;
+
+    vmcoreinfo_get(VMCOREINFO_SIZE, name, NULL, &value);
+    return value;
+}
+
+long vmcoreinfo_offset(const char *name, const char *member)
+{
+    long value = 0;
+
+    vmcoreinfo_get(VMCOREINFO_OFFSET, name, member, &value);
+    return value;
+}
+
+ulong vmcoreinfo_symbol(const char *name)
+{
+    struct vmcoreinfo_entry *e;
+
+    if (!(e = vmcoreinfo_find(VMCOREINFO_SYMBOL, name, NULL)))
+        return 0;
+    return e->num;
+}
+
+long vmcoreinfo_number(const char *name)
+{
+    long value = 0;
+
+    vmcoreinfo_get(VMCOREINFO_NUMBER, name, NULL, &value);
+    return value;
+}
+
+long vmcoreinfo_length(const char *name)
+{
+    long value = 0;
+
+    vmcoreinfo_get(VMCOREINFO_LENGTH, name, NULL, &value);
+    return value;
+}
+
+char *vmcoreinfo_read_string(const char *key)
+{
+    const char *value;
+    char *value_string;
+    size_t value_length;
+
+    if (!(value = vmcoreinfo_lookup(VMCOREINFO_STRING, key, &value_length)))
+        return NULL;
+
+    value_string = xcalloc(value_length + 1, sizeof(char));
+    memcpy(value_string, value, value_length);
+    value_string[value_length] = '\0';
+
+    return value_string;
+}
+
+long datatype_info(char *name, char *member, int datatype)
+{
+    if (datatype == STRUCT_SIZE_REQUEST)
+        return vmcoreinfo_size(name);
+    else if (datatype == MEMBER_OFFSET_REQUEST)
+        return vmcoreinfo_offset(name, member);
+
+    return 0;
+}
+
+void vmcoreinfo_free(void)
+{
+    if (!session->vmcoreinfo)
+        return;
+
+    xfree(session->vmcoreinfo->buf);
+    xfree(session->vmcoreinfo);
+    session->vmcoreinfo = NULL;
+}
+
+void vmcoreinfo_init()
+{
+    struct vmcoreinfo_table *v;
+    char *buf;
+    size_t vmcoreinfo_size;
+    ulong vmcoreinfo_data;
+    ulong osrelease;
+
+    // ASCII value of "OSRELEAS"
+    // crash> rd vmcoreinfo_data 1
+    // ffffffffbd56ca60:  5341454c4552534f                    OSRELEAS
+    osrelease=0x5341454c4552534f;
+
+    get_symbol_data("vmcoreinfo_size", sizeof(vmcoreinfo_size), &vmcoreinfo_size);
+    vmcoreinfo_size &= ((1<<13) - 1);
+
+    vmcoreinfo_free();
+    v = session->vmcoreinfo = xcalloc(1, sizeof(*v));
+    buf = v->buf = xmalloc(vmcoreinfo_size + 1);
+
+    get_symbol_data("vmcoreinfo_data", sizeof(vmcoreinfo_data), &vmcoreinfo_data);
+
+    // For legacy kernels like CentOS 3.10.x, the type of vmcoreinfo_data is string array
+    // instead of char pointer, get_symbol_data would simply return the string itself
+    // instead of address, which is not what we want.
+    //
+    // The best way to deal with it is get vmcoreinfo_data data type via tools like
+    // gdb, just like crash utility
+    if (vmcoreinfo_data == osrelease)
+    {
+        vmcoreinfo_data = symbol_value("vmcoreinfo_data");
+        vmcoreinfo_data -= kt->relocate;
+    }
+
+    if (readmem(vmcoreinfo_data, KVADDR, buf, vmcoreinfo_size)) {
+        pr_err("cannot read vmcoreinfo_data\n");
+        goto err;
+    }
+
+    buf[vmcoreinfo_size] = '\n';
+
+    if (KDEBUG(2)) {
+        for (size_t i = 0; i < vmcoreinfo_size; i++) {
+            fprintf(fp, "%c", buf[i]);
+        }
+        fprintf(fp, "\n");
+    }
+
+    vmcoreinfo_parse(v, buf, vmcoreinfo_size);
+    return;
+err:
+    vmcoreinfo_free();
+}
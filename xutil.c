@@ -30,9 +30,18 @@
 
 #define FATAL(format, ...) do {                 \
         fprintf(stderr, format, ##__VA_ARGS__); \
-        exit(EXIT_FAILURE);                     \
+        xfatal();                               \
 } while (0)
 
+__thread jmp_buf *xfatal_jmp;
+
+void xfatal(void)
+{
+    if (xfatal_jmp)
+        longjmp(*xfatal_jmp, 1);
+    exit(EXIT_FAILURE);
+}
+
 void *xmalloc(unsigned int size)
 {
     void *ptr = malloc(size);
@@ -184,7 +193,7 @@ void daemonize(void)
             exit(EXIT_SUCCESS);
     }
 
-    if ((sid = setsid()) == EPERM) {
+    if ((sid = setsid()) == -1) {
         FATAL("setsid()\n");
     }
 
@@ -17,6 +17,7 @@
 #define __XUTIL_H__
 
 #include <stddef.h>
+#include <setjmp.h>
 #include <sys/types.h>
 
 #ifndef offsetof
@@ -27,6 +28,13 @@
 
 #define strcaseeq(s1, s2) (!strcasecmp((s1), (s2)))
 
+/*
+ * Where a fatal error (out of memory) goes instead of exit(): set by the
+ * library around each call, so that the call fails and the caller lives.
+ */
+extern __thread jmp_buf *xfatal_jmp;
+
+void xfatal(void) __attribute__((noreturn));
 void *xmalloc(unsigned int size);
 void *xcalloc(unsigned int numb, unsigned int size);
 void *xrealloc(void *old, unsigned int size);